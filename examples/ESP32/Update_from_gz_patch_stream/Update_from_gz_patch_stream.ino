@@ -0,0 +1,185 @@
+/*\
+ *
+ * Update_from_gz_patch_stream.ino
+ * Example code for ESP32-targz
+ * https://github.com/tobozo/ESP32-targz
+ *
+\*/
+
+#ifndef ESP32
+  #error "gzStreamPatchUpdater is only available on ESP32 architecture"
+#endif
+
+// Set **source** filesystem by uncommenting one of these:
+//#define DEST_FS_USES_SPIFFS
+#define DEST_FS_USES_LITTLEFS
+#include <ESP32-targz.h>
+#include <WiFi.h>
+#include <HTTPClient.h>
+#include <WiFiClientSecure.h>
+#include <rom/rtc.h> // to get reset reason
+HTTPClient http;
+
+// 1) Flash this sketch (or any other) and keep a copy of the firmware binary it was built with, this is the
+//    running firmware the patch will be applied to:
+//        $ cp /tmp/arduino_build_xxxxxx/Your_Sketch.ino.bin running_firmware.bin
+//
+// 2) Build the new firmware and make the delta patch between both binaries:
+//        $ python3 extras/mkpatch.py running_firmware.bin new_firmware.bin patch.gz
+//
+// 3) Choose where the patch is read from by uncommenting one of those defines:
+//      - TEST_PATCH_FROM_FS: "/patch.gz" on the filesystem (e.g. uploaded with the data folder)
+//      - TEST_PATCH_FROM_HTTP: patchURL published on a web server
+//
+#define TEST_PATCH_FROM_FS
+//#define TEST_PATCH_FROM_HTTP
+//
+// 4) Edit the value of "const char* patchURL" in this sketch to match the url to the patch file (HTTP only)
+//
+// 5) Setup WIFI_SSID and WIFI_PASS if necessary (HTTP only, optional if your ESP32 had a previous successful connection to WiFi)
+//
+//#define WIFI_SSID "blahSSID"
+//#define WIFI_PASS "blahPASSWORD"
+//
+// 6) Press reset: the patch is only applied if it was made from the running firmware, otherwise
+//    the update stops with ESP32_TARGZ_PATCH_SOURCE_MISMATCH before anything is written.
+//
+
+
+#if (defined TEST_PATCH_FROM_FS && defined TEST_PATCH_FROM_HTTP ) || (!defined TEST_PATCH_FROM_FS && !defined TEST_PATCH_FROM_HTTP )
+
+  #error "Please define either TEST_PATCH_FROM_FS or TEST_PATCH_FROM_HTTP"
+
+#endif
+
+const char* patchFile = "/patch.gz";
+const char* patchURL  = "https://example.com/firmware/patch.gz"; // change this to your own patch url
+
+const char *certificate = NULL; // change this as needed, leave as is for no TLS check (yolo security)
+
+
+void stubbornConnect()
+{
+  uint8_t wifi_retry_count = 0;
+  uint8_t max_retries = 10;
+  unsigned long stubbornness_factor = 3000; // ms to wait between attempts
+
+  Serial.print( "MAC Address: " );
+  Serial.println(WiFi.macAddress());
+
+  while (WiFi.status() != WL_CONNECTED && wifi_retry_count < max_retries) {
+    #if defined WIFI_SSID && defined WIFI_PASS
+      WiFi.begin( WIFI_SSID, WIFI_PASS ); // put your ssid / pass if required, only needed once
+    #else
+      WiFi.begin();
+    #endif
+    Serial.printf(" => WiFi connect - Attempt No. %d\n", wifi_retry_count+1);
+    delay( stubbornness_factor );
+    wifi_retry_count++;
+  }
+  if(wifi_retry_count >= max_retries ) {
+    Serial.println("no connection, forcing restart");
+    ESP.restart();
+  }
+  if (WiFi.waitForConnectResult() == WL_CONNECTED){
+    Serial.println("Connected as");
+    Serial.println(WiFi.localIP());
+  }
+}
+
+
+WiFiClient *getPatchClientPtr( WiFiClientSecure *client, const char* url, const char *cert = NULL )
+{
+  if( cert == NULL ) client->setInsecure();
+  else client->setCACert( cert );
+  const char* UserAgent = "ESP32-HTTP-GzPatchUpdater-Client";
+  http.setReuse(true); // handle 301 redirects gracefully
+  http.setUserAgent( UserAgent );
+  http.setConnectTimeout( 10000 ); // 10s timeout = 10000
+  if( ! http.begin(*client, url ) ) {
+    log_e("Can't open url %s", url );
+    return nullptr;
+  }
+  const char * headerKeys[] = {"location", "redirect", "Content-Type", "Content-Length", "Content-Disposition" };
+  const size_t numberOfHeaders = 5;
+  http.collectHeaders(headerKeys, numberOfHeaders);
+  int httpCode = http.GET();
+  // file found at server
+  if (httpCode == HTTP_CODE_FOUND || httpCode == HTTP_CODE_MOVED_PERMANENTLY) {
+    String newlocation = "";
+    String headerLocation = http.header("location");
+    String headerRedirect = http.header("redirect");
+    if( headerLocation !="" ) {
+      newlocation = headerLocation;
+      Serial.printf("302 (location): %s => %s\n", url, headerLocation.c_str());
+    } else if ( headerRedirect != "" ) {
+      Serial.printf("301 (redirect): %s => %s\n", url, headerLocation.c_str());
+      newlocation = headerRedirect;
+    }
+    http.end();
+    if( newlocation != "" ) {
+      log_w("Found 302/301 location header: %s", newlocation.c_str() );
+      return getPatchClientPtr( client, newlocation.c_str(), cert );
+    } else {
+      log_e("Empty redirect !!");
+      return nullptr;
+    }
+  }
+  if( httpCode != 200 ) return nullptr;
+  return http.getStreamPtr();
+}
+
+
+void setup()
+{
+
+  Serial.begin( 115200 );
+
+  if( rtc_get_reset_reason(0) != 1 ) // software reset or crash
+  {
+    Serial.println("Press reset to restart test");
+    return;
+  }
+
+  #if defined TEST_PATCH_FROM_FS
+    tarGzFS.begin();
+    if( !tarGzFS.exists( patchFile ) ) {
+      Serial.printf("%s isn't there\n", patchFile );
+      return;
+    }
+    fs::File file = tarGzFS.open( patchFile, "r" );
+    if (!file) {
+      Serial.println("Can't open file");
+      return;
+    }
+    Stream *streamptr = &file;
+  #else // TEST_PATCH_FROM_HTTP
+    stubbornConnect();
+    WiFiClientSecure *client = new WiFiClientSecure;
+    Stream *streamptr = getPatchClientPtr( client, patchURL, certificate );
+  #endif
+
+  if( streamptr != nullptr ) {
+    GzUnpacker *Unpacker = new GzUnpacker();
+    Unpacker->setGzProgressCallback( BaseUnpacker::defaultProgressCallback );
+    if( !Unpacker->gzStreamPatchUpdater( streamptr, false ) ) {
+      int err = Unpacker->tarGzGetError();
+      if( err == ESP32_TARGZ_PATCH_SOURCE_MISMATCH ) {
+        Serial.println("This patch was not made for the running firmware");
+      }
+      Serial.printf("gzStreamPatchUpdater failed with return code #%d\n", err );
+    } else {
+      Serial.println("Update successful, now loading the new firmware!");
+      ESP.restart();
+    }
+  } else {
+    Serial.println("Failed to establish http connection");
+  }
+
+}
+
+
+void loop()
+{
+
+}
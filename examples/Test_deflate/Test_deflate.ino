@@ -13,6 +13,13 @@
 // const char *inputFilename = "/tiny.json"; // 32 bytes of JSON (tiny file, deflated output should be bigger than the original)
 const char *inputFilename = "/big.json"; // 52 KB of non-minified JSON (deflated output should be 50~80% smaller)
 const char *fzFileName = "/out.gz";
+const char *tgzFileName = "/out.tar.gz";
+const char *untarFolder = "/untar";
+const char *msgFileName = "/msg.json";
+const char *csvFileName = "/out.csv";
+const char *logDir = "/logs";
+const char *binFileName = "/ESP32-targz.bmp"; // binary input for the filters
+const char *unzFileName = "/out.bin";
 
 File src;
 File dst;
@@ -186,6 +193,310 @@ void testBufferToStream()
 }
 
 
+void testLevels()
+{
+  Serial.println();
+  Serial.println("### Compression levels ###");
+
+  const int levels[] = { 0, 1, 6, 9 };
+
+  for( int level : levels )
+  {
+    unsigned long started = millis();
+    size_t dstLen = LZPacker::compress( &tarGzFS, inputFilename, &tarGzFS, fzFileName, level );
+    unsigned long elapsed = millis() - started;
+
+    if( dstLen==0 ) {
+      Serial.printf("[testLevels] Failed to compress at level %d, halting\n", level);
+      while(1) yield();
+    }
+
+    Serial.printf("[testLevels] Level %d: deflated to %d bytes in %lu ms\n", level, dstLen, elapsed );
+
+    verify(fzFileName, inputFilename);
+
+    tarGzFS.remove(fzFileName);
+  }
+}
+
+
+
+void testOptimalLevel()
+{
+  Serial.println();
+  Serial.println("### Optimal parsing (level 10) ###");
+
+  // slow and memory hungry: the compressor falls back to smaller layouts and to level 9 parsing when RAM is short
+  unsigned long started = millis();
+  size_t dstLen = LZPacker::compress( &tarGzFS, inputFilename, &tarGzFS, fzFileName, 10 );
+  unsigned long elapsed = millis() - started;
+
+  if( dstLen==0 ) {
+    Serial.println("[testOptimalLevel] Failed to compress at level 10, halting");
+    while(1) yield();
+  }
+
+  Serial.printf("[testOptimalLevel] Level 10: deflated to %d bytes in %lu ms\n", dstLen, elapsed );
+
+  verify(fzFileName, inputFilename);
+
+  tarGzFS.remove(fzFileName);
+}
+
+
+
+void testTarGzLevels()
+{
+  Serial.println();
+  Serial.println("### TarGz compression levels ###");
+
+  fin = tarGzFS.open(inputFilename, "r");
+  if(!fin)
+  {
+    Serial.println("[testTarGzLevels] Unable to read input file, halting");
+    while(1) yield();
+  }
+  std::vector<TAR::dir_entity_t> dirEntities = { { inputFilename, false, fin.size() } };
+  fin.close();
+
+  String untarFileName = String(untarFolder) + String(inputFilename);
+
+  const int levels[] = { 0, 1, 6, 9 };
+
+  for( int level : levels )
+  {
+    int dstLen = TarGzPacker::compress( &tarGzFS, dirEntities, &tarGzFS, tgzFileName, nullptr, level );
+
+    if( dstLen<=0 ) {
+      Serial.printf("[testTarGzLevels] Failed to compress at level %d, halting\n", level);
+      while(1) yield();
+    }
+
+    Serial.printf("[testTarGzLevels] Level %d: packed to %d bytes\n", level, dstLen );
+
+    TarGzUnpacker *TARGZUnpacker = new TarGzUnpacker();
+    TARGZUnpacker->haltOnError( true );
+    if( !TARGZUnpacker->tarGzExpanderNoTempFile( tarGzFS, tgzFileName, tarGzFS, untarFolder ) ) {
+      Serial.printf("[testTarGzLevels] Failed to unpack level %d archive (error %d), halting\n", level, TARGZUnpacker->tarGzGetError() );
+      while(1) yield();
+    }
+    delete TARGZUnpacker;
+
+    compareFiles(untarFileName.c_str(), inputFilename);
+
+    tarGzFS.remove(untarFileName.c_str());
+    tarGzFS.remove(tgzFileName);
+  }
+
+  tarGzFS.rmdir(untarFolder);
+}
+
+
+void testDictionary()
+{
+  Serial.println();
+  Serial.println("### Preset dictionary ###");
+
+  const char* dict = "{\"device_id\":\"esp32-0001\",\"temperature\":21.5,\"humidity\":45.2,\"status\":\"ok\"}";
+
+  if( !LZPacker::setDictionary( (uint8_t*)dict, strlen(dict) ) ) {
+    Serial.println("[testDictionary] Failed to set dictionary, halting");
+    while(1) yield();
+  }
+
+  for( int i=0; i<5; i++ )
+  {
+    char json[128];
+    size_t jsonLen = snprintf(json, sizeof(json), "{\"device_id\":\"esp32-%04d\",\"temperature\":%d.%d,\"humidity\":%d.5,\"status\":\"%s\"}",
+      i+1, 19+i, (i*7)%10, 40+i*3, i==3?"low battery":"ok" );
+
+    uint8_t* dstBuf = NULL;
+    size_t dstBufLen = LZPacker::compressWithDict( (uint8_t*)json, jsonLen, &dstBuf );
+
+    if( dstBufLen==0 ) {
+      Serial.printf("[testDictionary] Failed to compress message #%d, halting\n", i);
+      while(1) yield();
+    }
+
+    Serial.printf("[testDictionary] Message #%d: %d bytes to %d bytes\n", i, jsonLen, dstBufLen );
+
+    saveBufferToFile( dstBuf, dstBufLen, fzFileName );
+    saveBufferToFile( (uint8_t*)json, jsonLen, msgFileName );
+    free(dstBuf);
+
+    verify(fzFileName, msgFileName, (uint8_t*)dict, strlen(dict));
+
+    tarGzFS.remove(fzFileName);
+    tarGzFS.remove(msgFileName);
+  }
+
+  LZPacker::freeDictionary();
+}
+
+
+void testGzipPrint()
+{
+  Serial.println();
+  Serial.println("### GzipPrint ###");
+
+  dst = tarGzFS.open(fzFileName, "w");
+  src = tarGzFS.open(csvFileName, "w"); // uncompressed copy for verification
+  if(!dst || !src)
+  {
+    Serial.println("[testGzipPrint] Unable to create output files, halting");
+    while(1) yield();
+  }
+
+  LZPacker::GzipPrint gz(&dst);
+  size_t srcLen = 0;
+  for( int i=0; i<1000; i++ )
+  {
+    gz.printf("%d,%d,%d\n", i, (i*37)%1000, i%7==0 );
+    srcLen += src.printf("%d,%d,%d\n", i, (i*37)%1000, i%7==0 );
+  }
+
+  if( !gz.end() ) {
+    Serial.println("[testGzipPrint] Failed to end the gzip stream, halting");
+    while(1) yield();
+  }
+
+  Serial.printf("[testGzipPrint] Deflated %d bytes to %d bytes\n", srcLen, gz.size() );
+
+  dst.close();
+  src.close();
+
+  verify(fzFileName, csvFileName);
+
+  tarGzFS.remove(fzFileName);
+  tarGzFS.remove(csvFileName);
+}
+
+
+void testGzipLogRotator()
+{
+  Serial.println();
+  Serial.println("### GzipLogRotator ###");
+
+  src = tarGzFS.open(csvFileName, "w"); // uncompressed copy for verification
+  if(!src)
+  {
+    Serial.println("[testGzipLogRotator] Unable to create output file, halting");
+    while(1) yield();
+  }
+
+  LZPacker::GzipLogRotator logs(&tarGzFS, logDir, 1024); // small segments for a few rotations
+  if( !logs.begin() ) {
+    Serial.println("[testGzipLogRotator] Unable to start the log rotator, halting");
+    while(1) yield();
+  }
+
+  size_t srcLen = 0;
+  for( int i=0; i<2000; i++ )
+  {
+    logs.printf("[%06d] sensor %d: %d\n", i*250, i%4, (i*53)%997 );
+    srcLen += src.printf("[%06d] sensor %d: %d\n", i*250, i%4, (i*53)%997 );
+  }
+  logs.end();
+  src.close();
+
+  // read the index back: each segment inflates to the next slice of the uncompressed copy
+  File index = tarGzFS.open(logs.indexPath().c_str(), "r");
+  src = tarGzFS.open(csvFileName, "r");
+  if(!index || !src)
+  {
+    Serial.println("[testGzipLogRotator] Unable to read the index, halting");
+    while(1) yield();
+  }
+
+  size_t segments = 0, total = 0;
+  while( index.available() )
+  {
+    String line = index.readStringUntil('\n');
+    char name[16];
+    unsigned inBytes, gzBytes;
+    if( sscanf(line.c_str(), "%15[^,],%u,%u", name, &inBytes, &gzBytes) != 3 ) {
+      Serial.printf("[testGzipLogRotator] Bad index line: %s, halting\n", line.c_str());
+      while(1) yield();
+    }
+    String segment = String(logDir) + "/" + name;
+
+    flz = tarGzFS.open(segment.c_str(), "r");
+    if( !flz || flz.size() != gzBytes ) {
+      Serial.printf("[testGzipLogRotator] %s is missing or not %d bytes, halting\n", segment.c_str(), gzBytes);
+      while(1) yield();
+    }
+    flz.close();
+
+    dst = tarGzFS.open(msgFileName, "w");
+    for( unsigned i=0; i<inBytes; i++ )
+      dst.write(src.read());
+    dst.close();
+
+    Serial.printf("[testGzipLogRotator] %s: %d bytes to %d bytes\n", name, inBytes, gzBytes );
+
+    verify(segment.c_str(), msgFileName);
+
+    tarGzFS.remove(segment.c_str());
+    tarGzFS.remove(msgFileName);
+    segments++;
+    total += inBytes;
+  }
+  index.close();
+  src.close();
+
+  if( segments < 2 || total != srcLen ) {
+    Serial.printf("[testGzipLogRotator] %d segments hold %d bytes out of %d, halting\n", segments, total, srcLen);
+    while(1) yield();
+  }
+
+  tarGzFS.remove(logs.indexPath().c_str());
+  tarGzFS.remove(csvFileName);
+  tarGzFS.rmdir(logDir);
+}
+
+
+void testFilters()
+{
+  Serial.println();
+  Serial.println("### Filters ###");
+
+  const struct { int id; int stride; const char* name; } filters[] =
+  {
+    { UZLIB_FILTER_DELTA,     3, "delta (stride 3)" },
+    { UZLIB_FILTER_XTENSA,    1, "xtensa" },
+    { UZLIB_FILTER_RISCV,     1, "riscv" },
+    { UZLIB_FILTER_ARM_THUMB, 1, "arm thumb" },
+  };
+
+  for( auto &filter : filters )
+  {
+    LZPacker::setFilter( filter.id, filter.stride );
+    size_t dstLen = LZPacker::compress( &tarGzFS, binFileName, &tarGzFS, fzFileName );
+    LZPacker::setFilter( UZLIB_FILTER_NONE );
+
+    if( dstLen==0 ) {
+      Serial.printf("[testFilters] Failed to compress with the %s filter, halting\n", filter.name);
+      while(1) yield();
+    }
+
+    Serial.printf("[testFilters] Filter %s: deflated to %d bytes\n", filter.name, dstLen );
+
+    GzUnpacker *GZUnpacker = new GzUnpacker();
+    GZUnpacker->haltOnError( true );
+    if( !GZUnpacker->gzExpander( tarGzFS, fzFileName, tarGzFS, unzFileName ) ) {
+      Serial.printf("[testFilters] Failed to expand %s (error %d), halting\n", fzFileName, GZUnpacker->tarGzGetError() );
+      while(1) yield();
+    }
+    delete GZUnpacker;
+
+    compareFiles(unzFileName, binFileName);
+
+    tarGzFS.remove(unzFileName);
+    tarGzFS.remove(fzFileName);
+  }
+}
+
+
 void setup()
 {
   Serial.begin(115200);
@@ -206,6 +517,20 @@ void setup()
   {
     testStreamToStream(); // tested OK on ESP32/RP2040/ESP8266 (any file size)
     printMem();
+    testLevels(); // levels 0, 1, 6 and 9 (any file size)
+    printMem();
+    testTarGzLevels(); // same with a tar.gz archive (any file size)
+    printMem();
+    testOptimalLevel(); // level 10 (slow, any file size)
+    printMem();
+    testDictionary(); // small messages with a preset dictionary
+    printMem();
+    testGzipPrint(); // output of unknown length
+    printMem();
+    testGzipLogRotator(); // rolling logs
+    printMem();
+    testFilters(); // delta and BCJ filters
+    printMem();
     // testBufferToBuffer(); // tested OK on ESP32/RP2040/ESP8266 (small file size)
     // printMem();
     // testBufferToStream(); // tested OK on ESP32/RP2040/ESP8266 (small file size)
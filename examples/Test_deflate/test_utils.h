@@ -45,7 +45,8 @@ struct verify_progress_t
 
 
 
-void verify(const char* fzFileName, const char* srcFilename)
+// dict: preset dictionary the file was compressed with, see LZPacker::setDictionary()
+void verify(const char* fzFileName, const char* srcFilename, const uint8_t* dict=nullptr, size_t dictLen=0)
 {
   // open the fz file for reading
   flz = tarGzFS.open(fzFileName, "r");
@@ -68,6 +69,8 @@ void verify(const char* fzFileName, const char* srcFilename)
 
   // create GzUnpacker instance
   GzUnpacker *GZUnpacker = new GzUnpacker();
+  if( dict )
+    GZUnpacker->setDictionary(dict, dictLen);
 
   // attach callback to verify the uncompressed data
   GZUnpacker->setStreamWriter(
@@ -104,12 +107,41 @@ void verify(const char* fzFileName, const char* srcFilename)
     }
   }
 
+  GZUnpacker->setStreamWriter( nullptr ); // the stream writer is shared by all instances, gzExpander() would use it too
+
   flz.close();
   vprogress.src.close();
   delete GZUnpacker;
 }
 
 
+// byte for byte comparison of two files, halts on the first difference
+void compareFiles(const char* fileName, const char* origFileName)
+{
+  fin = tarGzFS.open(fileName, "r");
+  vprogress.src = tarGzFS.open(origFileName, "r");
+  if(!fin || !vprogress.src)
+  {
+    Serial.printf("[compareFiles] Unable to open %s or %s, halting\n", fileName, origFileName);
+    while(1) yield();
+  }
+  if( fin.size() != vprogress.src.size() )
+  {
+    Serial.printf("[VERIFY ERROR] %s is %d bytes, %s is %d bytes, halting\n", fileName, fin.size(), origFileName, vprogress.src.size());
+    while(1) yield();
+  }
+  for(size_t i=0;i<vprogress.src.size();i++) {
+    if( fin.read() != vprogress.src.read() ) {
+      Serial.printf("[VERIFY ERROR] %s and %s differ at offset %d, halting\n", fileName, origFileName, i);
+      while(1) yield();
+    }
+  }
+  Serial.printf("[compareFiles] %s matches %s (%d bytes)\n", fileName, origFileName, vprogress.src.size());
+  fin.close();
+  vprogress.src.close();
+}
+
+
 void loadFileToBuffer( const char* fileName, unsigned char** bufPtr, size_t* bufLen )
 {
   fin = tarGzFS.open(fileName, "r");
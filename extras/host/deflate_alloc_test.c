@@ -0,0 +1,209 @@
+// Stream mode allocations test (host): once uzlib_deflate_init_stream() has allocated the spill buffer,
+// uzlib_deflate_stream() must not allocate anything, whatever the level, strategy or flush mode.
+// The compressor is laid out like LZStreamWriter's (ESP32 build defaults, 4KB staging buffers) and fed
+// the same way: full 4KB chunks with Z_NO_FLUSH, partial ones with Z_SYNC_FLUSH or Z_PARTIAL_FLUSH, then
+// Z_FINISH. malloc(), calloc() and realloc() are wrapped to count the calls, the output is inflated back.
+// The spill buffer is left to its default size (zlib_stream_spill_size()), two more runs set it too small
+// on purpose, malloc'd or caller provided like lzAlloc() does: it must grow inside the loop, the caller's
+// buffer must be left alone, and the output must still inflate back.
+//
+//   gcc -O2 -I../../src/uzlib -o deflate_alloc_test deflate_alloc_test.c ../../src/uzlib/*.c -lm -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+//   ./deflate_alloc_test ../../examples/*/data/*
+//
+// Level 10 is left out: optimal parsing allocates its working memory for each call.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uzlib.h"
+
+#define HISTORY_SIZE  32768
+#define IO_BUFFER     4096
+#define SYMBOL_BUFFER 16384
+#define HASH_BITS     12
+#define CHAIN_BITS    13
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static int counting = 0;
+static int allocs = 0;
+
+void *__wrap_malloc(size_t size)
+{
+    allocs += counting;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    allocs += counting;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocs += counting;
+    return __real_realloc(ptr, size);
+}
+
+static unsigned char *load_file(const char *name, size_t *len)
+{
+    FILE *f = fopen(name, "rb");
+    unsigned char *data;
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(*len + 1);
+    if (data && fread(data, 1, *len, f) != *len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+static int inflate_buf(const unsigned char *src, size_t len, unsigned char *dst, size_t dstlen)
+{
+    TINF_DATA d;
+    int res;
+
+    memset(&d, 0, sizeof(d));
+    uzlib_uncompress_init(&d, NULL, 0);
+    d.source = src;
+    d.source_limit = src + len;
+    d.destStart = d.dest = dst;
+    d.destSize = dstlen + 1;
+    d.destRemaining = dstlen;
+    res = uzlib_uncompress(&d);
+    if (res == TINF_OK) { // end of output: the final block may still be open
+        d.destRemaining = 1;
+        res = uzlib_uncompress(&d);
+    }
+    if (res != TINF_DONE || (size_t)(d.dest - dst) != dstlen)
+        return -1;
+    return 0;
+}
+
+// compress src the way LZStreamWriter does, returns the allocations made by uzlib_deflate_stream()
+static int run(const unsigned char *src, size_t len, int level, int strategy, unsigned int spill, int placed, unsigned char *out, size_t outsize, size_t *outlen)
+{
+    struct uzlib_comp c;
+    unsigned char spill_mem[64];
+    uzlib_stream strm;
+    unsigned char outbuf[IO_BUFFER];
+    size_t pos = 0;
+    int chunks = 0, state;
+    int matches = strategy == Z_DEFAULT_STRATEGY;
+
+    memset(&c, 0, sizeof(c));
+    memset(&strm, 0, sizeof(strm));
+    c.dict_size = HISTORY_SIZE;
+    c.hash_bits = matches ? HASH_BITS : 0;
+    c.hash_table = matches ? calloc(1 << HASH_BITS, sizeof(uzlib_hash_entry_t)) : NULL;
+    c.checksum_type = TINF_CHKSUM_CRC;
+    uzlib_deflate_level(&c, level);
+    c.strategy = strategy;
+    if (matches && c.max_chain > 1) {
+        c.prev_bits = CHAIN_BITS;
+        c.hash_prev = calloc(1 << CHAIN_BITS, sizeof(uint16_t));
+    }
+    zlib_huff_place(&c, malloc(zlib_huff_size(SYMBOL_BUFFER)), SYMBOL_BUFFER);
+    if (matches) {
+        c.window = malloc(HISTORY_SIZE + IO_BUFFER);
+        c.window_size = HISTORY_SIZE + IO_BUFFER;
+    }
+    c.spill_size = spill; // 0 = zlib_stream_spill_size(), the size lzSpillSize() gives LZStreamWriter
+    if (placed && spill <= sizeof(spill_mem))
+        c.spill = spill_mem; // not owned, uzlib must never free nor realloc it
+    c.adaptive = 1;
+    if (uzlib_deflate_init_stream(&c, &strm) != Z_OK)
+        return -1;
+
+    *outlen = 0;
+    allocs = 0;
+    counting = 1;
+    do {
+        size_t n = len - pos < IO_BUFFER ? len - pos : IO_BUFFER;
+        int flush = Z_NO_FLUSH;
+        chunks++;
+        if (pos + n == len) {
+            flush = Z_FINISH;
+        } else if (chunks % 8 == 0) { // flush() or autoflush with a partly staged buffer
+            n = 1000;
+            flush = chunks % 16 == 0 ? Z_PARTIAL_FLUSH : Z_SYNC_FLUSH;
+        }
+        strm.in.next = (unsigned char *)src + pos;
+        strm.in.avail = n;
+        pos += n;
+        do { // same drain loop as LZStreamWriter::deflate()
+            strm.out.next = outbuf;
+            strm.out.avail = IO_BUFFER;
+            state = uzlib_deflate_stream(&strm, flush);
+            size_t write_size = strm.out.next - outbuf;
+            if (write_size == 0)
+                break;
+            if (*outlen + write_size > outsize)
+                return -1;
+            memcpy(out + *outlen, outbuf, write_size);
+            *outlen += write_size;
+        } while (state == Z_OK && strm.out.avail == 0);
+        if (state != Z_OK && state != Z_STREAM_END)
+            return -1;
+    } while (pos < len);
+    counting = 0;
+
+    uzlib_deflate_end_stream(&c);
+    free(c.window);
+    free(c.huff);
+    free(c.hash_prev);
+    free(c.hash_table);
+    return state == Z_STREAM_END ? allocs : -1;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct { int level, strategy; unsigned int spill; int placed; } modes[] = {
+        { 0, Z_DEFAULT_STRATEGY, 0, 0 }, { 1, Z_DEFAULT_STRATEGY, 0, 0 }, { 6, Z_DEFAULT_STRATEGY, 0, 0 },
+        { 9, Z_DEFAULT_STRATEGY, 0, 0 }, { 6, Z_RLE, 0, 0 }, { 6, Z_HUFFMAN_ONLY, 0, 0 },
+        { 6, Z_DEFAULT_STRATEGY, 64, 0 }, { 6, Z_DEFAULT_STRATEGY, 64, 1 }, // too small: grows, allocations expected
+    };
+    int failed = 0, grown = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file...\n", argv[0]);
+        return 1;
+    }
+
+    uzlib_init();
+    for (int i = 1; i < argc; i++) {
+        size_t len, outsize, outlen;
+        unsigned char *src = load_file(argv[i], &len), *out, *check;
+        if (!src || len == 0) {
+            free(src);
+            continue;
+        }
+        outsize = len + len / 8 + 1024;
+        out = malloc(outsize);
+        check = malloc(len + 1);
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            int n = run(src, len, modes[m].level, modes[m].strategy, modes[m].spill, modes[m].placed, out, outsize, &outlen);
+            int ok = (modes[m].spill ? n >= 0 : n == 0) && inflate_buf(out, outlen, check, len) == 0 && memcmp(check, src, len) == 0;
+            printf("%s %s level %d strategy %d spill %u%s: %zu -> %zu bytes, %d allocations\n", ok ? "OK  " : "FAIL",
+                argv[i], modes[m].level, modes[m].strategy, modes[m].spill, modes[m].placed ? " (caller's)" : "", len, outlen, n);
+            failed |= !ok;
+            grown += modes[m].spill && n > 0;
+        }
+        free(check);
+        free(out);
+        free(src);
+    }
+    if (!grown) { // small files don't overflow it
+        printf("FAIL the spill buffer never had to grow\n");
+        failed = 1;
+    }
+    return failed;
+}
@@ -0,0 +1,183 @@
+// Deflate levels benchmark (host): compression ratio against speed for each level,
+// over the examples data files or any list of files.
+//
+//   gcc -O2 -I../../src/uzlib -o deflate_bench deflate_bench.c ../../src/uzlib/*.c -lm
+//   ./deflate_bench ../../examples/*/data/*
+//
+// The compressor is set up like LZPacker's buffer mode with the ESP32 build defaults
+// (4K hash entries, 8K chain slots, 16KB symbol buffer, adaptive mode), level 10 gets
+// the largest layout as in lzConfig(). Every output is inflated back and compared with
+// its source, the timings only cover compression and inflate.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "uzlib.h"
+
+#define BENCH_MIN_NS 200000000LL // repeat each file for at least that long
+
+struct bench_file {
+    const char *name;
+    unsigned char *data;
+    size_t len;
+};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned char *load_file(const char *name, size_t *len)
+{
+    FILE *f = fopen(name, "rb");
+    unsigned char *data;
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(*len + 1);
+    if (data && fread(data, 1, *len, f) != *len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+/* raw deflate of src, the output buffer (*out) is reused across calls */
+static size_t deflate_buf(const unsigned char *src, size_t len, int level, unsigned char **out, int *outsize)
+{
+    struct uzlib_comp c;
+    unsigned int hash_bits = level > 9 ? 15 : 12;
+    unsigned int chain_bits = level > 9 ? 15 : 13;
+    unsigned int symbol_buffer = level > 9 ? 49152 : 16384;
+
+    memset(&c, 0, sizeof(c));
+    c.dict_size = 32768;
+    c.hash_bits = hash_bits;
+    c.hash_table = calloc(1 << hash_bits, sizeof(uzlib_hash_entry_t));
+    c.grow_buffer = 1;
+    c.outbuf = *out;
+    c.outsize = *outsize;
+    uzlib_deflate_level(&c, level);
+    if (c.max_chain > 1) {
+        c.prev_bits = chain_bits;
+        c.hash_prev = calloc(1 << chain_bits, sizeof(uint16_t));
+    }
+    zlib_huff_init(&c, symbol_buffer);
+    c.adaptive = 1;
+
+    zlib_start_block(&c);
+    uzlib_compress(&c, src, len);
+    zlib_finish_block(&c);
+
+    zlib_huff_free(&c);
+    free(c.hash_prev);
+    free(c.hash_table);
+    *out = c.outbuf;
+    *outsize = c.outsize;
+    return c.outlen;
+}
+
+static int inflate_buf(const unsigned char *src, size_t len, unsigned char *dst, size_t dstlen)
+{
+    TINF_DATA d;
+    int res;
+
+    memset(&d, 0, sizeof(d));
+    uzlib_uncompress_init(&d, NULL, 0);
+    d.source = src;
+    d.source_limit = src + len;
+    d.destStart = d.dest = dst;
+    d.destSize = dstlen + 1;
+    d.destRemaining = dstlen;
+    res = uzlib_uncompress(&d);
+    if (res == TINF_OK) { // end of output: the final block may still be open
+        d.destRemaining = 1;
+        res = uzlib_uncompress(&d);
+    }
+    if (res != TINF_DONE || (size_t)(d.dest - dst) != dstlen)
+        return -1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_file *files = calloc(argc, sizeof(struct bench_file));
+    size_t nfiles = 0, total = 0, largest = 0;
+    unsigned char *out = NULL, *check;
+    int outsize = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file...\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        struct bench_file *f = &files[nfiles];
+        f->name = argv[i];
+        f->data = load_file(f->name, &f->len);
+        if (!f->data || f->len == 0) {
+            fprintf(stderr, "skipping %s (unreadable or empty)\n", f->name);
+            continue;
+        }
+        total += f->len;
+        if (f->len > largest)
+            largest = f->len;
+        nfiles++;
+    }
+    if (nfiles == 0)
+        return 1;
+    check = malloc(largest + 1);
+
+    uzlib_init();
+    printf("%zu files, %zu bytes\n\n", nfiles, total);
+    printf("level  compressed   ratio  deflate MB/s  inflate MB/s\n");
+
+    for (int level = 0; level <= 10; level++) {
+        size_t compressed = 0;
+        double deflate_s = 0, inflate_s = 0;
+
+        for (size_t i = 0; i < nfiles; i++) {
+            struct bench_file *f = &files[i];
+            long long start, elapsed;
+            size_t len = 0;
+            int runs = 0;
+
+            start = now_ns();
+            do {
+                len = deflate_buf(f->data, f->len, level, &out, &outsize);
+                runs++;
+                elapsed = now_ns() - start;
+            } while (elapsed < BENCH_MIN_NS);
+            deflate_s += (double)elapsed / runs / 1e9;
+            compressed += len;
+
+            runs = 0;
+            start = now_ns();
+            do {
+                if (inflate_buf(out, len, check, f->len) != 0 || memcmp(check, f->data, f->len) != 0) {
+                    fprintf(stderr, "level %d: %s does not round trip\n", level, f->name);
+                    return 1;
+                }
+                runs++;
+                elapsed = now_ns() - start;
+            } while (elapsed < BENCH_MIN_NS);
+            inflate_s += (double)elapsed / runs / 1e9;
+        }
+
+        printf("%5d  %10zu  %5.1f%%  %12.1f  %12.1f\n", level, compressed, 100.0 * compressed / total,
+            total / deflate_s / 1e6, total / inflate_s / 1e6);
+    }
+
+    for (size_t i = 0; i < nfiles; i++)
+        free(files[i].data);
+    free(files);
+    free(check);
+    free(out);
+    return 0;
+}
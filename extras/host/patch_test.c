@@ -0,0 +1,149 @@
+// Delta patch test (host): a raw patch (extras/mkpatch.py -n) is applied with the source image file read
+// through patch_readfunc_t and the target image written to a file, fed in chunks of varying sizes,
+// then the file is checked against the target crc32 and the expected image. A source image with one
+// byte changed, and a short one, must be rejected with PATCH_ERR_SOURCE before anything is written.
+//
+//   gcc -O2 -I../../src/uzlib -o patch_test patch_test.c ../../src/patch/libpatch.c ../../src/uzlib/crc32.c
+//   gunzip -c ../../examples/Test_tar_gz_tgz/data/firmware_example_esp32.gz > old.bin
+//   python3 -c "d=bytearray(open('old.bin','rb').read()); d[4096:4100]=b'\1\2\3\4'; d[50000:50000]=b'new code'*64; del d[90000:91000]; open('new.bin','wb').write(d)"
+//   python3 ../mkpatch.py -n old.bin new.bin patch.bin
+//   ./patch_test old.bin new.bin patch.bin
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uzlib.h"
+#include "../../src/patch/libpatch.h"
+
+#define TARGET_FILE "patch_test.out"
+
+struct patch_ctx {
+    FILE *source;
+    size_t source_len; // bytes readfunc serves, to cut the source image short
+    long flip;         // source offset read with one bit changed, -1 for none
+    FILE *target;
+    size_t writes;
+};
+
+static unsigned char *load_file(const char *name, size_t *len)
+{
+    FILE *f = fopen(name, "rb");
+    unsigned char *data;
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(*len + 1);
+    if (data && fread(data, 1, *len, f) != *len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+// reads the source image at offset, like esp_partition_read() on the running partition
+static size_t read_source(void *ctx, size_t offset, unsigned char *buf, size_t len)
+{
+    struct patch_ctx *pc = ctx;
+    if (offset >= pc->source_len)
+        return 0;
+    if (len > pc->source_len - offset)
+        len = pc->source_len - offset;
+    if (fseek(pc->source, offset, SEEK_SET) != 0)
+        return 0;
+    len = fread(buf, 1, len, pc->source);
+    if (pc->flip >= 0 && (size_t)pc->flip >= offset && (size_t)pc->flip < offset + len)
+        buf[pc->flip - offset] ^= 0x20;
+    return len;
+}
+
+static size_t write_target(void *ctx, unsigned char *buf, size_t len)
+{
+    struct patch_ctx *pc = ctx;
+    pc->writes++;
+    return fwrite(buf, 1, len, pc->target);
+}
+
+// applies the patch to the target file, returns the first error or the patch_end() result
+static int apply(PATCH *p, struct patch_ctx *pc, const unsigned char *patch, size_t len)
+{
+    unsigned int seed = 1;
+    size_t pos = 0;
+    int ret = PATCH_OK;
+
+    pc->target = fopen(TARGET_FILE, "wb");
+    pc->writes = 0;
+    if (!pc->target)
+        return PATCH_ERR_WRITE;
+    patch_init(p, read_source, write_target, pc);
+    while (pos < len && ret == PATCH_OK) {
+        size_t n;
+        seed = seed * 1103515245 + 12345;
+        n = 1 + (seed >> 16) % 6000; // split records, varints and the header across calls
+        if (n > len - pos)
+            n = len - pos;
+        ret = patch_write(p, patch + pos, n);
+        pos += n;
+    }
+    if (ret == PATCH_OK)
+        ret = patch_end(p);
+    fclose(pc->target);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    static PATCH p;
+    struct patch_ctx pc;
+    unsigned char *patch, *target, *out;
+    size_t patch_len, target_len, out_len;
+    int failed = 0, ret;
+
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s source.bin target.bin patch.bin\n", argv[0]);
+        return 1;
+    }
+    pc.source = fopen(argv[1], "rb");
+    target = load_file(argv[2], &target_len);
+    patch = load_file(argv[3], &patch_len);
+    if (!pc.source || !target || !patch) {
+        fprintf(stderr, "unable to read the input files\n");
+        return 1;
+    }
+    fseek(pc.source, 0, SEEK_END);
+    pc.source_len = ftell(pc.source);
+    pc.flip = -1;
+
+    // source image as is: the target file must match the target crc32 and image
+    ret = apply(&p, &pc, patch, patch_len);
+    out = load_file(TARGET_FILE, &out_len);
+    if (ret != PATCH_OK || !out || out_len != p.target_size || ~uzlib_crc32(out, out_len, 0xffffffff) != p.target_crc
+        || out_len != target_len || memcmp(out, target, target_len) != 0) {
+        printf("FAIL patch: error %d, %zu bytes written\n", ret, out ? out_len : 0);
+        failed = 1;
+    } else {
+        printf("OK   patch: %zu bytes, crc32 %08x, %zu writes\n", out_len, (unsigned)p.target_crc, pc.writes);
+    }
+    free(out);
+
+    // one byte changed in the source image
+    pc.flip = pc.source_len / 2;
+    ret = apply(&p, &pc, patch, patch_len);
+    printf("%s changed source: error %d, %zu writes\n", ret == PATCH_ERR_SOURCE && pc.writes == 0 ? "OK  " : "FAIL", ret, pc.writes);
+    failed |= ret != PATCH_ERR_SOURCE || pc.writes != 0;
+
+    // source image shorter than the patch expects
+    pc.flip = -1;
+    pc.source_len--;
+    ret = apply(&p, &pc, patch, patch_len);
+    printf("%s short source: error %d, %zu writes\n", ret == PATCH_ERR_SOURCE && pc.writes == 0 ? "OK  " : "FAIL", ret, pc.writes);
+    failed |= ret != PATCH_ERR_SOURCE || pc.writes != 0;
+
+    remove(TARGET_FILE);
+    fclose(pc.source);
+    free(patch);
+    free(target);
+    return failed;
+}
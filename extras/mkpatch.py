@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+"""
+Make a delta patch for GzUnpacker::gzStreamPatchUpdater() / gzPatchUpdater()
+
+  usage: mkpatch.py [-n] old.bin new.bin patch.gz
+
+old.bin must be the exact image currently running on the device, new.bin is the update.
+The patch is gzipped unless -n is given (see src/patch/libpatch.h for the format).
+
+The matcher follows bsdiff: regions of the new image are described as an approximate match
+against the old image (stored as bytewise differences, mostly zeros once code moved around
+or addresses shifted), plus literal bytes for what doesn't match. bsdiff's suffix array is
+replaced by an index of 8 bytes substrings sampled every 4 bytes of the old image.
+"""
+
+import gzip
+import struct
+import sys
+import zlib
+
+K = 8            # indexed substring length
+STEP = 4         # index sampling step
+CANDIDATES = 8   # positions kept per indexed substring
+
+
+def build_index(old):
+    index = {}
+    for pos in range(0, len(old) - K + 1, STEP):
+        key = old[pos:pos + K]
+        slot = index.get(key)
+        if slot is None:
+            index[key] = [pos]
+        elif len(slot) < CANDIDATES:
+            slot.append(pos)
+    return index
+
+
+def match_len(old, opos, new, npos):
+    """length of the exact match between old[opos:] and new[npos:]"""
+    limit = min(len(old) - opos, len(new) - npos)
+    lo, step = 0, 32
+    while lo < limit:  # gallop, then bisect the first window that differs
+        k = min(step, limit - lo)
+        if old[opos + lo:opos + lo + k] != new[npos + lo:npos + lo + k]:
+            hi = lo + k
+            while hi - lo > 1:
+                mid = (lo + hi) // 2
+                if old[opos + lo:opos + mid] == new[npos + lo:npos + mid]:
+                    lo = mid
+                else:
+                    hi = mid
+            return lo
+        lo += k
+        step *= 2
+    return limit
+
+
+def search(index, old, new, scan, hint):
+    """longest exact match for new[scan:] in old, returns (length, position)"""
+    best_len, best_pos = 0, 0
+    if 0 <= hint < len(old):
+        best_len, best_pos = match_len(old, hint, new, scan), hint
+    for j in range(STEP):
+        key = new[scan + j:scan + j + K]
+        if len(key) < K:
+            break
+        for pos in index.get(key, ()):
+            pos -= j
+            if pos < 0 or pos == best_pos:
+                continue
+            n = match_len(old, pos, new, scan)
+            if n > best_len:
+                best_len, best_pos = n, pos
+    return best_len, best_pos
+
+
+def varint(v):
+    out = bytearray()
+    while True:
+        b = v & 0x7f
+        v >>= 7
+        if v:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return out
+
+
+def zigzag(v):
+    return (v << 1) if v >= 0 else ((-v - 1) << 1) | 1
+
+
+def diff(old, new):
+    """bsdiff's main loop, yields (diff bytes, extra bytes, seek) records"""
+    index = build_index(old)
+    oldsize, newsize = len(old), len(new)
+    scan = length = pos = lastscan = lastpos = lastoffset = 0
+
+    while scan < newsize:
+        oldscore = 0
+        scan += length
+        scsc = scan
+        while scan < newsize:
+            length, pos = search(index, old, new, scan, scan + lastoffset)
+            while scsc < scan + length:
+                if scsc + lastoffset < oldsize and old[scsc + lastoffset] == new[scsc]:
+                    oldscore += 1
+                scsc += 1
+            if (length == oldscore and length != 0) or length > oldscore + 8:
+                break
+            if scan + lastoffset < oldsize and old[scan + lastoffset] == new[scan]:
+                oldscore -= 1
+            scan += 1
+
+        if length != oldscore or scan == newsize:
+            # extend the previous match forward and this one backward, approximately
+            s = sf = lenf = 0
+            i = 0
+            while lastscan + i < scan and lastpos + i < oldsize:
+                if old[lastpos + i] == new[lastscan + i]:
+                    s += 1
+                i += 1
+                if s * 2 - i > sf * 2 - lenf:
+                    sf, lenf = s, i
+
+            lenb = 0
+            if scan < newsize:
+                s = sb = 0
+                i = 1
+                while scan >= lastscan + i and pos >= i:
+                    if old[pos - i] == new[scan - i]:
+                        s += 1
+                    if s * 2 - i > sb * 2 - lenb:
+                        sb, lenb = s, i
+                    i += 1
+
+            if lastscan + lenf > scan - lenb:
+                overlap = (lastscan + lenf) - (scan - lenb)
+                s = ss = lens = 0
+                for i in range(overlap):
+                    if new[lastscan + lenf - overlap + i] == old[lastpos + lenf - overlap + i]:
+                        s += 1
+                    if new[scan - lenb + i] == old[pos - lenb + i]:
+                        s -= 1
+                    if s > ss:
+                        ss, lens = s, i + 1
+                lenf += lens - overlap
+                lenb -= lens
+
+            d = bytes((new[lastscan + i] - old[lastpos + i]) & 0xff for i in range(lenf))
+            extra = new[lastscan + lenf:scan - lenb]
+            yield d, extra, (pos - lenb) - (lastpos + lenf)
+
+            lastscan = scan - lenb
+            lastpos = pos - lenb
+            lastoffset = pos - scan
+
+
+def make_patch(old, new):
+    out = bytearray(b"TGZP" + bytes([1, 0, 0, 0]))
+    out += struct.pack("<IIII", len(old), zlib.crc32(old), len(new), zlib.crc32(new))
+    for d, extra, seek in diff(old, new):
+        out += varint(len(d)) + d + varint(len(extra)) + extra + varint(zigzag(seek))
+    return bytes(out)
+
+
+def main(argv):
+    raw = "-n" in argv
+    args = [a for a in argv if a != "-n"]
+    if len(args) != 3:
+        print(__doc__.strip().splitlines()[2].strip(), file=sys.stderr)
+        return 1
+    with open(args[0], "rb") as f:
+        old = f.read()
+    with open(args[1], "rb") as f:
+        new = f.read()
+    patch = make_patch(old, new)
+    data = patch if raw else gzip.compress(patch, 9)
+    with open(args[2], "wb") as f:
+        f.write(data)
+    print("%s: %d bytes (%d uncompressed), %s is %d bytes (%d gzipped)" % (
+        args[2], len(data), len(patch), args[1], len(new), len(gzip.compress(new, 9))))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -48,6 +48,7 @@
 #if defined ESP32
 
   #include <Update.h>
+  #include <esp_ota_ops.h> // esp_ota_get_running_partition(), source of delta patches
   #define HAS_OTA_SUPPORT
 
   // Figure out the chosen fs::FS library to load for the **destination** filesystem
@@ -1,20 +1,6 @@
+#include <stdint.h>
 #include "untar.h"
 
-const char *empty_string = "";
-entry_callbacks_t *read_tar_callbacks = NULL;
-unsigned char *read_buffer = NULL;
-header_t header;
-header_translated_t header_translated;
-void *read_context_data = NULL;
-int num_blocks;
-int num_blocks_iterator;
-int current_data_size;
-int entry_index;
-int empty_count;
-int received_bytes;
-int indatablock;
-int tar_error = TAR_OK;
-
 extern void (*tar_error_logger)(const char* subject, ...);
 extern void (*tar_debug_logger)(const char* subject, ...);
 
@@ -28,16 +14,6 @@ void log_debug(const char *message) {
   //else printf("[TAR DEBUG]: %s\n", message);
 }
 
-int parse_header(const unsigned char buffer[TAR_BLOCK_SIZE], header_t *header) {
-  //log_debug("Copying tar header");
-  memcpy(header, buffer, sizeof(header_t));
-  return TAR_OK;
-}
-
-unsigned long long decode_base256( __attribute__((unused)) const unsigned char *buffer) {
-  return TAR_OK;
-}
-
 __attribute__((unused)) static void dump_hex(const char *ptr, int length) {
   int i = 0;
   printf("DUMP: ");
@@ -55,188 +31,177 @@ __attribute__((unused)) static void dump_hex(const char *ptr, int length) {
   printf("\n\n");
 }
 
-char *trim(char *raw, int length) {
+// numeric field, read in place: octal digits after the leading padding, or big-endian base-256 (GNU, sizes >8GB)
+static unsigned long long decode_field(const char *field, int length) {
+  const unsigned char *p = (const unsigned char *)field;
+  unsigned long long value = 0;
   int i = 0;
-  int j = length - 1;
-  int is_empty = 0;
-  // Determine left padding.
-  while((raw[i] == 0 || raw[i] == ' ')) {
-    i++;
-    if(i >= length) {
-      is_empty = 1;
-      break;
-    }
+  if( p[0] & 0x80 ) {
+    value = p[0] & 0x7f;
+    for( i = 1; i < length; i++ )
+      value = (value << 8) | p[i];
+    return value;
   }
-  if(is_empty == 1)
-    return (char*)empty_string;
-  // Determine right padding.
-  while((raw[j] == 0 || raw[j] == ' ')) {
-    j--;
-    if(j <= i)
+  while( i < length && (p[i] == ' ' || p[i] == 0) )
+    i++;
+  for( ; i < length; i++ ) {
+    unsigned int digit = p[i] - '0'; // non digits wrap above 7
+    if( digit > 7 )
       break;
+    value = (value << 3) | digit;
   }
-  // Place the terminator.
-  raw[j + 1] = 0;
-  // Return an offset pointer.
-  return &raw[i];
+  return value;
+}
+
+
+// copy a name field up to its first NUL
+static void copy_name(char *dest, const char *field, size_t length) {
+  const char *end = memchr(field, 0, length);
+  if( end != NULL )
+    length = end - field;
+  memcpy(dest, field, length);
+  dest[length] = 0;
 }
 
+
+// raw_header is a whole block: the checksum counts the 512 bytes, its own field as spaces.
+// Link target, user and group names are left empty, see tar_copy_names()
 int translate_header(header_t *raw_header, header_translated_t *parsed) {
-  char buffer[101];
-  char *buffer_ptr;
-  const int R_OCTAL = 8;
-  //
-  memcpy(buffer, raw_header->filename, 100);
-  buffer_ptr = trim(buffer, 100);
-  strcpy(parsed->filename, buffer_ptr);
-  parsed->filename[strlen(buffer_ptr)] = 0;
-  //
-  memcpy(buffer, raw_header->filemode, 8);
-  buffer_ptr = trim(buffer, 8);
-
-  if(IS_BASE256_ENCODED(buffer) != 0)
-      parsed->filemode = decode_base256((const unsigned char *)buffer_ptr);
-  else
-      parsed->filemode = strtoull(buffer_ptr, NULL, R_OCTAL);
-  //
-  memcpy(buffer, raw_header->uid, 8);
-  buffer_ptr = trim(buffer, 8);
-
-  if(IS_BASE256_ENCODED(buffer) != 0)
-      parsed->uid = decode_base256((const unsigned char *)buffer_ptr);
-  else
-      parsed->uid = strtoull(buffer_ptr, NULL, R_OCTAL);
-  //
-  memcpy(buffer, raw_header->gid, 8);
-  buffer_ptr = trim(buffer, 8);
-
-  if(IS_BASE256_ENCODED(buffer) != 0)
-      parsed->gid = decode_base256((const unsigned char *)buffer_ptr);
-  else
-      parsed->gid = strtoull(buffer_ptr, NULL, R_OCTAL);
-  //
-  memcpy(buffer, raw_header->filesize, 12);
-  buffer_ptr = trim(buffer, 12);
-
-  if(IS_BASE256_ENCODED(buffer) != 0)
-      parsed->filesize = decode_base256((const unsigned char *)buffer_ptr);
-  else
-      parsed->filesize = strtoull(buffer_ptr, NULL, R_OCTAL);
-  //
-  memcpy(buffer, raw_header->mtime, 12);
-  buffer_ptr = trim(buffer, 12);
-
-  if(IS_BASE256_ENCODED(buffer) != 0)
-      parsed->mtime = decode_base256((const unsigned char *)buffer_ptr);
-  else
-      parsed->mtime = strtoull(buffer_ptr, NULL, R_OCTAL);
-  //
-  memcpy(buffer, raw_header->checksum, 8);
-  buffer_ptr = trim(buffer, 8);
-
-  if(IS_BASE256_ENCODED(buffer) != 0)
-      parsed->checksum = decode_base256((const unsigned char *)buffer_ptr);
-  else
-      parsed->checksum = strtoull(buffer_ptr, NULL, R_OCTAL);
-  //
-  parsed->type = get_type_from_char(raw_header->type);
-
-  memcpy(buffer, raw_header->link_target, 100);
-  buffer_ptr = trim(buffer, 100);
-  strcpy(parsed->link_target, buffer_ptr);
-  parsed->link_target[strlen(buffer_ptr)] = 0;
-  //
-  memcpy(buffer, raw_header->ustar_indicator, 6);
-  buffer_ptr = trim(buffer, 6);
-  strcpy(parsed->ustar_indicator, buffer_ptr);
-  parsed->ustar_indicator[strlen(buffer_ptr)] = 0;
-  //
-  memcpy(buffer, raw_header->ustar_version, 2);
-  buffer_ptr = trim(buffer, 2);
-  strcpy(parsed->ustar_version, buffer_ptr);
-  parsed->ustar_version[strlen(buffer_ptr)] = 0;
+  const unsigned char *block = (const unsigned char *)raw_header;
+  uint32_t pairs = 0; // two 16 bits byte sums, 128 words * 2 * 255 can't overflow
+  uint32_t highs = 0; // four 8 bits counts of bytes >127, some old tars sum signed chars
+  unsigned int sum, high;
+  int i;
+
+  for( i = 0; i < TAR_BLOCK_SIZE; i += 4 ) {
+    uint32_t w;
+    memcpy(&w, &block[i], 4);
+    pairs += (w & 0x00ff00ff) + ((w >> 8) & 0x00ff00ff);
+    highs += (w >> 7) & 0x01010101;
+  }
+  sum = (pairs & 0xffff) + (pairs >> 16) + 8 * ' ';
+  high = (highs & 0xff) + ((highs >> 8) & 0xff) + ((highs >> 16) & 0xff) + (highs >> 24);
+  for( i = 148; i < 156; i++ ) { // the checksum field counts as spaces
+    sum -= block[i];
+    high -= block[i] >> 7;
+  }
+  parsed->checksum = decode_field(raw_header->checksum, 8);
+  if( parsed->checksum != sum && parsed->checksum != sum - 256 * high ) {
+    if(tar_error_logger) tar_error_logger("[TAR ERROR] Header checksum mismatch (expected %u, got %llu)\n", sum, parsed->checksum);
+    return TAR_ERROR;
+  }
 
+  copy_name(parsed->filename, raw_header->filename, 100);
+  parsed->filemode = decode_field(raw_header->filemode, 8);
+  parsed->uid      = decode_field(raw_header->uid, 8);
+  parsed->gid      = decode_field(raw_header->gid, 8);
+  parsed->filesize = decode_field(raw_header->filesize, 12);
+  parsed->mtime    = decode_field(raw_header->mtime, 12);
+  parsed->type     = get_type_from_char(raw_header->type);
+  copy_name(parsed->ustar_indicator, raw_header->ustar_indicator, 5);
+  copy_name(parsed->ustar_version, raw_header->ustar_version, 2);
+
+  parsed->link_target[0] = 0;
+  parsed->user_name[0] = 0;
+  parsed->group_name[0] = 0;
   if(strcmp(parsed->ustar_indicator, "ustar") == 0) {
-    //
-    memcpy(buffer, raw_header->user_name, 32);
-    buffer_ptr = trim(buffer, 32);
-    strcpy(parsed->user_name, buffer_ptr);
-    parsed->user_name[strlen(buffer_ptr)] = 0;
-    //
-    memcpy(buffer, raw_header->group_name, 32);
-    buffer_ptr = trim(buffer, 32);
-    strcpy(parsed->group_name, buffer_ptr);
-    parsed->group_name[strlen(buffer_ptr)] = 0;
-    //
-    memcpy(buffer, raw_header->device_major, 8);
-    buffer_ptr = trim(buffer, 8);
-
-    if(IS_BASE256_ENCODED(buffer) != 0)
-        parsed->device_major = decode_base256((const unsigned char *)buffer_ptr);
-    else
-        parsed->device_major = strtoull(buffer_ptr, NULL, R_OCTAL);
-    //
-    memcpy(buffer, raw_header->device_minor, 8);
-    buffer_ptr = trim(buffer, 8);
-
-    if(IS_BASE256_ENCODED(buffer) != 0) {
-      parsed->device_minor = decode_base256((const unsigned char *)buffer_ptr);
-    } else {
-      parsed->device_minor = strtoull(buffer_ptr, NULL, R_OCTAL);
-    }
+    parsed->device_major = decode_field(raw_header->device_major, 8);
+    parsed->device_minor = decode_field(raw_header->device_minor, 8);
   } else {
-    strcpy(parsed->user_name, "");
-    strcpy(parsed->group_name, "");
-
     parsed->device_major = 0;
     parsed->device_minor = 0;
   }
+  parsed->raw = raw_header;
+  return TAR_OK;
+}
+
+
+int tar_copy_names(header_translated_t *header) {
+  if( header->raw == NULL ) {
+    log_error("tar_copy_names() called outside of the header callback");
+    return TAR_ERROR;
+  }
+  copy_name(header->link_target, header->raw->link_target, 100);
+  if(strcmp(header->ustar_indicator, "ustar") == 0) {
+    copy_name(header->user_name, header->raw->user_name, 31);
+    copy_name(header->group_name, header->raw->group_name, 31);
+  }
   return TAR_OK;
 }
 
 
-int read_block(unsigned char *buffer) {
+// read up to max_blocks blocks in one go, returns the number of blocks now at reader->current_block or TAR_ERROR
+static int read_blocks(tar_reader_t *reader, int max_blocks) {
 
+  entry_callbacks_t *callbacks = reader->callbacks;
   int num_read;
-
-  if( read_tar_callbacks->read_cb == NULL ) {
+  size_t buffsize;
+
+  if( callbacks->borrow_cb != NULL ) {
+    buffsize = (size_t)max_blocks * TAR_BLOCK_SIZE;
+    reader->current_block = callbacks->borrow_cb(&buffsize, reader->context_data);
+    num_read = reader->current_block != NULL ? (int)buffsize : 0;
+  } else if( callbacks->read_cb != NULL ) {
+    if( max_blocks > reader->read_buffer_blocks )
+      max_blocks = reader->read_buffer_blocks;
+    reader->current_block = reader->read_buffer;
+    num_read = callbacks->read_cb(reader->current_block, max_blocks * TAR_BLOCK_SIZE, reader->context_data);
+  } else {
     log_error("read_cb() has NOT been defined" );
-    tar_error = TAR_ERR_READBLOCK_FAIL;
+    reader->error = TAR_ERR_READBLOCK_FAIL;
     return TAR_ERROR;
   }
 
-  num_read = read_tar_callbacks->read_cb(buffer, TAR_BLOCK_SIZE);
-
-  if(num_read < TAR_BLOCK_SIZE) {
-    tar_error = TAR_ERR_READBLOCK_FAIL;
-    if(tar_error_logger) tar_error_logger("[TAR ERROR] Stopped after %d reads rather than %d. Quitting under error.", num_read, TAR_BLOCK_SIZE);
+  // borrowed runs may be shorter than asked, copied ones may not
+  if(num_read < TAR_BLOCK_SIZE || num_read % TAR_BLOCK_SIZE != 0 || num_read > max_blocks * TAR_BLOCK_SIZE
+    || (reader->current_block == reader->read_buffer && num_read != max_blocks * TAR_BLOCK_SIZE)) {
+    reader->error = TAR_ERR_READBLOCK_FAIL;
+    if(tar_error_logger) tar_error_logger("[TAR ERROR] Stopped after %d reads rather than %d. Quitting under error.", num_read, max_blocks * TAR_BLOCK_SIZE);
     return TAR_ERROR;
   }
-  return TAR_OK;
+  return num_read / TAR_BLOCK_SIZE;
 }
 
 
-int expand_tar_data_block() {
+// send a run of data blocks to write_cb, the last block of the entry is trimmed to the file size
+static int expand_tar_data_blocks(tar_reader_t *reader, int blocks) {
 
-  if(num_blocks_iterator >= num_blocks - 1)
-    current_data_size = get_last_block_portion_size(header_translated.filesize);
-  else
-    current_data_size = TAR_BLOCK_SIZE;
+  reader->current_data_size = blocks * TAR_BLOCK_SIZE;
+  if(reader->num_blocks_iterator + blocks >= reader->num_blocks)
+    reader->current_data_size -= TAR_BLOCK_SIZE - get_last_block_portion_size(reader->header.filesize);
 
-  read_buffer[current_data_size] = 0;
+  if( reader->current_block == reader->read_buffer )
+    reader->read_buffer[reader->current_data_size] = 0; // a borrowed run is followed by the caller's data
 
-  if(read_tar_callbacks->write_cb(&header_translated, entry_index, read_context_data, read_buffer, current_data_size) != 0) {
+  if(reader->callbacks->write_cb(&reader->header, reader->entry_index, reader->context_data, reader->current_block, reader->current_data_size) != 0) {
     //log_error("Data callback failed.");
     return TAR_ERR_DATACB_FAIL;
   }
-  num_blocks_iterator++;
-  received_bytes += current_data_size;
+  reader->num_blocks_iterator += blocks;
+  reader->received_bytes += reader->current_data_size;
 
   return TAR_OK;
 
 }
 
-void tar_abort( const char* msgstr, int iserror ) {
+
+// the copy buffer for read_cb: TAR_READ_BLOCKS blocks, or a single one when the heap is short
+static int alloc_read_buffer(tar_reader_t *reader) {
+  reader->read_buffer_blocks = TAR_READ_BLOCKS;
+  reader->read_buffer = (unsigned char*)malloc(reader->read_buffer_blocks * TAR_BLOCK_SIZE + 1);
+  if( reader->read_buffer == NULL && reader->read_buffer_blocks > 1 ) {
+    reader->read_buffer_blocks = 1;
+    reader->read_buffer = (unsigned char*)malloc(TAR_BLOCK_SIZE + 1);
+  }
+  if( reader->read_buffer == NULL ) {
+    return TAR_ERROR_HEAP;
+  }
+  reader->read_buffer[reader->read_buffer_blocks * TAR_BLOCK_SIZE] = 0;
+  return TAR_OK;
+}
+
+
+void tar_abort( tar_reader_t *reader, const char* msgstr, int iserror ) {
   if( iserror == 1 ) {
     log_error( msgstr );
   } else {
@@ -244,128 +209,111 @@ void tar_abort( const char* msgstr, int iserror ) {
       log_debug( msgstr );
     }
   }
-  if( read_buffer != NULL ) {
-    free( read_buffer );
-    read_buffer = NULL;
+  if( reader->read_buffer != NULL ) {
+    free( reader->read_buffer );
+    reader->read_buffer = NULL;
   }
-  read_tar_callbacks = NULL;
+  reader->current_block = NULL;
+  reader->callbacks = NULL;
 }
 
 
-int tar_setup(  entry_callbacks_t *callbacks, void *context_data ) {
+int tar_setup( tar_reader_t *reader, entry_callbacks_t *callbacks, void *context_data ) {
   //log_debug("entering tar setup");
-  tar_error = TAR_OK;
-  read_tar_callbacks = callbacks;
-  read_context_data = context_data;
-  read_buffer = (unsigned char*)malloc(TAR_BLOCK_SIZE + 1);
-  if( read_buffer == NULL ) {
-    return TAR_ERROR_HEAP;
+  memset(reader, 0, sizeof(tar_reader_t));
+  reader->error = TAR_OK;
+  reader->callbacks = callbacks;
+  reader->context_data = context_data;
+  if( callbacks->borrow_cb == NULL ) { // blocks are copied
+    int res = alloc_read_buffer(reader);
+    if( res != TAR_OK ) {
+      reader->callbacks = NULL;
+      return res;
+    }
   }
-  entry_index = 0;
-  empty_count = 0;
-  indatablock = -1;
-  read_buffer[TAR_BLOCK_SIZE] = 0;
+  reader->indatablock = -1;
   return TAR_OK;
 }
 
 
-int tar_datablock_step() {
+// one run of data blocks is read and written per step, the end callback comes with the last one
+static int tar_datablock_step(tar_reader_t *reader) {
 
-  static int block_read = 0;
-
-  if(num_blocks_iterator < num_blocks) {
-    if( block_read == 0 ) {
-      if(read_block( read_buffer ) != 0) {
-        tar_abort("Could not read block. File too short.", 1);
-        tar_error = TAR_ERR_READBLOCK_FAIL;
-        return tar_error;
-      }
-      block_read = 1;
-    } else {
-      int res = expand_tar_data_block();
-      if( res != 0 ) {
-        tar_abort("Data callback failed", 1);
-        return res;
-      }
-      block_read = 0;
+  if(reader->num_blocks_iterator < reader->num_blocks) {
+    int blocks = read_blocks(reader, reader->num_blocks - reader->num_blocks_iterator);
+    if(blocks <= 0) {
+      tar_abort(reader, "Could not read block. File too short.", 1);
+      reader->error = TAR_ERR_READBLOCK_FAIL;
+      return reader->error;
     }
-    return TAR_CONTINUE;
-  } else {
-    indatablock = -1;
-    if(read_tar_callbacks->end_cb(&header_translated, entry_index, read_context_data) != 0) {
-      tar_abort("End callback failed.", 1);
-      tar_error = TAR_ERR_FOOTERCB_FAIL;
-      return tar_error;
+    int res = expand_tar_data_blocks(reader, blocks);
+    if( res != 0 ) {
+      tar_abort(reader, "Data callback failed", 1);
+      return res;
     }
-    entry_index++;
-    return TAR_ERROR;
+    if(reader->num_blocks_iterator < reader->num_blocks)
+      return TAR_CONTINUE;
+  }
+  reader->indatablock = -1;
+  if(reader->callbacks->end_cb(&reader->header, reader->entry_index, reader->context_data) != 0) {
+    tar_abort(reader, "End callback failed.", 1);
+    reader->error = TAR_ERR_FOOTERCB_FAIL;
+    return reader->error;
   }
+  reader->entry_index++;
+  return TAR_ERROR;
 }
 
 
-int tar_step() {
+// each step reads one header block or one run of data blocks, and is done with it when it returns (see borrow_cb)
+static int tar_step(tar_reader_t *reader) {
 
-  static int readstep = 0;
-
-  if( tar_error != TAR_OK ) {
-    tar_abort("tar expanding interrupted!", 1);
-    return tar_error;
+  if( reader->error != TAR_OK ) {
+    tar_abort(reader, "tar expanding interrupted!", 1);
+    return reader->error;
   }
 
-  if( indatablock == 0 ) {
-    return tar_datablock_step();
+  if( reader->indatablock == 0 ) {
+    return tar_datablock_step(reader);
   }
 
-  if(empty_count >= 2) {
-    tar_abort("tar expanding done!", 0);
+  if(reader->empty_count >= 2) {
+    tar_abort(reader, "tar expanding done!", 0);
     return TAR_EXPANDING_DONE;
   }
 
-  if( readstep == 0 ) {
-    if(read_block( read_buffer ) != 0) {
-      tar_abort("tar expanding done!", 0);
-      return TAR_ERROR;
-    }
-    readstep = 1;
-    return TAR_OK;
-  } else {
-    readstep = 0;
+  if(read_blocks(reader, 1) != 1) {
+    tar_abort(reader, "tar expanding done!", 0);
+    return TAR_ERROR;
   }
 
-  // If we haven't yet determined what format to support, read the
-  // header of the next entry, now. This should be done only at the
-  // top of the archive.
-  if( parse_header(read_buffer, &header) != 0) {
-      tar_abort("Could not understand the header of the first entry in the TAR.", 1);
-      tar_error = TAR_ERR_HEADERPARSE_FAIL;
-      return tar_error;
-  } else if(strlen(header.filename) == 0) {
-      empty_count++;
-      //entry_index++;
+  // the header is read in place, an empty name marks the end of the archive
+  if(reader->current_block[0] == 0) {
+      reader->empty_count++;
+      //reader->entry_index++;
       return TAR_OK;
   } else {
-    if(translate_header(&header, &header_translated) != 0) {
-      tar_abort("Could not translate header.", 1);
-      tar_error = TAR_ERR_HEADERTRANS_FAIL;
-      return tar_error;
+    if(translate_header((header_t*)reader->current_block, &reader->header) != 0) {
+      tar_abort(reader, "Could not understand the header, bad checksum.", 1);
+      reader->error = TAR_ERR_HEADERPARSE_FAIL;
+      return reader->error;
     }
 
-    if(read_tar_callbacks->header_cb(&header_translated, entry_index, read_context_data) != 0) {
-      tar_abort("An error occured during Header callback.", 1);
-      tar_error = TAR_ERR_HEADERCB_FAIL;
-      return tar_error;
+    int res = reader->callbacks->header_cb(&reader->header, reader->entry_index, reader->context_data);
+    reader->header.raw = NULL; // the block is gone after this step
+    if(res != 0) {
+      tar_abort(reader, "An error occured during Header callback.", 1);
+      reader->error = TAR_ERR_HEADERCB_FAIL;
+      return reader->error;
     }
-    num_blocks_iterator = 0;
-    received_bytes = 0;
-    num_blocks = GET_NUM_BLOCKS(header_translated.filesize);
-    indatablock = 0;
-
-    int res = tar_datablock_step();
-    if( num_blocks > 0 && res < 0 ) {
-      char message[200];
-      snprintf(message, 200, "tar_datablock_step return code (%d)", res );
-      log_error(message);
-      return res;
+    reader->num_blocks_iterator = 0;
+    reader->received_bytes = 0;
+    reader->num_blocks = GET_NUM_BLOCKS(reader->header.filesize);
+    reader->indatablock = 0;
+
+    if( reader->num_blocks == 0 ) { // no data blocks, the entry ends here
+      res = tar_datablock_step(reader);
+      return res == TAR_ERROR ? TAR_OK : res;
     }
     return TAR_OK;
   }
@@ -373,21 +321,21 @@ int tar_step() {
 }
 
 
-int read_tar_step() {
-  if( read_tar_callbacks == NULL ) {
-    //tar_abort("No callbacks defined!", 1);
+int read_tar_step( tar_reader_t *reader ) {
+  if( reader->callbacks == NULL ) {
+    //tar_abort(reader, "No callbacks defined!", 1);
     return TAR_ERROR;
   }
-  int res = tar_step();
+  int res = tar_step(reader);
 
   if( res < 0 ) {
     if( res != TAR_ERROR ) {
       char message[200];
       snprintf(message, 200, "read_tar return code (%d)", res );
-      tar_abort(message, 1);
+      tar_abort(reader, message, 1);
       return res;
     } else {
-      //tar_abort("Unpacking success!", 0);
+      //tar_abort(reader, "Unpacking success!", 0);
       return TAR_OK;
     }
   } else {
@@ -396,89 +344,26 @@ int read_tar_step() {
 }
 
 
-int read_tar( entry_callbacks_t *callbacks, void *context_data) {
-  if( read_tar_callbacks != NULL ) {
-    read_tar_callbacks = NULL;
+// whole archive in one call, the reader lives on the stack
+int read_tar( entry_callbacks_t *callbacks, void *context_data ) {
+  tar_reader_t reader;
+  int res = tar_setup(&reader, callbacks, context_data);
+
+  // the end of the file is represented by two empty entries, a stream ending earlier ends the archive too
+  while( res == TAR_OK && reader.callbacks != NULL ) {
+    res = read_tar_step(&reader);
   }
-  read_tar_callbacks = callbacks;
-  read_context_data = context_data;
-  read_buffer = (unsigned char*)malloc(TAR_BLOCK_SIZE + 1);
-
-  entry_index = 0;
-  empty_count = 0;
-  indatablock = -1;
-
-  read_buffer[TAR_BLOCK_SIZE] = 0;
-  // The end of the file is represented by two empty entries (which we
-  // expediently identify by filename length).
-
-  while(empty_count < 2) {
-    if(read_block( read_buffer ) != 0)
-        break;
-
-    // If we haven't yet determined what format to support, read the
-    // header of the next entry, now. This should be done only at the
-    // top of the archive.
-
-    if(parse_header(read_buffer, &header) != 0) {
-      tar_abort("Could not understand the header of the first entry in the TAR.", 1);
-      tar_error = TAR_ERR_HEADERPARSE_FAIL;
-      return tar_error;
-    } else if(strlen(header.filename) == 0) {
-      empty_count++;
-    } else {
-      if(translate_header(&header, &header_translated) != 0) {
-        tar_abort("Could not translate header.", 1);
-        tar_error = TAR_ERR_HEADERTRANS_FAIL;
-        return tar_error;
-      }
-      if(callbacks->header_cb(&header_translated, entry_index, context_data) != 0) {
-        tar_abort("An error occured during Header callback.", 1);
-        tar_error = TAR_ERR_HEADERCB_FAIL;
-        return tar_error;
-      }
-      int i = 0;
-      received_bytes = 0;
-      num_blocks = GET_NUM_BLOCKS(header_translated.filesize);
-      while(i < num_blocks) {
-        if(read_block( read_buffer ) != 0) {
-          tar_abort("Could not read block. File too short.", 1);
-          tar_error = TAR_ERR_READBLOCK_FAIL;
-          return tar_error;
-        }
-
-        if(i >= num_blocks - 1)
-          current_data_size = get_last_block_portion_size(header_translated.filesize);
-        else
-          current_data_size = TAR_BLOCK_SIZE;
-
-        read_buffer[current_data_size] = 0;
-
-        if(callbacks->write_cb(&header_translated, entry_index, context_data, read_buffer, current_data_size) != 0) {
-          tar_abort("Data callback failed.", 1);
-          tar_error = TAR_ERR_DATACB_FAIL;
-          return tar_error;
-        }
-        i++;
-        received_bytes += current_data_size;
-      }
-      if(callbacks->end_cb(&header_translated, entry_index, context_data) != 0) {
-        tar_abort("End callback failed.", 1);
-        tar_error = TAR_ERR_FOOTERCB_FAIL;
-        return tar_error;
-      }
-    }
-    entry_index++;
+  if( reader.callbacks != NULL ) {
+    tar_abort(&reader, "", 0);
   }
-
-  tar_abort("tar expanding done!", 0);
-  return TAR_OK;
+  return res == TAR_EXPANDING_DONE ? TAR_OK : res;
 }
 
 
 void dump_header(header_translated_t *header) {
   if( !tar_debug_logger ) return;
   if( header->type == T_DIRECTORY ) return;
+  if( header->raw != NULL ) tar_copy_names(header);
   tar_debug_logger("===========================================\n");
   tar_debug_logger("      filename: %s\n", header->filename);
   tar_debug_logger("      filemode: 0%o (%llu)\n", (unsigned int)header->filemode, header->filemode);
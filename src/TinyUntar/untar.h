@@ -14,7 +14,7 @@ extern "C"
 
 
 #define IS_BASE256_ENCODED(buffer) (((unsigned char)buffer[0] & 0x80) > 0)
-#define GET_NUM_BLOCKS(filesize) (int)ceil((double)filesize / (double)TAR_BLOCK_SIZE)
+#define GET_NUM_BLOCKS(filesize) (int)(((filesize) + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE)
 
 inline int get_last_block_portion_size(int filesize);
 
@@ -50,6 +50,11 @@ inline int get_last_block_portion_size(int filesize);
 
 #define TAR_BLOCK_SIZE 512
 
+// blocks read at once by read_cb, consecutive data blocks go to write_cb in one call
+#if !defined TAR_READ_BLOCKS
+  #define TAR_READ_BLOCKS 8
+#endif
+
 #define TAR_HT_PRE11988 1
 #define TAR_HT_P10031 2
 
@@ -108,38 +113,64 @@ struct header_translated_s
   char group_name[32];
   unsigned long long device_major;
   unsigned long long device_minor;
+  const header_t *raw; // the header block, only valid in header_cb
 };
 
 typedef struct header_translated_s header_translated_t;
 
 typedef int (*entry_header_callback_t) (header_translated_t *header, int entry_index, void *context_data);
-typedef int (*entry_read_callback_t)   (unsigned char* buff, size_t buffsize );
+typedef int (*entry_read_callback_t)   (unsigned char* buff, size_t buffsize, void *context_data);
 typedef int (*entry_write_callback_t)  (header_translated_t *header, int entry_index, void *context_data, unsigned char *block, int length);
 typedef int (*entry_end_callback_t)    (header_translated_t *header, int entry_index, void *context_data);
+typedef unsigned char* (*entry_borrow_callback_t) (size_t *buffsize, void *context_data);
 
 struct entry_callbacks_s
 {
   entry_header_callback_t header_cb;
-  entry_read_callback_t read_cb;
+  entry_read_callback_t read_cb; // asked for TAR_READ_BLOCKS blocks at most
   entry_write_callback_t write_cb;
   entry_end_callback_t end_cb;
+  // optional, replaces read_cb: returns a pointer to the next bytes in the caller's buffer (no copy), valid until the
+  // next call. *buffsize is the most blocks wanted (in bytes) and is set to the bytes lent: whole blocks, at least one.
+  // Each read_tar_step() borrows once at most and is done with the blocks when it returns
+  entry_borrow_callback_t borrow_cb;
 };
 
 typedef struct entry_callbacks_s entry_callbacks_t;
 
+// parser state, one per archive being read: archives can be read in parallel or nested
+struct tar_reader_s
+{
+  entry_callbacks_t *callbacks; // NULL once the archive is done or aborted
+  void *context_data;           // passed to every callback
+  unsigned char *read_buffer;   // read_cb copy buffer, NULL with borrow_cb
+  int read_buffer_blocks;
+  unsigned char *current_block; // blocks being processed: read_buffer, or borrowed from the caller
+  header_translated_t header;   // current entry
+  int num_blocks;
+  int num_blocks_iterator;
+  int current_data_size;
+  int entry_index;
+  int empty_count;
+  int received_bytes;
+  int indatablock;
+  int error;
+};
+
+typedef struct tar_reader_s tar_reader_t;
+
 // C weirdness: these functions are also declared as extern in the C file
 __attribute__((unused))static void (*tar_error_logger)(const char* subject, ...);
 __attribute__((unused))static void (*tar_debug_logger)(const char* subject, ...);
 
-int tar_setup(  entry_callbacks_t *callbacks, void *context_data );
-void tar_abort( const char* msgstr, int iserror);
-int read_tar( entry_callbacks_t *callbacks, void *context_data);
-int read_tar_step();
+int tar_setup( tar_reader_t *reader, entry_callbacks_t *callbacks, void *context_data );
+void tar_abort( tar_reader_t *reader, const char* msgstr, int iserror );
+int read_tar( entry_callbacks_t *callbacks, void *context_data );
+int read_tar_step( tar_reader_t *reader );
 void dump_header(header_translated_t *header);
-unsigned long long decode_base256(unsigned const char *buffer);
-char *trim(char *raw, int length);
-int parse_header(unsigned const char buffer[512], header_t *header);
 int translate_header(header_t *raw_header, header_translated_t *parsed);
+// link_target, user_name and group_name are only copied on demand: call this from header_cb if needed
+int tar_copy_names(header_translated_t *header);
 enum entry_type_e get_type_from_char(char raw_type);
 
 #ifdef __cplusplus
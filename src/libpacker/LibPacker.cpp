@@ -34,6 +34,12 @@
 
 #include "LibPacker.hpp"
 
+#if LZPACKER_PARALLEL_TASKS > 1
+  #include <freertos/FreeRTOS.h>
+  #include <freertos/task.h>
+  #include <freertos/semphr.h>
+#endif
+
 
 namespace TAR
 {
@@ -56,15 +62,28 @@ namespace LZPacker
   static int outputBufferSize = 4096;// lowest possible value = 1024
 
   Stream* dstStream = nullptr;
+  static size_t dstWritten = 0; // compressed bytes written to dstStream by the buffer to stream writer
   Stream* srcStream = nullptr;
 
   void (*progressCb)( size_t progress, size_t total ) = nullptr;
-  size_t lzHeader(uint8_t* buf, bool gzip_header=true);
+  static size_t storedBytes = 0;     // last compress() call input bytes sent as stored blocks
+  static size_t compressedBytes = 0; // last compress() call input bytes sent as huffman blocks
+  size_t lzHeader(uint8_t* buf, bool gzip_header=true, int filter=UZLIB_FILTER_NONE, int filterParam=0);
   size_t lzFooter(uint8_t* buf, uint32_t outlen, uint32_t crc, bool terminate=false);
-  struct GZ::uzlib_comp* lzInit();
+  static size_t memoryBudget = LZPACKER_MEMORY_BUDGET; // per compressor, 0 = build defaults
+  static int deflateStrategy = Z_DEFAULT_STRATEGY;
+  static int filterId = UZLIB_FILTER_NONE;
+  static int filterParam = 0; // FEXTRA parameter byte (delta stride - 1)
+  static config_t lastConfig = {};
+  static struct GZ::uzlib_comp* lzAlloc(int level, size_t streamBufSize, int strategy);
+  struct GZ::uzlib_comp* lzInit(int level=LZPACKER_DEFAULT_LEVEL, size_t streamBufSize=0, int strategy=deflateStrategy);
+  size_t lzWrite(Print* stream, const uint8_t* buf, size_t len);
+  void lzFree(struct GZ::uzlib_comp* c);
+  void lzStats(struct GZ::uzlib_comp* c);
 
   // write LZ77 header
-  size_t lzHeader(uint8_t* buf, bool gzip_header)
+  // up to 18 bytes with a filter
+  size_t lzHeader(uint8_t* buf, bool gzip_header, int filter, int filterParam)
   {
     assert(buf);
     size_t len = 0;
@@ -86,11 +105,16 @@ namespace LZPacker
     //       bits 0 to 4  FCHECK  (check bits for CMF and FLG)
     //       bit  5       FDICT   (preset dictionary)
     //       bits 6 to 7  FLEVEL  (compression level)
-    buf[len++] = ((uint8_t)0x00); // FLG
+    buf[len++] = filter != UZLIB_FILTER_NONE ? 0x04 : 0x00; // FLG (gzip FEXTRA when filtered)
     for(size_t i=0;i<sizeof(int);i++)
       buf[len++] = 0; // mtime
     buf[len++] = ((uint8_t)0x04); // XFL
     buf[len++] = ((uint8_t)0x03); // OS
+    if( filter != UZLIB_FILTER_NONE ) { // XLEN, then a single subfield: SI1 SI2 LEN filter param
+      const uint8_t extra[8] = { 6, 0, UZLIB_FILTER_SI1, UZLIB_FILTER_SI2, 2, 0, (uint8_t)filter, (uint8_t)filterParam };
+      memcpy(&buf[len], extra, sizeof(extra));
+      len += sizeof(extra);
+    }
     return len;
   }
 
@@ -112,261 +136,856 @@ namespace LZPacker
   }
 
 
-  // uzlib comp object initializer
-  struct GZ::uzlib_comp* lzInit()
+  // compressor memory block: lzAlloc() allocates this header, the hash table, the hash chains,
+  // the symbol buffer and the stream buffers (history window, staging buffers, spill buffer) in one go
+  struct LZBlock
+  {
+    struct GZ::uzlib_comp comp; // first member: a compressor address is its block address
+    config_t config;
+    unsigned char* inputBuffer;  // stream mode staging buffers, config.io_buffer bytes each
+    unsigned char* outputBuffer;
+  };
+
+
+  static size_t lzAlign(size_t n)
+  {
+    return (n + 7) & ~(size_t)7;
+  }
+
+
+  // stream mode spill buffer size: blocks left open across chunks (Z_NO_FLUSH) are emitted
+  // in one go, the spill buffer holds the part of a dynamic block that doesn't fit the output
+  static size_t lzSpillSize(const config_t& cfg)
+  {
+    return lzAlign(GZ::zlib_huff_spill_size(cfg.symbol_buffer));
+  }
+
+
+  // bytes allocated by lzAlloc() for a given layout, the stream spill buffer included,
+  // plus the level 10 working memory
+  static size_t lzFootprint(const config_t& cfg)
+  {
+    size_t n = lzAlign(sizeof(LZBlock)) + cfg.optimal;
+    if( cfg.hash_bits > 0 )
+      n += lzAlign(sizeof(GZ::uzlib_hash_entry_t) << cfg.hash_bits);
+    if( cfg.chain_bits > 0 )
+      n += lzAlign(sizeof(uint16_t) << cfg.chain_bits);
+    n += lzAlign(GZ::zlib_huff_size(cfg.symbol_buffer));
+    if( cfg.io_buffer > 0 ) { // stream mode
+      if( cfg.history > 0 )
+        n += lzAlign(cfg.history + cfg.io_buffer);
+      n += 2*lzAlign(cfg.io_buffer) + lzSpillSize(cfg);
+    }
+    return n;
+  }
+
+
+  // compressor layouts by increasing footprint, history and staging buffers only apply to stream mode.
+  // Row 6 is the ESP32 build default (~100KB in stream mode), row 3 is close to the ESP8266 one.
+  static const struct
+  {
+    uint8_t hash_bits, chain_bits;
+    uint16_t symbol_buffer, history, io_buffer;
+  } lzLayouts[] =
+  {
+    /* 0 */ {  9,  0,     0,     0,   512 },
+    /* 1 */ { 10,  9,     0,  1024,   512 },
+    /* 2 */ { 10, 10,  3072,  2048,  1024 },
+    /* 3 */ { 11, 11,  6144,  4096,  1024 },
+    /* 4 */ { 11, 12,  6144,  8192,  2048 },
+    /* 5 */ { 12, 12, 12288, 16384,  4096 },
+    /* 6 */ { 12, 13, 16384, 32768,  4096 },
+    /* 7 */ { 13, 14, 32768, 32768,  8192 },
+    /* 8 */ { 14, 15, 49152, 32768, 16384 },
+    /* 9 */ { 15, 15, 49152, 32768, 16384 },
+  };
+
+
+  // streamBufSize > 0 for stream mode, it sets the staging buffers size when there's no budget
+  static config_t lzConfig(size_t budget, int level, size_t streamBufSize, int strategy=Z_DEFAULT_STRATEGY)
+  {
+    config_t cfg = {};
+    bool chains = level != 0; // every level but 0 (store only) walks hash chains
+    bool matches = strategy != Z_RLE && strategy != Z_HUFFMAN_ONLY; // no hash table nor history for these
+    cfg.budget = budget;
+    if( level > 9 && matches ) {
+      cfg.optimal = GZ::uzlib_optimal_size(UZLIB_OPTIMAL_SEGMENT);
+      if( budget == 0 )
+        budget = (size_t)-1; // optimal parsing is meant for offline builds: largest layout unless a budget is set
+    }
+
+    if( budget == 0 ) { // build defaults
+      cfg.hash_bits     = matches ? 12 : 0;
+      cfg.chain_bits    = matches && chains ? LZPACKER_CHAIN_BITS : 0;
+      cfg.symbol_buffer = LZPACKER_SYMBOL_BUFFER_SIZE;
+      cfg.history       = matches && streamBufSize > 0 ? LZPACKER_STREAM_HISTORY_SIZE : 0;
+      cfg.io_buffer     = streamBufSize;
+    } else {
+      // pick the largest layout that fits, the smallest one if none does
+      for( size_t i = 0; i < sizeof(lzLayouts)/sizeof(lzLayouts[0]); i++ ) {
+        config_t next = cfg;
+        next.hash_bits     = matches ? lzLayouts[i].hash_bits : 0;
+        next.chain_bits    = matches && chains ? lzLayouts[i].chain_bits : 0;
+        next.symbol_buffer = lzLayouts[i].symbol_buffer;
+        next.history       = matches && streamBufSize > 0 ? lzLayouts[i].history : 0;
+        next.io_buffer     = streamBufSize > 0 ? lzLayouts[i].io_buffer : 0;
+        if( i > 0 && lzFootprint(next) > budget )
+          break;
+        cfg = next;
+      }
+    }
+    if( level == 0 && cfg.symbol_buffer == 0 )
+      cfg.symbol_buffer = 3072; // level 0 emits stored blocks from the symbol buffer
+    cfg.footprint = lzFootprint(cfg);
+    if( cfg.optimal > 0 && cfg.footprint > budget ) // level 10 doesn't fit the budget, lzAlloc() uses level 9
+      return lzConfig(cfg.budget, 9, streamBufSize, strategy);
+    return cfg;
+  }
+
+
+  void setMemoryBudget(size_t bytes)
+  {
+    memoryBudget = bytes;
+  }
+
+
+  void setStrategy(int strategy)
+  {
+    if( strategy != Z_DEFAULT_STRATEGY && strategy != Z_RLE && strategy != Z_HUFFMAN_ONLY ) {
+      log_w("Unsupported strategy %d, using Z_DEFAULT_STRATEGY", strategy);
+      strategy = Z_DEFAULT_STRATEGY;
+    }
+    deflateStrategy = strategy;
+  }
+
+
+  void setFilter(int filter, int deltaStride)
   {
-    auto c = (struct GZ::uzlib_comp*)calloc(1, sizeof(struct GZ::uzlib_comp)+1);
-    if( c == NULL ) {
-      log_e("unable to alloc %d bytes for compressor", sizeof(struct GZ::uzlib_comp)+1);
-      return nullptr;
+    struct GZ::uzlib_filter f;
+    int param = filter == UZLIB_FILTER_DELTA ? deltaStride - 1 : 0;
+    if( GZ::uzlib_filter_init(&f, filter, param, 1) != 0 ) {
+      log_w("Unsupported filter %d (stride %d), using UZLIB_FILTER_NONE", filter, deltaStride);
+      filter = UZLIB_FILTER_NONE;
+      param = 0;
     }
+    filterId = filter;
+    filterParam = param;
+  }
+
+
+  config_t getConfig(size_t budget, int level, bool stream)
+  {
+    return lzConfig(budget, level, stream ? 4096 : 0, deflateStrategy);
+  }
+
+
+  config_t getLastConfig()
+  {
+    return lastConfig;
+  }
+
+
+  // uzlib comp object allocator, the whole compressor is a single allocation sized by
+  // the memory budget (see setMemoryBudget()), halved until it fits in the available heap.
+  // Safe to call from several tasks at once, see lzInit() for the calling task.
+  static struct GZ::uzlib_comp* lzAlloc(int level, size_t streamBufSize, int strategy)
+  {
+    config_t cfg = lzConfig(memoryBudget, level, streamBufSize, strategy);
+    if( memoryBudget > 0 && cfg.footprint > memoryBudget )
+      log_w("Memory budget (%d bytes) is below the minimal compressor size (%d bytes)", memoryBudget, cfg.footprint);
+    if( level > 9 && cfg.optimal == 0 && strategy == Z_DEFAULT_STRATEGY ) {
+      log_w("Level 10 needs %d bytes of working memory, over the memory budget (%d bytes): using level 9", GZ::uzlib_optimal_size(UZLIB_OPTIMAL_SEGMENT), memoryBudget);
+      level = 9;
+    }
+
+    uint8_t* mem = nullptr;
+    while( (mem = (uint8_t*)malloc(cfg.footprint)) == nullptr ) {
+      config_t smaller = lzConfig(cfg.footprint/2, level, streamBufSize, strategy);
+      if( smaller.footprint >= cfg.footprint ) {
+        log_e("unable to alloc %d bytes for compressor", cfg.footprint);
+        return nullptr;
+      }
+      log_w("unable to alloc %d bytes for compressor, trying %d bytes", cfg.footprint, smaller.footprint);
+      smaller.budget = cfg.budget;
+      cfg = smaller;
+    }
+
+    auto block = (LZBlock*)mem;
+    auto c = &block->comp;
+    size_t hash_size  = cfg.hash_bits > 0 ? sizeof(GZ::uzlib_hash_entry_t) << cfg.hash_bits : 0;
+    size_t chain_size = cfg.chain_bits > 0 ? sizeof(uint16_t) << cfg.chain_bits : 0;
+    memset(block, 0, sizeof(LZBlock));
+    block->config = cfg;
+    mem += lzAlign(sizeof(LZBlock));
 
     c->dict_size   = 32768;
-    c->hash_bits   = 12;
+    c->hash_bits   = cfg.hash_bits;
     c->grow_buffer = 1;
-    size_t hash_size = sizeof(GZ::uzlib_hash_entry_t) * (1 << c->hash_bits);
-    c->hash_table = (const uint8_t**)calloc(hash_size, sizeof(uint8_t));
-    if( c->hash_table == NULL ) {
-      printf("lz77 error: unable to allocate %d bytes for hash table\n", hash_size );
-      return nullptr;
+    if( hash_size > 0 ) { // Z_RLE and Z_HUFFMAN_ONLY don't search for matches
+      c->hash_table = (const uint8_t**)mem;
+      memset(mem, 0, hash_size);
+      mem += lzAlign(hash_size);
     }
     c->checksum_type = TINF_CHKSUM_CRC;
     c->checksum_cb = GZ::uzlib_crc32;    // more reliable but slightly slower
     // comp.checksum_cb = uzlib_adler32; // slightly faster but more prone to checksum miss
     c->checksum = ~0;
+    if( GZ::uzlib_deflate_level(c, level) < 0 ) {
+      log_w("Invalid compression level %d, using %d", level, LZPACKER_DEFAULT_LEVEL);
+      GZ::uzlib_deflate_level(c, LZPACKER_DEFAULT_LEVEL);
+    }
+    c->strategy = strategy;
+    // hash chains are optional: one candidate per hash bucket without them
+    if( c->max_chain > 1 && chain_size > 0 ) {
+      c->prev_bits = cfg.chain_bits;
+      c->hash_prev = (uint16_t*)mem;
+      memset(mem, 0, chain_size);
+      mem += lzAlign(chain_size);
+    }
+    // dynamic huffman blocks are optional: static huffman blocks without a symbol buffer
+    GZ::zlib_huff_place(c, cfg.symbol_buffer > 0 ? mem : nullptr, cfg.symbol_buffer);
+    mem += lzAlign(GZ::zlib_huff_size(cfg.symbol_buffer));
+    if( cfg.io_buffer > 0 ) { // stream mode
+      if( cfg.history > 0 ) { // keep compression history across chunks
+        c->window = mem;
+        c->window_size = cfg.history + cfg.io_buffer;
+        c->dict_size = cfg.history;
+        mem += lzAlign(c->window_size);
+      }
+      block->inputBuffer = mem;
+      block->outputBuffer = mem + lzAlign(cfg.io_buffer);
+      c->spill = mem + 2*lzAlign(cfg.io_buffer); // not owned: uzlib_deflate_end_stream() won't free it
+      c->spill_size = lzSpillSize(cfg);
+    }
     if( LZPacker::progressCb != nullptr )
       c->progress_cb = LZPacker::progressCb;
+    c->adaptive = LZPACKER_ADAPTIVE;
 
     c->outbuf = NULL;
+    log_d("Compressor: %d bytes (hash=%d bits, chains=%d bits, symbols=%d, history=%d, buffers=2x%d)",
+      cfg.footprint, cfg.hash_bits, c->prev_bits, cfg.symbol_buffer, cfg.history, cfg.io_buffer);
     return c;
   }
 
-  // LZ77 Stream writer e.g. size_t compressed_size = LZStreamWriter::write(uncompressedBytes, count)
-  class LZStreamWriter : public Stream
+
+  // uzlib comp object initializer, same as lzAlloc() and keeps its layout for getLastConfig()
+  struct GZ::uzlib_comp* lzInit(int level, size_t streamBufSize, int strategy)
+  {
+    auto c = lzAlloc(level, streamBufSize, strategy);
+    if( c )
+      lastConfig = ((LZBlock*)c)->config;
+    return c;
+  }
+
+  // uzlib comp object destructor, for compressors created with lzInit() or lzAlloc()
+  void lzFree(struct GZ::uzlib_comp* c)
+  {
+    GZ::zlib_huff_free(c);
+    GZ::uzlib_deflate_end_stream(c);
+    free(c);
+  }
+
+  // write len bytes to stream, retrying after short writes, returns the bytes actually written
+  size_t lzWrite(Print* stream, const uint8_t* buf, size_t len)
+  {
+    size_t done = 0;
+    while( done < len ) {
+      size_t written = stream->write(buf + done, len - done);
+      if( written == 0 || written > len - done )
+        break;
+      done += written;
+    }
+    return done;
+  }
+
+
+  // keep the stored/compressed stats of a finished compressor, see getStats()
+  void lzStats(struct GZ::uzlib_comp* c)
+  {
+    storedBytes = c->stored_bytes;
+    compressedBytes = c->compressed_bytes;
+    log_d("Stored %d bytes, compressed %d bytes", storedBytes, compressedBytes);
+  }
+
+
+  void getStats(size_t* stored, size_t* compressed)
+  {
+    if( stored )
+      *stored = storedBytes;
+    if( compressed )
+      *compressed = compressedBytes;
+  }
+
+
+  #if LZPACKER_PARALLEL_TASKS > 1
+
+  // one block of a parallel compression
+  struct LZBlockJob
   {
-  private:
-    Stream* dstStream;
+    const uint8_t* src;    // block start, up to 32KB before it are used as dictionary
     size_t srcLen;
-    const size_t bufSize = 4096;
-    size_t outputBufIdx = 0;
-    unsigned char* outputBuffer = nullptr;
-    unsigned char* inputBuffer = nullptr;
-    struct GZ::uzlib_comp* compressor = nullptr;
-    GZ::uzlib_stream uzstream;
-    int prev_state;
-    size_t dstLen;           // gz output size
-    size_t total_bytes = 0;  // progress meter and end health check
-    int defl_mode = Z_BLOCK; // gz loop control
-    bool success = false;    // return status
-    bool in_loop = false;    // stream loop control
-
-  public:
-
-    LZStreamWriter() { }
-
-    LZStreamWriter(Stream* dstStream, size_t srcLen, const size_t bufSize=4096) : dstStream(dstStream), srcLen(srcLen), bufSize(bufSize)
-    {
-      assert(dstStream);
-      setup();
+    size_t dictLen;
+    bool last;             // ends with the final deflate block, otherwise with a sync flush
+    int level;
+    uint8_t* out;          // compressed block, malloc'd
+    size_t outLen;
+    uint32_t crc;          // crc32 of the block
+    size_t stored;         // input bytes sent as stored blocks
+    size_t compressed;     // input bytes sent as huffman blocks
+    config_t config;       // compressor layout, for getLastConfig()
+    bool done;             // compression succeeded
+    SemaphoreHandle_t sem; // given by the worker task, nullptr when the job runs in the calling task
+  };
+
+
+  // runs in the worker tasks too: lzAlloc() only, lastConfig is set by compressParallel()
+  static bool compressBlock(LZBlockJob* job)
+  {
+    job->out = nullptr;
+    auto c = lzAlloc(job->level, 0, deflateStrategy);
+    if( !c )
+      return false;
+    job->config = ((LZBlock*)c)->config;
+    c->progress_cb = nullptr; // progress is reported by the calling task
+    c->outsize = job->srcLen + job->srcLen/8 + 64; // worst case, no realloc
+    c->outbuf = (unsigned char*)malloc(c->outsize);
+    if( c->outbuf ) {
+      GZ::uzlib_compress_dict(c, job->src - job->dictLen, job->dictLen);
+      if( job->last ) {
+        GZ::zlib_start_block(c);
+        GZ::uzlib_compress(c, job->src, job->srcLen);
+        GZ::zlib_finish_block(c);
+      } else {
+        GZ::zlib_next_block(c);
+        GZ::uzlib_compress(c, job->src, job->srcLen);
+        GZ::zlib_empty_block(c); // sync flush: byte aligned, the next block can be appended
+      }
+      job->out = c->outbuf;
+      job->outLen = c->outlen;
+      job->crc = ~GZ::uzlib_crc32(job->src, job->srcLen, ~0);
+      job->stored = c->stored_bytes;
+      job->compressed = c->compressed_bytes;
+    } else {
+      log_e("unable to alloc %d bytes for compressed block", c->outsize);
     }
+    lzFree(c);
+    return job->out != nullptr;
+  }
 
-    ~LZStreamWriter()
-    {
-      free(compressor->hash_table);
-      compressor->hash_table = NULL;
-      if( compressor->outbuf != NULL )
-        free(compressor->outbuf);
-      if( outputBuffer )
-        free(outputBuffer);
-      if( inputBuffer )
-        free(inputBuffer);
-      if( compressor )
-        free(compressor);
-    };
 
+  static void compressBlockTask(void* arg)
+  {
+    auto job = (LZBlockJob*)arg;
+    job->done = compressBlock(job);
+    xSemaphoreGive(job->sem);
+    vTaskDelete(NULL);
+  }
 
-    size_t size()
-    {
-      return success ? dstLen : -1;
+
+  // pigz-style buffer to stream: batches of LZPACKER_PARALLEL_TASKS blocks are compressed concurrently,
+  // then written in order as a single gzip member, crc32 is combined from the blocks crcs
+  static size_t compressParallel( uint8_t* srcBuf, size_t srcBufLen, Stream* dstStream, int level )
+  {
+    log_d("Parallel compression (%d tasks, %d bytes blocks)", LZPACKER_PARALLEL_TASKS, LZPACKER_PARALLEL_BLOCK_SIZE);
+    LZBlockJob jobs[LZPACKER_PARALLEL_TASKS];
+    uint32_t crc = 0;
+    size_t pos = 0;
+    bool success = true;
+    storedBytes = compressedBytes = 0;
+
+    uint8_t header[18];
+    size_t header_len = lzHeader(header, true, filterId, filterParam);
+    size_t dstLen = lzWrite(dstStream, header, header_len);
+    if( dstLen != header_len ) {
+      log_e("Failed to write lz header");
+      return 0;
     }
 
-    void setup()
-    {
-      if( srcLen == 0) {
-        log_e("Bad source length, aborting");
-        return;
-      }
-      if(!dstStream) {
-        log_e("No destination stream, aborting");
-        return;
+    if( progressCb )
+      progressCb(0, srcBufLen);
+
+    while( success && pos < srcBufLen ) {
+      int count = 0;
+      for( ; count<LZPACKER_PARALLEL_TASKS && pos<srcBufLen; count++ ) {
+        auto job = &jobs[count];
+        job->src     = srcBuf + pos;
+        job->srcLen  = srcBufLen - pos < LZPACKER_PARALLEL_BLOCK_SIZE ? srcBufLen - pos : LZPACKER_PARALLEL_BLOCK_SIZE;
+        job->dictLen = pos < 32768 ? pos : 32768;
+        job->level   = level;
+        job->done    = false;
+        job->sem     = nullptr;
+        job->out     = nullptr; // freed by the collect loop whether the job ran or not
+        job->outLen  = 0;
+        pos += job->srcLen;
+        job->last    = pos == srcBufLen;
+        if( count == 0 ) // first block of the batch is compressed by the calling task
+          continue;
+        job->sem = xSemaphoreCreateBinary();
+        if( job->sem && xTaskCreate(compressBlockTask, "lzblock", 8192, job, uxTaskPriorityGet(NULL), NULL) != pdPASS ) {
+          vSemaphoreDelete(job->sem);
+          job->sem = nullptr;
+        }
       }
 
-      uint8_t header[10];
-      size_t header_size = LZPacker::lzHeader(header);
-      dstLen = dstStream->write(header, header_size);
-      if( dstLen == 0 ) {
-        log_e("Failed to write lz header");
-        return;
-      }
+      jobs[0].done = compressBlock(&jobs[0]);
 
-      outputBuffer = (unsigned char*)malloc(bufSize);
-      if(!outputBuffer) {
-        log_e("Failed to malloc %d bytes", bufSize);
+      for( int i=0; i<count; i++ ) {
+        auto job = &jobs[i];
+        if( job->sem ) {
+          xSemaphoreTake(job->sem, portMAX_DELAY);
+          vSemaphoreDelete(job->sem);
+        }
+        if( !success ) {
+          free(job->out);
+          job->out = nullptr;
+          continue;
+        }
+        // task could not be created or ran out of memory: retry here, the previous blocks are freed by now
+        if( !job->done && !(job->done = compressBlock(job)) ) {
+          log_e("Failed to compress block at offset %d", job->src - srcBuf);
+          success = false;
+          continue;
+        }
+        size_t written_bytes = lzWrite(dstStream, job->out, job->outLen);
+        free(job->out);
+        job->out = nullptr;
+        if( written_bytes != job->outLen ) {
+          log_e("Write failed at offset %d", job->src - srcBuf);
+          success = false;
+          continue;
+        }
+        dstLen += written_bytes;
+        crc = job->src == srcBuf ? job->crc : GZ::uzlib_crc32_combine(crc, job->crc, job->srcLen);
+        storedBytes += job->stored;
+        compressedBytes += job->compressed;
       }
 
-      inputBuffer = (unsigned char*)malloc(bufSize);
-      if(!inputBuffer) {
-        log_e("Failed to malloc %d bytes", bufSize);
-      }
+      if( success ) // every block of the batch is collected, the workers are done
+        lastConfig = jobs[count-1].config;
 
-      compressor = LZPacker::lzInit();
+      if( progressCb )
+        progressCb(pos, srcBufLen);
+    }
 
-      if(!compressor)
-        return;
+    if( !success )
+      return 0;
+
+    log_d("Stored %d bytes, compressed %d bytes", storedBytes, compressedBytes);
+
+    uint8_t footer[8];
+    size_t footer_len = lzFooter(footer, srcBufLen, crc);
+    if( lzWrite(dstStream, footer, footer_len) != footer_len ) {
+      log_e("Failed to write lz footer");
+      return 0;
+    }
+    return dstLen + footer_len;
+  }
+
+  #endif // LZPACKER_PARALLEL_TASKS > 1
+
+
+  // LZ77 Stream writer e.g. size_t compressed_size = LZStreamWriter::write(uncompressedBytes, count)
+  LZStreamWriter::LZStreamWriter(Print* dstStream, size_t srcLen, size_t bufSize, int level, int filter, int filterParam) : dstStream(dstStream), srcLen(srcLen), bufSize(bufSize), level(level)
+  {
+    assert(dstStream);
+    if( filter < 0 ) {
+      filter = LZPacker::filterId;
+      filterParam = LZPacker::filterParam;
+    }
+    setup(filter, filterParam);
+  }
+
+
+  LZStreamWriter::~LZStreamWriter()
+  {
+    if( compressor ) {
+      LZPacker::lzStats(compressor);
+      if( compressor->outbuf != NULL )
+        free(compressor->outbuf);
+      LZPacker::lzFree(compressor); // also holds the staging buffers
+    }
+    free(filter);
+  }
+
+
+  size_t LZStreamWriter::size()
+  {
+    return success ? dstLen : -1;
+  }
 
-      compressor->checksum_type = TINF_CHKSUM_CRC;
-      compressor->writeDestByte = NULL;
-      compressor->slen = srcLen;
 
-      prev_state = uzlib_deflate_init_stream(compressor, &uzstream);
+  void LZStreamWriter::setup(int id, int param)
+  {
+    if(!dstStream) {
+      log_e("No destination stream, aborting");
+      return;
+    }
 
-      if(prev_state != Z_OK) {
-        log_e("failed to init lz77");
+    if( id != UZLIB_FILTER_NONE ) {
+      filter = (struct GZ::uzlib_filter*)malloc(sizeof(struct GZ::uzlib_filter));
+      if( !filter || GZ::uzlib_filter_init(filter, id, param, 1) != 0 ) {
+        log_e("Unable to setup filter %d", id);
         return;
       }
+    }
 
-      uzstream.out.avail = bufSize;
-      total_bytes = 0;      // reset processed bytes
-      outputBufIdx = 0;     // reset buffer index
-      defl_mode  = Z_BLOCK; // init GZ loop
-      in_loop = true;       // ready to loop
-      success = true;       // reset success state
+    uint8_t header[18];
+    size_t header_size = LZPacker::lzHeader(header, true, id, param);
+    dstLen = LZPacker::lzWrite(dstStream, header, header_size);
+    if( dstLen != header_size ) {
+      log_e("Failed to write lz header");
+      return;
     }
 
+    compressor = LZPacker::lzInit(level, bufSize); // history window and staging buffers included
 
-    virtual size_t write(const uint8_t* buf, size_t size)
-    {
-      if(!success || !in_loop || prev_state != Z_OK) {
-        log_d("Returning from previous error");
-        return -1;
-      }
+    if(!compressor)
+      return;
 
-      if( size > bufSize ) {
-        log_e("Writing %d bytes would overflow the %d-bytes buffer, aborting", size);
-        return -1;
-      }
+    auto block = (LZPacker::LZBlock*)compressor;
+    bufSize = block->config.io_buffer;
+    inputBuffer = block->inputBuffer;
+    outputBuffer = block->outputBuffer;
 
-      // index to write in the gz input buffer
-      size_t buf_idx = outputBufIdx%bufSize;
-      // append to buffer
-      memcpy(&inputBuffer[buf_idx], buf, size);
-      outputBufIdx += size;
-
-      if( outputBufIdx < srcLen   // not last chunk
-       && buf_idx+size < bufSize) // buffer not full
-      {
-        log_v("cached chunk %d bytes", size);
-        return size;
-      }
+    compressor->checksum_type = TINF_CHKSUM_CRC;
+    compressor->writeDestByte = NULL;
+    compressor->slen = srcLen;
+    if( srcLen == 0 )
+      compressor->progress_cb = NULL; // unknown length, no progress
 
-      // full buffer, or maybe-partial buffer if last chunk
-      size_t input_bytes =  outputBufIdx < srcLen ? bufSize : buf_idx+size;
+    prev_state = uzlib_deflate_init_stream(compressor, &uzstream);
 
-      // print some debug if in verbose mode
-      if( outputBufIdx+1 >= srcLen ) {
-        log_v("last chunk");
-      } else {
-        log_v("chunk %d bytes, now at idx %d", input_bytes, outputBufIdx);
-      }
+    if(prev_state != Z_OK) {
+      log_e("failed to init lz77");
+      return;
+    }
+
+    total_bytes = 0;      // reset processed bytes
+    outputBufIdx = 0;     // reset buffer index
+    staged = 0;
+    unflushed = 0;
+    lastFlush = millis();
+    in_loop = true;       // ready to loop
+    success = true;       // reset success state
+  }
 
-      if(uzstream.out.avail > 0) {
-        total_bytes += input_bytes;
 
-        if( compressor->progress_cb )
-            compressor->progress_cb(total_bytes, srcLen);
+  void LZStreamWriter::setAutoFlush(uint32_t ms, size_t bytes, int mode)
+  {
+    autoFlushMs = ms;
+    autoFlushBytes = bytes;
+    autoFlushMode = mode;
+  }
 
-        uzstream.in.next   = (uint8_t*)inputBuffer;
-        uzstream.in.avail  = input_bytes;
 
-        if(total_bytes==srcLen) {
-          log_v("Last chunk");
-          defl_mode = Z_FINISH;
+  // writes of any size: whole chunks are compressed in place from buf, only a partial chunk is staged
+  size_t LZStreamWriter::write(const uint8_t* buf, size_t size)
+  {
+    if(!success || !in_loop || prev_state != Z_OK) {
+      log_d("Returning from previous error");
+      return -1;
+    }
+
+    size_t done = 0;
+    while( done < size ) {
+      const uint8_t* src = buf+done;
+      size_t len = size-done;
+      bool last = srcLen > 0 && outputBufIdx + len >= srcLen;
+      bool inplace = !filter && staged == 0 && (len >= bufSize || last);
+      if( len > bufSize - staged )
+        len = bufSize - staged;
+      if( last && len > srcLen - outputBufIdx )
+        len = srcLen - outputBufIdx;
+      if( !inplace ) {
+        memcpy(&inputBuffer[staged], src, len);
+        staged += len;
+        src = inputBuffer;
+      }
+      done += len;
+      outputBufIdx += len;
+      unflushed += len;
+
+      if( srcLen > 0 && outputBufIdx >= srcLen ) { // last chunk
+        log_v("last chunk");
+        if( !deflate(src, inplace ? len : staged, Z_FINISH) )
+          return -1;
+        if( done < size ) {
+          log_e("Read more bytes (%d) than source contains (%d), something is wrong", outputBufIdx + size - done, srcLen);
+          return -1;
         }
+      } else if( inplace || staged == bufSize ) { // full chunk: the block goes on with the next one
+        log_v("chunk %d bytes, now at idx %d", inplace ? len : staged, outputBufIdx);
+        if( !deflate(src, inplace ? len : staged, Z_NO_FLUSH) )
+          return -1;
       }
+    }
+
+    if( in_loop && ((autoFlushBytes > 0 && unflushed >= autoFlushBytes) || (autoFlushMs > 0 && (uint32_t)millis() - lastFlush >= autoFlushMs)) ) {
+      if( !flush(autoFlushMode) )
+        return -1;
+    }
+
+    return size;
+  }
+
+
+  // finish the gzip stream, required when the source length is unknown
+  bool LZStreamWriter::end()
+  {
+    if( compressor && prev_state == Z_STREAM_END )
+      return success; // already finished by write()
+    if(!success || !in_loop || prev_state != Z_OK)
+      return false;
+    if( srcLen > 0 && outputBufIdx < srcLen )
+      log_w("Ending after %d bytes out of %d", outputBufIdx, srcLen);
+    return deflate(inputBuffer, staged, Z_FINISH) && success;
+  }
+
+
+  bool LZStreamWriter::flush(int mode)
+  {
+    if(!success || !in_loop || prev_state != Z_OK)
+      return false;
+    if( unflushed > 0 && !deflate(inputBuffer, staged, mode == Z_PARTIAL_FLUSH ? Z_PARTIAL_FLUSH : Z_SYNC_FLUSH) )
+      return false;
+    unflushed = 0;
+    lastFlush = millis();
+    return true;
+  }
+
+
+  // compress len bytes (staged input or caller's memory) and send the output to dstStream
+  bool LZStreamWriter::deflate(const uint8_t* src, size_t len, int mode)
+  {
+    size_t held = 0; // filter lookahead: an instruction cut by the end of the chunk stays staged
+    if( filter )
+      held = len - GZ::uzlib_filter(filter, inputBuffer, len, mode == Z_FINISH);
+    len -= held;
+    total_bytes += len;
+    if( src == inputBuffer )
+      staged = 0;
+
+    if( compressor->progress_cb )
+      compressor->progress_cb(total_bytes, srcLen);
+
+    uzstream.in.next  = (uint8_t*)src;
+    uzstream.in.avail = len;
 
+    do { // compressed output may not fit in a single output buffer: loop until drained
       uzstream.out.next  = outputBuffer;
       uzstream.out.avail = bufSize;
 
-      prev_state = uzlib_deflate_stream(&uzstream, defl_mode);
+      prev_state = uzlib_deflate_stream(&uzstream, mode);
 
       size_t write_size = uzstream.out.next - outputBuffer;
-      size_t written_bytes = dstStream->write(outputBuffer, write_size); // write to output stream
+      if( write_size == 0 )
+        break;
+      size_t written_bytes = LZPacker::lzWrite(dstStream, outputBuffer, write_size); // write to output stream
 
-      if( written_bytes == 0 ) {
+      if( written_bytes != write_size ) {
         log_e("Write failed at offset %d", outputBufIdx );
         in_loop = false;
-        return -1;
+        success = false; // the output is truncated
+        return false;
       }
 
       dstLen += written_bytes;
+    } while( prev_state == Z_OK && uzstream.out.avail == 0 ); // full output buffer: more output may be pending
 
-      if( total_bytes > srcLen ) {
-        log_e("Read more bytes (%d) than source contains (%d), something is wrong", total_bytes, srcLen);
-        in_loop = false;
-        return -1;
-      }
+    if( held > 0 ) {
+      memmove(inputBuffer, inputBuffer + len, held);
+      staged = held;
+    }
 
-      if(prev_state==Z_STREAM_END) {
-        in_loop = false;
-        end();
-      }
+    if( prev_state != Z_OK && prev_state != Z_STREAM_END ) {
+      log_e("Compression failed at offset %d (state=%d)", outputBufIdx, prev_state );
+      in_loop = false;
+      return false;
+    }
 
-      return size;
+    if(prev_state==Z_STREAM_END) {
+      in_loop = false;
+      writeFooter();
     }
 
-    void end()
-    {
-      if(prev_state!=Z_STREAM_END) {
-        log_e("Premature end of gz stream (state=%d)", prev_state);
-        success = false;
-      }
+    return true;
+  }
 
-      if( compressor->progress_cb )
-          compressor->progress_cb(srcLen, srcLen); // send progress end signal, whatever the outcome
 
-      if( total_bytes != srcLen ) {
-        success = false;
-        int diff = srcLen - total_bytes;
-        if( diff>0 ) {
-          log_e("Bad input stream size: could not read every %d bytes, missed %d bytes.", srcLen, diff);
-          log_e("The file has been truncated, it is likely corrupted");
-        } else {
-          log_e("Bad input stream size: read %d further than %d requested bytes.", -diff, srcLen);
-          log_e("The file has been padded, it is likely corrupted");
-        }
-        // fix the size so the corrupted gzip file can be saved for inspection
-        srcLen = total_bytes;
+  void LZStreamWriter::writeFooter()
+  {
+    if(prev_state!=Z_STREAM_END) {
+      log_e("Premature end of gz stream (state=%d)", prev_state);
+      success = false;
+    }
+
+    if( srcLen == 0 ) // unknown length
+      srcLen = total_bytes;
+
+    if( compressor->progress_cb )
+        compressor->progress_cb(srcLen, srcLen); // send progress end signal, whatever the outcome
+
+    if( total_bytes != srcLen ) {
+      success = false;
+      int diff = srcLen - total_bytes;
+      if( diff>0 ) {
+        log_e("Bad input stream size: could not read every %d bytes, missed %d bytes.", srcLen, diff);
+        log_e("The file has been truncated, it is likely corrupted");
+      } else {
+        log_e("Bad input stream size: read %d further than %d requested bytes.", -diff, srcLen);
+        log_e("The file has been padded, it is likely corrupted");
       }
+      // fix the size so the corrupted gzip file can be saved for inspection
+      srcLen = total_bytes;
+    }
+
+    uint8_t footer[8];
+    size_t footer_len = 0;
+
+    footer_len = LZPacker::lzFooter(footer, srcLen, ~compressor->checksum);
+    log_v("Writing lz footer");
+    size_t written_bytes = LZPacker::lzWrite(dstStream, footer, footer_len);
+    if( written_bytes != footer_len ) {
+      log_e("Failed to write lz footer");
+      success = false;
+    }
+    dstLen += written_bytes;
+  }
 
-      uint8_t footer[8];
-      size_t footer_len = 0;
 
-      footer_len = LZPacker::lzFooter(footer, srcLen, ~compressor->checksum);
-      log_v("Writing lz footer");
-      dstLen += dstStream->write(footer, footer_len);
+  GzipLogRotator::GzipLogRotator(fs_FS* fs, const char* dir, size_t maxSegmentSize, uint32_t maxSegmentMs, int level)
+    : fs(fs), dir(dir), maxSegmentSize(maxSegmentSize), maxSegmentMs(maxSegmentMs), level(level)
+  {
+    if( this->dir.endsWith("/") )
+      this->dir.remove(this->dir.length()-1);
+  }
 
-    };
+
+  String GzipLogRotator::segmentName(uint32_t id)
+  {
+    char name[16];
+    snprintf(name, sizeof(name), "log-%05u.gz", (unsigned)id);
+    return String(name);
+  }
 
 
-    virtual size_t write(uint8_t c) { log_e("This function should not be called"); return this->write(&c, 1); }
-    virtual int available() { log_e("This function should not be called"); return 0; }
-    virtual int read() { log_e("This function should not be called"); return 0; }
-    virtual int peek() { log_e("This function should not be called"); return 0; }
+  bool GzipLogRotator::begin()
+  {
+    if(!fs) {
+      log_e("No filesystem, aborting");
+      return false;
+    }
+    if( dir.length() > 0 && !fs->exists(dir) && !fs->mkdir(dir) ) {
+      log_e("Unable to create %s", dir.c_str());
+      return false;
+    }
+    // the last index line holds the last closed segment, only the tail of the index is read
+    nextId = 1;
+    fs_File index = fs->open(indexPath(), fs_file_read);
+    if( index ) {
+      char tail[48] = {0};
+      size_t len = index.size();
+      size_t pos = len > sizeof(tail)-1 ? len - (sizeof(tail)-1) : 0;
+      index.seek(pos, fs_SeekSet);
+      len = index.read((uint8_t*)tail, sizeof(tail)-1);
+      tail[len] = '\0';
+      while( len > 0 && (tail[len-1] == '\n' || tail[len-1] == '\r') )
+        tail[--len] = '\0';
+      char* line = strrchr(tail, '\n');
+      unsigned id;
+      if( sscanf(line ? line+1 : tail, "log-%u.gz", &id) == 1 )
+        nextId = id + 1;
+      index.close();
+    }
+    // segments left open by a crash aren't indexed, they're kept as is
+    while( fs->exists(dir + "/" + segmentName(nextId)) ) {
+      log_w("Skipping unfinished segment %s", segmentName(nextId).c_str());
+      nextId++;
+    }
+    return true;
+  }
 
-  };
+
+  bool GzipLogRotator::open()
+  {
+    String path = dir + "/" + segmentName(nextId);
+    file = fs->open(path, fs_file_write);
+    if(!file) {
+      log_e("Unable to open %s", path.c_str());
+      return false;
+    }
+    gz = new GzipPrint(&file, level);
+    segmentBytes = 0;
+    segmentStart = millis();
+    log_d("Log segment %s opened", path.c_str());
+    return true;
+  }
+
+
+  bool GzipLogRotator::rotate()
+  {
+    if(!gz)
+      return true;
+    bool ret = gz->end();
+    size_t gzBytes = gz->size();
+    delete gz;
+    gz = nullptr;
+    file.close();
+
+    String name = segmentName(nextId++);
+    if(!ret) {
+      log_e("Failed to close log segment %s", name.c_str());
+      return false;
+    }
+    fs_File index = fs->open(indexPath(), fs_file_append);
+    if(!index) {
+      log_e("Unable to open %s", indexPath().c_str());
+      return false;
+    }
+    index.printf("%s,%u,%u\n", name.c_str(), (unsigned)segmentBytes, (unsigned)gzBytes);
+    index.close();
+    log_d("Log segment %s closed (%d bytes -> %d bytes)", name.c_str(), segmentBytes, gzBytes);
+    return true;
+  }
+
+
+  size_t GzipLogRotator::write(const uint8_t* buf, size_t size)
+  {
+    if( size == 0 )
+      return 0;
+    // rotate between lines, or anywhere when a line doesn't end
+    if( gz && (lineStart || gz->size() >= 2*maxSegmentSize) ) {
+      if( gz->size() >= maxSegmentSize || (maxSegmentMs > 0 && (uint32_t)millis() - segmentStart >= maxSegmentMs) )
+        rotate();
+    }
+    if(!gz && !open())
+      return 0;
+    size_t written = gz->write(buf, size);
+    segmentBytes += written;
+    lineStart = buf[size-1] == '\n';
+    return written;
+  }
 
 
-  // Stream with in/out buffers to help with uzlib custom stream compressor
+  void GzipLogRotator::flush()
+  {
+    if(gz) {
+      gz->flush();
+      file.flush();
+    }
+  }
+
+
+  void GzipLogRotator::poll()
+  {
+    if( gz && lineStart && maxSegmentMs > 0 && (uint32_t)millis() - segmentStart >= maxSegmentMs )
+      rotate();
+  }
+
+
+  // Stream with in/out buffers to help with uzlib custom stream compressor.
+  // Read mode with (buffer, size), write mode with (nullptr, 0, capacity) allocating capacity bytes once
+  // (grows if needed, see release()), or (buffer, 0, capacity) to write in a caller supplied buffer
   class LZBufferWriter : public Stream
   {
     uint8_t * buffer;
@@ -374,32 +993,62 @@ namespace LZPacker
     int readPosition;
     int size;
     size_t capacity = 0;
-    size_t grow_size = 64;
+    bool owned = false; // the buffer was allocated here
     public:
-      LZBufferWriter(uint8_t * buffer=nullptr, int size=0) : writePosition(0), readPosition(0) {
+      LZBufferWriter(uint8_t * buffer=nullptr, int size=0, size_t capacity=0) : writePosition(0), readPosition(0) {
         this->buffer = buffer;
         this->size = size;
         if( buffer == nullptr ) { // write mode
-          this->buffer = (uint8_t*)malloc(grow_size);
-          this->capacity = grow_size;
+          this->capacity = capacity > 64 ? capacity : 64;
+          this->buffer = (uint8_t*)malloc(this->capacity);
+          if( this->buffer == nullptr && this->capacity > 64 ) { // start small and grow instead
+            log_w("unable to alloc %d bytes for output, growing it instead", this->capacity);
+            this->capacity = 64;
+            this->buffer = (uint8_t*)malloc(this->capacity);
+          }
+          if( this->buffer == nullptr )
+            this->capacity = 0;
+          owned = true;
+        } else if( size == 0 ) { // write mode, caller supplied buffer
+          this->capacity = capacity;
         }
       }
+      ~LZBufferWriter() { if( owned ) free(buffer); }
       uint8_t * getBuffer() { return buffer; }
       size_t getSize() { return size; }
+      // hand the buffer over to the caller, shrunk to its size
+      uint8_t * release() {
+        if( owned && size > 0 && (size_t)size < capacity ) {
+          auto shrunk = (uint8_t*)realloc(buffer, size);
+          if( shrunk )
+            buffer = shrunk;
+        }
+        owned = false;
+        return buffer;
+      }
       // Stream methods
       virtual int available(){ return writePosition - readPosition; }
       virtual int read(){ if(readPosition == writePosition) return -1; return buffer[readPosition++]; }
       virtual int peek(){ if(readPosition == writePosition) return -1; return buffer[readPosition]; }
       virtual void flush() { readPosition=0; writePosition = 0; }
       // Print methods
-      virtual void end(){ buffer[writePosition] = '\0'; }
+      virtual void end(){ if( (size_t)writePosition < capacity ) buffer[writePosition] = '\0'; }
       virtual size_t write(uint8_t c) { return this->write(&c, 1); }
       virtual size_t write(const uint8_t* data, size_t len) {
         size_t target_size = size + len;
-        if (target_size >= capacity) {
-          while( capacity<target_size )
-              capacity += grow_size;
-          buffer = (uint8_t*)realloc(buffer, capacity);
+        if (target_size > capacity) {
+          if( !owned )
+            return 0; // caller supplied buffer is full
+          size_t grow_size = capacity + capacity/2; // geometric growth when the estimate was exceeded
+          if( grow_size < target_size )
+            grow_size = target_size;
+          auto grown = (uint8_t*)realloc(buffer, grow_size);
+          if( grown == nullptr ) {
+            log_e("unable to grow output to %d bytes", grow_size);
+            return 0;
+          }
+          buffer = grown;
+          capacity = grow_size;
         }
         memcpy(buffer + size, data, len);
         size += len;
@@ -445,39 +1094,67 @@ namespace LZPacker
   }
 
 
+  // worst case compress() output: literals cost up to 9 bits per byte (level 0 stores them), plus block
+  // framing (up to 10 bytes per chunk when compressing from a stream) and the gzip header and footer
+  size_t compressBound( size_t srcLen, int level )
+  {
+    size_t bound = srcLen + (srcLen >> 5) + 64 + 18;
+    if( filterId != UZLIB_FILTER_NONE )
+      bound += 8; // FEXTRA
+    if( level != 0 ) // lzConfig() always gives level 0 a symbol buffer
+      bound += srcLen >> 3;
+    return bound;
+  }
+
+
   // stream to buffer
-  size_t compress( Stream* srcStream, size_t srcLen, uint8_t** dstBuf )
+  size_t compress( Stream* srcStream, size_t srcLen, uint8_t** dstBuf, int level )
   {
     log_d("Stream to buffer (source=%d bytes)", srcLen);
-    LZBufferWriter dstStream(nullptr, 0);
-    size_t dstLen = LZPacker::compress( srcStream, srcLen, &dstStream);
+    LZBufferWriter dstStream(nullptr, 0, compressBound(srcLen, level));
+    size_t dstLen = LZPacker::compress( srcStream, srcLen, &dstStream, level);
     if( dstLen == 0 || dstLen != dstStream.getSize() )
       return 0;
-    *dstBuf = dstStream.getBuffer();
-    return dstStream.getSize();
+    *dstBuf = dstStream.release();
+    return dstLen;
   }
 
 
   // buffer to buffer
-  size_t compress( uint8_t* srcBuf, size_t srcBufLen, uint8_t** dstBuf )
+  size_t compress( uint8_t* srcBuf, size_t srcBufLen, uint8_t** dstBuf, int level )
   {
     log_d("Buffer to buffer (source=%d bytes)", srcBufLen);
-    LZBufferWriter dstStream(nullptr, 0);
-    size_t dstLen = LZPacker::compress( srcBuf, srcBufLen, &dstStream);
+    LZBufferWriter dstStream(nullptr, 0, compressBound(srcBufLen, level));
+    size_t dstLen = LZPacker::compress( srcBuf, srcBufLen, &dstStream, level);
     if( dstLen == 0 || dstLen != dstStream.getSize() )
       return 0;
-    *dstBuf = dstStream.getBuffer();
-    return dstStream.getSize();
+    *dstBuf = dstStream.release();
+    return dstLen;
+  }
+
+
+  // buffer to caller supplied buffer, compressBound() bytes are always enough
+  size_t compress( uint8_t* srcBuf, size_t srcBufLen, uint8_t* dstBuf, size_t dstBufSize, int level )
+  {
+    log_d("Buffer to buffer (source=%d bytes, destination=%d bytes)", srcBufLen, dstBufSize);
+    assert(dstBuf);
+    LZBufferWriter dstStream(dstBuf, 0, dstBufSize);
+    size_t dstLen = LZPacker::compress( srcBuf, srcBufLen, &dstStream, level);
+    if( dstLen == 0 || dstLen != dstStream.getSize() ) {
+      log_e("Compressed data doesn't fit in %d bytes", dstBufSize);
+      return 0;
+    }
+    return dstLen;
   }
 
 
   // stream to stream
-  size_t compress( Stream* srcStream, size_t srcLen, Stream* dstStream )
+  size_t compress( Stream* srcStream, size_t srcLen, Stream* dstStream, int level )
   {
     log_d("Stream to Stream (source=%d bytes)", srcLen);
     if( !srcStream || srcLen==0 || !dstStream )
       return -1;
-    LZPacker::LZStreamWriter lzStream( dstStream, srcLen, LZPacker::outputBufferSize );
+    LZPacker::LZStreamWriter lzStream( dstStream, srcLen, LZPacker::outputBufferSize, level );
     size_t total_source_bytes = 0;
     size_t total_gz_bytes = 0;
     unsigned char* inputBuffer  = (unsigned char*)malloc(LZPacker::inputBufferSize);
@@ -503,79 +1180,132 @@ namespace LZPacker
   }
 
 
-  // buffer to stream
-  size_t compress( uint8_t* srcBuf, size_t srcBufLen, Stream* dstStream )
+  // buffer to stream, srcBuf is already filtered if a filter is set
+  static size_t compressBuffer( uint8_t* srcBuf, size_t srcBufLen, Stream* dstStream, int level )
   {
-    log_d("Buffer to Stream (source=%d bytes)", srcBufLen);
-    assert(srcBuf);
-    assert(srcBufLen>0);
-    assert(dstStream);
+    #if LZPACKER_PARALLEL_TASKS > 1
+      if( level > 0 && srcBufLen >= 2*LZPACKER_PARALLEL_BLOCK_SIZE )
+        return compressParallel(srcBuf, srcBufLen, dstStream, level);
+    #endif
+
+    uint8_t header[18];
+    size_t header_len = lzHeader(header, true, filterId, filterParam);
+    if( lzWrite(dstStream, header, header_len) != header_len ) {
+      log_e("Failed to write lz header");
+      return 0;
+    }
 
     LZPacker::dstStream = dstStream;
-    auto c = lzInit();
+    auto c = lzInit(level);
 
     if(!c)
       return 0;
 
-    // wrap dstStream->write() in lambda byteWriter
-    c->writeDestByte  = []([[maybe_unused]]struct GZ::uzlib_comp *data, unsigned char byte) -> unsigned int {
-      return LZPacker::dstStream->write(byte);
+    // stage the output in a small span, flushed to dstStream with bulk writes
+    c->grow_buffer = 0;
+    c->outsize = LZPACKER_WRITE_BUFFER_SIZE;
+    c->outbuf = (unsigned char*)malloc(c->outsize);
+    if( c->outbuf == NULL ) {
+      log_e("unable to alloc %d bytes for output buffer", LZPACKER_WRITE_BUFFER_SIZE);
+      lzFree(c);
+      return 0;
+    }
+    dstWritten = 0;
+    c->writeDestBytes = []([[maybe_unused]]struct GZ::uzlib_comp *data, const unsigned char *buf, unsigned int len) -> unsigned int {
+      if( dstWritten != (size_t)(data->outlen - data->outpos) ) // a previous write failed, drop the output
+        return 0;
+      size_t written = lzWrite(LZPacker::dstStream, buf, len);
+      dstWritten += written;
+      return written;
     };
-    c->grow_buffer = 0; // use direct writes, don't grow output buffer
-
-    uint8_t header[10];
-    size_t header_len = lzHeader(header);
-    dstStream->write(header, header_len);
 
     GZ::zlib_start_block(c);
     GZ::uzlib_compress(c, srcBuf, srcBufLen);
     GZ::zlib_finish_block(c);
 
+    size_t dstLen = header_len + dstWritten;
+    bool success = dstWritten == (size_t)c->outlen;
+    if( !success )
+      log_e("Write failed at offset %d", dstWritten);
+
     uint8_t footer[8];
     c->checksum = c->checksum_cb(srcBuf, srcBufLen, c->checksum);
     size_t footer_len = lzFooter(footer, srcBufLen, ~c->checksum);
-    dstStream->write(footer, footer_len);
+    if( success && lzWrite(dstStream, footer, footer_len) != footer_len ) {
+      log_e("Failed to write lz footer");
+      success = false;
+    }
+    dstLen += footer_len;
 
-    free(c->hash_table);
-    c->hash_table = NULL;
-    auto ret = c->outlen;
-    free(c);
+    lzStats(c);
+    free(c->outbuf);
+    lzFree(c);
+
+    return success ? dstLen : 0;
+  }
+
+  // buffer to stream
+  size_t compress( uint8_t* srcBuf, size_t srcBufLen, Stream* dstStream, int level )
+  {
+    log_d("Buffer to Stream (source=%d bytes)", srcBufLen);
+    assert(srcBuf);
+    assert(srcBufLen>0);
+    assert(dstStream);
 
-    return header_len + ret + footer_len;
+    if( filterId == UZLIB_FILTER_NONE )
+      return compressBuffer(srcBuf, srcBufLen, dstStream, level);
+
+    // the filter works on a copy, srcBuf is left untouched
+    uint8_t* filtered = (uint8_t*)malloc(srcBufLen);
+    if( filtered == nullptr ) { // no room for a copy: filter in the stream writer staging buffer (slightly lower ratio)
+      log_d("Unable to alloc %d bytes for a filtered copy, using a stream writer", srcBufLen);
+      LZStreamWriter lzStream( dstStream, srcBufLen, LZPacker::outputBufferSize, level );
+      if( lzStream.write(srcBuf, srcBufLen) != srcBufLen || lzStream.size() == (size_t)-1 )
+        return 0;
+      return lzStream.size();
+    }
+    struct GZ::uzlib_filter filter;
+    GZ::uzlib_filter_init(&filter, filterId, filterParam, 1);
+    memcpy(filtered, srcBuf, srcBufLen);
+    GZ::uzlib_filter(&filter, filtered, srcBufLen, 1);
+    size_t dstLen = compressBuffer(filtered, srcBufLen, dstStream, level);
+    free(filtered);
+    return dstLen;
   }
 
 
+
   // stream to file
-  size_t compress( Stream* srcStream, size_t srcLen, fs_FS*dstFS, const char* dstFilename )
+  size_t compress( Stream* srcStream, size_t srcLen, fs_FS*dstFS, const char* dstFilename, int level )
   {
     log_d("Stream to file (source=%d bytes)", srcLen);
-    if( !srcStream || srcLen>0 || !dstFS || !dstFilename)
+    if( !srcStream || srcLen==0 || !dstFS || !dstFilename)
       return 0;
     fs_File dstFile = dstFS->open(dstFilename, fs_file_write);
     if( !dstFile )
       return 0;
-    auto ret = LZPacker::compress(srcStream, srcLen, &dstFile);
+    auto ret = LZPacker::compress(srcStream, srcLen, &dstFile, level);
     dstFile.close();
     return ret;
   }
 
 
   // file to file
-  size_t compress( fs_FS *srcFS, const char* srcFilename, fs_FS*dstFS, const char* dstFilename )
+  size_t compress( fs_FS *srcFS, const char* srcFilename, fs_FS*dstFS, const char* dstFilename, int level )
   {
     if( !srcFS || !srcFilename || !dstFS || !dstFilename)
       return 0;
     fs_File srcFile = srcFS->open(srcFilename, fs_file_read);
     if(!srcFile)
       return 0;
-    auto ret = LZPacker::compress( &srcFile, srcFile.size(), dstFS, dstFilename);
+    auto ret = LZPacker::compress( &srcFile, srcFile.size(), dstFS, dstFilename, level);
     srcFile.close();
     return ret;
   }
 
 
   // file to stream
-  size_t compress( fs_FS *srcFS, const char* srcFilename, Stream* dstStream )
+  size_t compress( fs_FS *srcFS, const char* srcFilename, Stream* dstStream, int level )
   {
     if( !srcFS || !srcFilename || !dstStream)
       return 0;
@@ -583,12 +1313,150 @@ namespace LZPacker
     if(!srcFile)
       return 0;
     log_d("File to stream (source=%d bytes)", srcFile.size());
-    auto ret = LZPacker::compress( &srcFile, srcFile.size(), dstStream );
+    auto ret = LZPacker::compress( &srcFile, srcFile.size(), dstStream, level );
     srcFile.close();
     return ret;
   }
 
 
+  // preset dictionary state, see setDictionary()
+  static struct GZ::uzlib_comp* dictComp = nullptr;
+  static uint8_t* dictBuf = nullptr;   // dictionary, followed by the message being compressed
+  static size_t dictBufSize = 0;
+  static size_t dictLen = 0;
+  static uint16_t* dictHeads = nullptr; // hash table as seeded by the dictionary
+  static uint16_t* dictChains = nullptr; // hash chain slots of the end of the dictionary
+  static size_t dictMsgLen = 0;          // last message, its chain slots are given back to the dictionary
+  static uint32_t dictId = 0;           // adler32 of the dictionary
+  static int dictLevel = LZPACKER_DEFAULT_LEVEL;
+  static bool dictDirty = false;        // the hash tables must be seeded again
+
+
+  bool setDictionary( const uint8_t* dict, size_t len, int level )
+  {
+    freeDictionary();
+    if( !dict || len == 0 )
+      return false;
+
+    dictComp = lzInit(level, 0, Z_DEFAULT_STRATEGY); // a dictionary is only useful with matches
+    if( !dictComp )
+      return false;
+    dictComp->progress_cb = nullptr; // messages are small
+    dictLevel = level;
+    dictId = GZ::uzlib_adler32(dict, len, 1);
+    dictLen = len > 32768 ? 32768 : len; // only the last 32KB can be referenced
+    dictBufSize = dictLen + 1024; // grows with the largest message
+    dictBuf = (uint8_t*)malloc(dictBufSize);
+    dictHeads = (uint16_t*)malloc(sizeof(uint16_t) << dictComp->hash_bits);
+    size_t chainsLen = 0;
+    if( dictComp->hash_prev ) {
+      chainsLen = dictLen < (1U << dictComp->prev_bits) ? dictLen : (1U << dictComp->prev_bits);
+      dictChains = (uint16_t*)malloc(sizeof(uint16_t) * chainsLen);
+    }
+    if( !dictBuf || !dictHeads || (chainsLen && !dictChains) ) {
+      log_e("unable to alloc %d bytes for dictionary", dictBufSize + (sizeof(uint16_t) << dictComp->hash_bits) + sizeof(uint16_t) * chainsLen);
+      freeDictionary();
+      return false;
+    }
+    memcpy(dictBuf, dict + len - dictLen, dictLen);
+    GZ::uzlib_compress_dict_save(dictComp, dictBuf, dictLen, dictHeads, dictChains);
+    dictDirty = false;
+    dictMsgLen = 0;
+    log_d("Dictionary: %d bytes, id=0x%08x", dictLen, dictId);
+    return true;
+  }
+
+
+  void freeDictionary()
+  {
+    if( dictComp ) {
+      free(dictComp->outbuf);
+      lzFree(dictComp);
+      dictComp = nullptr;
+    }
+    free(dictBuf);
+    dictBuf = nullptr;
+    free(dictHeads);
+    dictHeads = nullptr;
+    free(dictChains);
+    dictChains = nullptr;
+    dictBufSize = dictLen = dictMsgLen = 0;
+  }
+
+
+  // buffer to buffer with the preset dictionary
+  size_t compressWithDict( uint8_t* srcBuf, size_t srcBufLen, uint8_t** dstBuf, bool raw )
+  {
+    log_d("Buffer to buffer with dictionary (source=%d bytes)", srcBufLen);
+    assert(srcBuf);
+    assert(dstBuf);
+    if( !dictComp ) {
+      log_e("No dictionary, see setDictionary()");
+      return 0;
+    }
+
+    auto c = dictComp;
+    if( dictLen + srcBufLen > dictBufSize ) {
+      auto buf = (uint8_t*)realloc(dictBuf, dictLen + srcBufLen);
+      if( !buf ) {
+        log_e("unable to alloc %d bytes for message", dictLen + srcBufLen);
+        return 0;
+      }
+      dictBuf = buf;
+      dictBufSize = dictLen + srcBufLen;
+      dictDirty = true; // the hash tables point to the old buffer
+    }
+    memcpy(dictBuf + dictLen, srcBuf, srcBufLen);
+
+    if( dictDirty ) // only after the buffer has moved
+      GZ::uzlib_compress_dict_save(c, dictBuf, dictLen, dictHeads, dictChains);
+    else
+      GZ::uzlib_compress_dict_restore(c, dictBuf, dictLen, dictHeads, dictChains, dictMsgLen);
+    dictDirty = false;
+    dictMsgLen = srcBufLen;
+
+    c->outsize = srcBufLen + srcBufLen/8 + 64;
+    c->outbuf = (unsigned char*)malloc(c->outsize);
+    if( !c->outbuf ) {
+      log_e("unable to alloc %d bytes for output", c->outsize);
+      c->outsize = 0;
+      return 0;
+    }
+    c->outlen = 0;
+    c->outbits = 0;
+    c->noutbits = 0;
+    c->stored_bytes = c->compressed_bytes = 0;
+
+    if( !raw ) { // zlib header (RFC1950) with FDICT and the dictionary id
+      uint8_t cmf = 0x78; // deflate, 32KB window
+      uint8_t flg = 0x20 | ((dictLevel < 2 ? 0 : dictLevel < 6 ? 1 : dictLevel == 6 ? 2 : 3) << 6); // FDICT, FLEVEL
+      flg |= (31 - (cmf * 256 + flg) % 31) % 31; // FCHECK
+      GZ::outbits(c, cmf, 8);
+      GZ::outbits(c, flg, 8);
+      for( int i=24; i>=0; i-=8 )
+        GZ::outbits(c, (dictId >> i) & 0xff, 8);
+    }
+
+    GZ::zlib_start_block(c);
+    GZ::uzlib_compress(c, dictBuf + dictLen, srcBufLen);
+    GZ::zlib_finish_block(c);
+
+    if( !raw ) { // adler32, big endian
+      uint32_t adler = GZ::uzlib_adler32(srcBuf, srcBufLen, 1);
+      for( int i=24; i>=0; i-=8 )
+        GZ::outbits(c, (adler >> i) & 0xff, 8);
+      GZ::outalign(c);
+    }
+
+    lzStats(c);
+    size_t ret = c->outlen;
+    *dstBuf = c->outbuf; // handed over to the caller
+    c->outbuf = NULL;
+    c->outsize = 0;
+    return ret;
+  }
+
+
 }; // end namespace LZPacker
 
 
@@ -983,21 +1851,21 @@ namespace TarGzPacker
 
 
   // tar-to-gz compression from files/folders list
-  int compress(fs_FS *srcFS, std::vector<dir_entity_t> dirEntities, fs_FS *dstFS, const char* tgz_name, const char* tar_prefix)
+  int compress(fs_FS *srcFS, std::vector<dir_entity_t> dirEntities, fs_FS *dstFS, const char* tgz_name, const char* tar_prefix, int level)
   {
     auto dstFile = dstFS->open(tgz_name, fs_file_write);
     if(!dstFile) {
       log_e("Can't open %s for writing", tgz_name);
       return -1;
     }
-    auto ret = compress(srcFS, dirEntities, &dstFile, tar_prefix);
+    auto ret = compress(srcFS, dirEntities, &dstFile, tar_prefix, level);
     dstFile.close();
     return ret;
   }
 
 
   // tar-to-gz compression from files/folders list
-  int compress(fs_FS *srcFS, std::vector<dir_entity_t> dirEntities, Stream* dstStream, const char* tar_prefix)
+  int compress(fs_FS *srcFS, std::vector<dir_entity_t> dirEntities, Stream* dstStream, const char* tar_prefix, int level)
   {
     auto TarStreamFunctions = TarIOFuncs;
     TarStreamFunctions.src_fs = srcFS;
@@ -1007,7 +1875,7 @@ namespace TarGzPacker
     if( tar_estimated_filesize <=0 )
       return -1;
 
-    LZPacker::LZStreamWriter lzStream( dstStream, tar_estimated_filesize );
+    LZPacker::LZStreamWriter lzStream( dstStream, tar_estimated_filesize, 4096, level, UZLIB_FILTER_NONE ); // tar streaming can't undo filters
 
     _tar->dst_file = &lzStream; // attach gz stream to tar i/o
 
@@ -1020,19 +1888,19 @@ namespace TarGzPacker
 
 
   // tar-to-gz compression from path
-  int compress(fs_FS *srcFS, const char* srcDir, Stream* dstStream, const char* tar_prefix)
+  int compress(fs_FS *srcFS, const char* srcDir, Stream* dstStream, const char* tar_prefix, int level)
   {
     std::vector<dir_entity_t> dirEntities;
     TarPacker::collectDirEntities(&dirEntities, srcFS, srcDir);
-    return compress(srcFS, dirEntities, dstStream, tar_prefix);
+    return compress(srcFS, dirEntities, dstStream, tar_prefix, level);
   }
 
   // tar-to-gz compression from path
-  int compress(fs_FS *srcFS, const char* srcDir, fs_FS *dstFS, const char* tgz_name, const char* tar_prefix)
+  int compress(fs_FS *srcFS, const char* srcDir, fs_FS *dstFS, const char* tgz_name, const char* tar_prefix, int level)
   {
     std::vector<dir_entity_t> dirEntities;
     TarPacker::collectDirEntities(&dirEntities, srcFS, srcDir);
-    return compress(srcFS, dirEntities, dstFS, tgz_name, tar_prefix);
+    return compress(srcFS, dirEntities, dstFS, tgz_name, tar_prefix, level);
   }
 
 
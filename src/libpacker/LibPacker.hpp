@@ -38,6 +38,11 @@
 #include "../types/esp32_targz_types.h"
 #include "../ESP32-targz-log.hpp"
 
+namespace GZ
+{
+  #include "../uzlib/uzlib.h"
+}
+
 
 
 // Work in progress: move namespaced functions to 1x Base class and 3x Polymorphic classes
@@ -89,25 +94,186 @@
 // .gz compressor (LZ77/deflate)
 namespace LZPacker
 {
+  // level: 0 = stored, 1 = fastest ... 9 = best, 10 = optimal parsing (slow, for offline builds), see LZPACKER_DEFAULT_LEVEL
   // buffer to stream (best compression)
-  size_t compress( uint8_t* srcBuf, size_t srcBufLen, Stream* dstStream );
+  size_t compress( uint8_t* srcBuf, size_t srcBufLen, Stream* dstStream, int level=LZPACKER_DEFAULT_LEVEL );
   // buffer to buffer (best compression)
-  size_t compress( uint8_t* srcBuf, size_t srcBufLen, uint8_t** dstBufPtr );
+  size_t compress( uint8_t* srcBuf, size_t srcBufLen, uint8_t** dstBufPtr, int level=LZPACKER_DEFAULT_LEVEL );
+  // buffer to caller supplied buffer, returns 0 if the output doesn't fit (see compressBound())
+  size_t compress( uint8_t* srcBuf, size_t srcBufLen, uint8_t* dstBuf, size_t dstBufSize, int level=LZPACKER_DEFAULT_LEVEL );
   // stream to buffer
-  size_t compress( Stream* srcStream, size_t srcLen, uint8_t** dstBufPtr );
+  size_t compress( Stream* srcStream, size_t srcLen, uint8_t** dstBufPtr, int level=LZPACKER_DEFAULT_LEVEL );
   // stream to stream
-  size_t compress( Stream* srcStream, size_t srcLen, Stream* dstStream );
+  size_t compress( Stream* srcStream, size_t srcLen, Stream* dstStream, int level=LZPACKER_DEFAULT_LEVEL );
   // stream to file
-  size_t compress( Stream* srcStream, size_t srcLen, fs_FS*dstFS, const char* dstFilename );
+  size_t compress( Stream* srcStream, size_t srcLen, fs_FS*dstFS, const char* dstFilename, int level=LZPACKER_DEFAULT_LEVEL );
   // file to file
-  size_t compress( fs_FS *srcFS, const char* srcFilename, fs_FS*dstFS, const char* dstFilename );
+  size_t compress( fs_FS *srcFS, const char* srcFilename, fs_FS*dstFS, const char* dstFilename, int level=LZPACKER_DEFAULT_LEVEL );
   // file to stream
-  size_t compress( fs_FS *srcFS, const char* srcFilename, Stream* dstStream );
+  size_t compress( fs_FS *srcFS, const char* srcFilename, Stream* dstStream, int level=LZPACKER_DEFAULT_LEVEL );
+
+  // worst case compress() output size (gzip header and footer included) for srcLen bytes at this level
+  size_t compressBound( size_t srcLen, int level=LZPACKER_DEFAULT_LEVEL );
 
   // progress callback setter [](size_t bytes_read, size_t total_bytes)
   void setProgressCallBack(totalProgressCallback cb);
   void defaultProgressCallback( size_t progress, size_t total );
 
+  // input bytes sent as stored (incompressible) and as compressed blocks by the last compress() call, see LZPACKER_ADAPTIVE
+  void getStats(size_t* storedBytes, size_t* compressedBytes);
+
+  // preset dictionary for small messages (e.g. json telemetry), the decompressor needs the same dictionary.
+  // The hash tables are seeded once here and reused by every compressWithDict() call, the chain slots covering the
+  // dictionary are saved too (2 bytes per dictionary byte, up to 2 << LZPACKER_CHAIN_BITS)
+  bool setDictionary( const uint8_t* dict, size_t dictLen, int level=LZPACKER_DEFAULT_LEVEL );
+  void freeDictionary();
+  // buffer to buffer with the preset dictionary: zlib format (RFC1950) with FDICT and dictionary id,
+  // or raw deflate (no header/trailer) when raw=true, *dstBufPtr must be freed by the caller
+  size_t compressWithDict( uint8_t* srcBuf, size_t srcBufLen, uint8_t** dstBufPtr, bool raw=false );
+
+  // compressor memory layout, derived from a byte budget
+  struct config_t
+  {
+    size_t budget;        // requested bytes, 0 = build defaults (LZPACKER_CHAIN_BITS, LZPACKER_SYMBOL_BUFFER_SIZE, etc)
+    uint8_t hash_bits;    // hash table: 1 << hash_bits pointers
+    uint8_t chain_bits;   // hash chains: 1 << chain_bits entries, 0 = one candidate per hash bucket
+    size_t symbol_buffer; // dynamic huffman symbol buffer (bytes), 0 = static huffman blocks only
+    size_t history;       // stream mode history (bytes), 0 = chunks are compressed independently
+    size_t io_buffer;     // stream mode input and output staging buffers (bytes each)
+    size_t optimal;       // level 10 optimal parsing working memory (bytes), allocated by each compression call
+    size_t footprint;     // bytes actually allocated
+  };
+  // memory budget per compressor (bytes, 0 = build defaults): hash table, chains, symbol buffer, history
+  // and staging buffers are derived from it and allocated as a single block, see LZPACKER_MEMORY_BUDGET.
+  // The layout is halved until it fits in the available heap.
+  void setMemoryBudget(size_t bytes);
+  // layout for a given budget, without allocating anything (stream=false for buffer to buffer/stream)
+  config_t getConfig(size_t budget, int level=LZPACKER_DEFAULT_LEVEL, bool stream=true);
+  // layout of the last allocated compressor
+  config_t getLastConfig();
+
+  // Z_DEFAULT_STRATEGY, Z_RLE (runs only, e.g. bitmaps) or Z_HUFFMAN_ONLY (entropy coding only, e.g. sensor dumps):
+  // the last two don't search for matches, they're much faster and need no hash table nor stream history
+  void setStrategy(int strategy);
+
+  // reversible filter applied before deflate, recorded in the gzip header and undone by GzUnpacker:
+  // UZLIB_FILTER_DELTA (fixed width samples, deltaStride = sample size in bytes, 1-256) or
+  // UZLIB_FILTER_XTENSA/RISCV/ARM_THUMB (firmware images, call targets made absolute), UZLIB_FILTER_NONE = off.
+  // Applies to the next gzip compressors (compress(), LZStreamWriter, GzipPrint), not to tar.gz archives
+  void setFilter(int filter, int deltaStride=1);
+
+  // gzip compressor as a Stream: srcLen bytes are written to it, the gzip output goes to dstStream,
+  // srcLen = 0 for an unknown length, then end() finishes the gzip stream
+  class LZStreamWriter : public Stream
+  {
+  public:
+    LZStreamWriter() { }
+    // filter: UZLIB_FILTER_* and its FEXTRA parameter, -1 = the one set with setFilter()
+    LZStreamWriter(Print* dstStream, size_t srcLen, size_t bufSize=4096, int level=LZPACKER_DEFAULT_LEVEL, int filter=-1, int filterParam=0);
+    ~LZStreamWriter();
+    // gzip output size, -1 on error
+    size_t size();
+    // compress what's left and write the gzip footer, called by write() when srcLen bytes are reached
+    bool end();
+    // send everything written so far to dstStream, for low latency streaming (logs, live json):
+    // Z_SYNC_FLUSH byte aligns the output with an empty stored block (5 bytes), Z_PARTIAL_FLUSH uses an
+    // empty static block (2 bytes) but the last byte is only complete with the next output
+    bool flush(int mode);
+    virtual void flush() { flush(Z_SYNC_FLUSH); }
+    // flush from write() when ms milliseconds or bytes input bytes have gone since the last flush, 0 = off
+    void setAutoFlush(uint32_t ms, size_t bytes=0, int mode=Z_SYNC_FLUSH);
+    virtual size_t write(const uint8_t* buf, size_t size);
+    virtual size_t write(uint8_t c) { return this->write(&c, 1); }
+    virtual int available() { log_e("This function should not be called"); return 0; }
+    virtual int read() { log_e("This function should not be called"); return 0; }
+    virtual int peek() { log_e("This function should not be called"); return 0; }
+  private:
+    Print* dstStream = nullptr;
+    size_t srcLen = 0;       // 0 = unknown
+    size_t bufSize = 4096;   // staging buffers size, set by the memory budget if any
+    int level = LZPACKER_DEFAULT_LEVEL;
+    struct GZ::uzlib_filter* filter = nullptr; // pre-compression filter, input is always staged when set
+    size_t outputBufIdx = 0; // input bytes received
+    size_t staged = 0;       // input bytes waiting in inputBuffer
+    unsigned char* outputBuffer = nullptr;
+    unsigned char* inputBuffer = nullptr;
+    struct GZ::uzlib_comp* compressor = nullptr;
+    GZ::uzlib_stream uzstream;
+    int prev_state = Z_STREAM_ERROR;
+    size_t dstLen = 0;       // gz output size
+    size_t total_bytes = 0;  // progress meter and end health check
+    bool success = false;    // return status
+    bool in_loop = false;    // stream loop control
+    uint32_t autoFlushMs = 0;
+    size_t autoFlushBytes = 0;
+    int autoFlushMode = Z_SYNC_FLUSH;
+    uint32_t lastFlush = 0;  // millis() of the last flush
+    size_t unflushed = 0;    // input bytes since the last flush
+    void setup(int id, int param);
+    bool deflate(const uint8_t* src, size_t len, int mode);
+    void writeFooter();
+  };
+
+  // gzip compressor as a Print for output of unknown length (json, csv, log lines), e.g.
+  //   LZPacker::GzipPrint gz(&file); gz.printf("%d,%d\n", x, y); gz.end();
+  // RAM use is bounded by the compressor layout, end() writes the gzip trailer (also called by the destructor)
+  class GzipPrint : public Print
+  {
+  public:
+    GzipPrint(Print* dst, int level=LZPACKER_DEFAULT_LEVEL, size_t bufSize=4096) : writer(dst, 0, bufSize, level) { }
+    ~GzipPrint() { end(); }
+    virtual size_t write(const uint8_t* buf, size_t size) { return writer.write(buf, size) == size ? size : 0; }
+    virtual size_t write(uint8_t c) { return this->write(&c, 1); }
+    virtual void flush() { writer.flush(Z_SYNC_FLUSH); }
+    bool flush(int mode) { return writer.flush(mode); }
+    void setAutoFlush(uint32_t ms, size_t bytes=0, int mode=Z_SYNC_FLUSH) { writer.setAutoFlush(ms, bytes, mode); }
+    bool end() { return writer.end(); }
+    // gzip output size so far, -1 on error
+    size_t size() { return writer.size(); }
+  private:
+    LZStreamWriter writer;
+  };
+
+  // rolling log archiver: text is compressed as it arrives into <dir>/log-00001.gz, log-00002.gz... segments.
+  // A segment is closed with a valid gzip trailer once it reaches maxSegmentSize compressed bytes (counted as blocks
+  // are written, so it can overshoot by one block) or maxSegmentMs, at a line boundary, then it's appended to
+  // <dir>/index.csv as "name,input bytes,gzip bytes". RAM use is a single compressor.
+  // Only the open segment is lost on a crash, and only since the last flush() as its prefix stays decodable.
+  class GzipLogRotator : public Print
+  {
+  public:
+    GzipLogRotator(fs_FS* fs, const char* dir, size_t maxSegmentSize=LZPACKER_LOG_SEGMENT_SIZE, uint32_t maxSegmentMs=0, int level=LZPACKER_DEFAULT_LEVEL);
+    ~GzipLogRotator() { end(); }
+    // creates dir if needed, numbering resumes after the last segment found there
+    bool begin();
+    virtual size_t write(const uint8_t* buf, size_t size);
+    virtual size_t write(uint8_t c) { return this->write(&c, 1); }
+    // sync flush the open segment to the file
+    virtual void flush();
+    // rotate on time without new writes, call it from loop() when maxSegmentMs is set
+    void poll();
+    // close the open segment, the next write starts a new one
+    bool rotate();
+    void end() { rotate(); }
+    // id of the next segment to be opened or of the open one
+    uint32_t segmentId() { return nextId; }
+    String indexPath() { return dir + "/index.csv"; }
+  private:
+    fs_FS* fs = nullptr;
+    String dir;
+    size_t maxSegmentSize;
+    uint32_t maxSegmentMs;
+    int level;
+    uint32_t nextId = 1;
+    fs_File file;
+    GzipPrint* gz = nullptr;  // compressor of the open segment, nullptr between segments
+    size_t segmentBytes = 0;  // input bytes in the open segment
+    uint32_t segmentStart = 0;
+    bool lineStart = true;    // last write ended with a new line
+    String segmentName(uint32_t id);
+    bool open();
+  };
+
 };
 
 
@@ -130,12 +296,12 @@ namespace TarGzPacker
   using namespace TAR;
 
   // tar-to-gz compression, recursion applies to srcDir up to 50 folders deep
-  int compress(fs_FS *srcFS, const char* srcDir, Stream* dstStream, const char* tar_prefix=nullptr);
-  int compress(fs_FS *srcFS, const char* srcDir, fs_FS *dstFS, const char* tgz_name, const char* tar_prefix=nullptr);
+  int compress(fs_FS *srcFS, const char* srcDir, Stream* dstStream, const char* tar_prefix=nullptr, int level=LZPACKER_DEFAULT_LEVEL);
+  int compress(fs_FS *srcFS, const char* srcDir, fs_FS *dstFS, const char* tgz_name, const char* tar_prefix=nullptr, int level=LZPACKER_DEFAULT_LEVEL);
 
   // tar-to-gz compression
-  int compress(fs_FS *srcFS, std::vector<dir_entity_t> dirEntities, Stream* dstStream, const char* tar_prefix=nullptr);
-  int compress(fs_FS *srcFS, std::vector<dir_entity_t> dirEntities, fs_FS *dstFS, const char* tgz_name, const char* tar_prefix=nullptr);
+  int compress(fs_FS *srcFS, std::vector<dir_entity_t> dirEntities, Stream* dstStream, const char* tar_prefix=nullptr, int level=LZPACKER_DEFAULT_LEVEL);
+  int compress(fs_FS *srcFS, std::vector<dir_entity_t> dirEntities, fs_FS *dstFS, const char* tgz_name, const char* tar_prefix=nullptr, int level=LZPACKER_DEFAULT_LEVEL);
 
 };
 
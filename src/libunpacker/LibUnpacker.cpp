@@ -55,6 +55,7 @@ fs_File untarredFile;
 fs_FS *tarFS = nullptr;
 
 TAR::entry_callbacks_t tarCallbacks;
+TAR::tar_reader_t tarReader; // tar parser state for the step by step expanders
 
 void* (*tgz_malloc)(size_t size) = nullptr;
 void* (*tgz_calloc)(size_t n, size_t size) = nullptr;
@@ -82,6 +83,7 @@ unsigned int (*gzReadDestByte)(int offset, unsigned char *out);
 const char* tarDestFolder = nullptr;
 unsigned char __attribute__((aligned(4))) *output_buffer = nullptr; // gz write buffer
 unsigned char *uzlib_gzip_dict = nullptr; // gz dictionnary buffer
+struct GZ::uzlib_filter *gzFilter = nullptr; // inverse of the pre-compression filter found in the gzip header, if any
 struct GZ::TINF_DATA uzLibDecompressor; // uzlib object
 
 tarGzErrorCode _error = ESP32_TARGZ_OK;
@@ -102,10 +104,15 @@ int64_t  stream_bytesleft = 0;
 uint32_t output_position = 0;  // position in output_buffer
 uint16_t blockmod = GZIP_BUFF_SIZE / TAR_BLOCK_SIZE; // how many tar blocks can fit in the gzip buffer
 uint16_t gzTarBlockPos = 0; // tar block number being decompressed
+unsigned char *gzTarBuffer = nullptr; // gz output buffer being processed by tar, see gzBorrowTarBuffer()
+size_t   gzTarBlocks = 0; // tar blocks in gzTarBuffer
 size_t   tarReadGzStreamBytes = 0;
 char*    tar_file_path = nullptr; // temporary storage for filenames
 #if defined HAS_OTA_SUPPORT
   bool     tarBlockIsUpdateData = false;
+  #if defined ESP32
+    PATCH::PATCH *gzPatch = nullptr; // delta patch being applied by gzStreamPatchUpdater()
+  #endif
 #endif
 
 
@@ -162,6 +169,7 @@ BaseUnpacker::BaseUnpacker()
   output_position = 0;  //position in output_buffer
   blockmod = GZIP_BUFF_SIZE / TAR_BLOCK_SIZE;
   gzTarBlockPos = 0;
+  gzTarBlocks = 0;
   tarReadGzStreamBytes = 0;
 
   tgz_malloc  = malloc;
@@ -907,7 +915,7 @@ int TarUnpacker::tarEndCallBack( TAR::header_translated_t *header, CC_UNUSED int
 
 
 // tinyUntarReadCallback
-int TarUnpacker::tarStreamReadCallback( unsigned char* buff, size_t buffsize )
+int TarUnpacker::tarStreamReadCallback( unsigned char* buff, size_t buffsize, CC_UNUSED void *context_data )
 {
   return tarGzIO.tar->readBytes( buff, buffsize );
 }
@@ -1245,7 +1253,49 @@ int GzUnpacker::gzUncompress( bool isupdate, bool stream_to_tar, bool use_dict,
 
   GZ::uzlib_init();
 
-  if ( use_dict == true && nodict == false ) {
+  uzLibDecompressor.source           = nullptr;
+  uzLibDecompressor.readSourceByte   = gzReadSourceByte;
+  uzLibDecompressor.destSize         = 1;
+  uzLibDecompressor.log              = targzPrintLoggerCallback;
+  uzLibDecompressor.readSourceErrors = 0;
+
+  uzLibDecompressor.dict_id = 0;
+  uzLibDecompressor.filter_id = UZLIB_FILTER_NONE;
+  if( presetDict != nullptr && tarGzIO.gz->peek() != 0x1f ) { // not gzip: zlib stream, maybe with FDICT
+    res = GZ::uzlib_zlib_parse_header(&uzLibDecompressor);
+    res = res < 0 ? res : TINF_OK; // returns the window size
+  } else {
+    res = GZ::uzlib_gzip_parse_header(&uzLibDecompressor);
+  }
+  if (res != TINF_OK) {
+    log_e("[ERROR] in gzUncompress: uzlib_gzip_parse_header failed (response code %d!", res);
+    return_value = ESP32_TARGZ_UZLIB_PARSE_HEADER_FAILED;
+    //if( halt_on_error() ) targz_system_halt();
+    goto _end;
+  }
+
+  if( uzLibDecompressor.filter_id != UZLIB_FILTER_NONE ) {
+    if( stream_to_tar ) {
+      log_e("[ERROR] in gzUncompress: filtered gzip (filter %d) can't be streamed to tar", uzLibDecompressor.filter_id);
+      return_value = ESP32_TARGZ_UZLIB_PARSE_HEADER_FAILED;
+      goto _end;
+    }
+    gzFilter = (struct GZ::uzlib_filter*)tgz_malloc( sizeof(struct GZ::uzlib_filter) );
+    if( gzFilter == NULL ) {
+      log_e("[ERROR] can't alloc %d bytes for gzip filter", sizeof(struct GZ::uzlib_filter) );
+      return_value = ESP32_TARGZ_UZLIB_MALLOC_FAIL;
+      goto _end;
+    }
+    if( GZ::uzlib_filter_init(gzFilter, uzLibDecompressor.filter_id, uzLibDecompressor.filter_param, 0) != 0 ) {
+      log_e("[ERROR] in gzUncompress: unsupported filter %d (param %d)", uzLibDecompressor.filter_id, uzLibDecompressor.filter_param);
+      return_value = ESP32_TARGZ_UZLIB_PARSE_HEADER_FAILED;
+      goto _end;
+    }
+    log_d("[INFO] gzip filter %d (param %d), output will be unfiltered", uzLibDecompressor.filter_id, uzLibDecompressor.filter_param);
+  }
+
+  // the filter modifies the output buffer before it's written: back references must come from the dictionary
+  if ( (use_dict == true && nodict == false) || gzFilter != nullptr ) {
 
     if( tgz_use_psram ) {
       uzlib_gzip_dict = (unsigned char*)tgz_calloc(1, GZIP_DICT_SIZE);
@@ -1280,22 +1330,21 @@ int GzUnpacker::gzUncompress( bool isupdate, bool stream_to_tar, bool use_dict,
     uzlib_dict_size = 0;
   }
 
-  uzLibDecompressor.source           = nullptr;
-  uzLibDecompressor.readSourceByte   = gzReadSourceByte;
-  uzLibDecompressor.destSize         = 1;
-  uzLibDecompressor.log              = targzPrintLoggerCallback;
-  uzLibDecompressor.readSourceErrors = 0;
+  GZ::uzlib_uncompress_init(&uzLibDecompressor, uzlib_gzip_dict, uzlib_dict_size);
 
-  res = GZ::uzlib_gzip_parse_header(&uzLibDecompressor);
-  if (res != TINF_OK) {
-    log_e("[ERROR] in gzUncompress: uzlib_gzip_parse_header failed (response code %d!", res);
-    return_value = ESP32_TARGZ_UZLIB_PARSE_HEADER_FAILED;
-    //if( halt_on_error() ) targz_system_halt();
-    goto _end;
+  if( uzLibDecompressor.dict_id != 0 ) {
+    if( uzLibDecompressor.dict_id != GZ::uzlib_adler32(presetDict, presetDictLen, 1) ) {
+      log_e("[ERROR] in gzUncompress: dictionary id mismatch (expected 0x%08x)", uzLibDecompressor.dict_id);
+      return_value = ESP32_TARGZ_UZLIB_PARSE_HEADER_FAILED;
+      goto _end;
+    }
+    if( GZ::uzlib_uncompress_dict(&uzLibDecompressor, presetDict, presetDictLen) != TINF_OK ) {
+      log_e("[ERROR] in gzUncompress: preset dictionary needs the gzip dictionary");
+      return_value = ESP32_TARGZ_NEEDS_DICT;
+      goto _end;
+    }
   }
 
-  GZ::uzlib_uncompress_init(&uzLibDecompressor, uzlib_gzip_dict, uzlib_dict_size);
-
   output_buffer = (unsigned char *)tgz_calloc( output_buffer_size+1, sizeof(unsigned char) );
   if( output_buffer == NULL ) {
     log_e("[ERROR] can't alloc %d bytes for output buffer", output_buffer_size );
@@ -1317,13 +1366,13 @@ int GzUnpacker::gzUncompress( bool isupdate, bool stream_to_tar, bool use_dict,
     blockmod = output_buffer_size / TAR_BLOCK_SIZE;
     log_v("[INFO] output_buffer_size=%d blockmod=%d", output_buffer_size, blockmod );
     untarredBytesCount = 0;
-    int ret = TAR::tar_setup(&tarCallbacks, NULL);
+    int ret = TAR::tar_setup(&tarReader, &tarCallbacks, NULL);
     firstblock = false;
     if( ret != TAR_OK ) {
       setError( (tarGzErrorCode)(ret-30) );
       return (tarGzErrorCode)(ret-30);
     }
-    while( TAR::read_tar_step() == TAR_OK ) yield();
+    while( TAR::read_tar_step(&tarReader) == TAR_OK ) yield();
     outlen = untarredBytesCount;
 
   } else {
@@ -1339,15 +1388,18 @@ int GzUnpacker::gzUncompress( bool isupdate, bool stream_to_tar, bool use_dict,
       output_position++;
       // when destination buffer is filled, write/stream it
       if (output_position == output_buffer_size) {
-        log_v("[INFO] Buffer full, now writing %d bytes (total=%d)", output_buffer_size, outlen);
-        if( !gzWriteCallback( output_buffer, output_buffer_size ) ) {
+        // with a filter, an instruction cut by the end of the buffer stays for the next write
+        size_t ready = gzFilter ? GZ::uzlib_filter(gzFilter, output_buffer, output_position, 0) : output_position;
+        log_v("[INFO] Buffer full, now writing %d bytes (total=%d)", ready, outlen);
+        if( !gzWriteCallback( output_buffer, ready ) ) {
           return_value = _error;
           goto _end;
         }
 
 
-        outlen += output_buffer_size;
-        output_position = 0;
+        outlen += ready;
+        output_position -= ready;
+        memmove( output_buffer, output_buffer + ready, output_position );
       }
 
       if( show_progress ) {
@@ -1377,6 +1429,8 @@ int GzUnpacker::gzUncompress( bool isupdate, bool stream_to_tar, bool use_dict,
 
     // some leftover bytes
     if( output_position > 0 ) {
+      if( gzFilter )
+        GZ::uzlib_filter(gzFilter, output_buffer, output_position, 1);
       if(! gzWriteCallback( output_buffer, output_position ) ) {
         return_value = _error;
         goto _end;
@@ -1416,6 +1470,10 @@ int GzUnpacker::gzUncompress( bool isupdate, bool stream_to_tar, bool use_dict,
 
   if( output_buffer != NULL )
     free( output_buffer );
+  if( gzFilter != nullptr ) {
+    free( gzFilter );
+    gzFilter = nullptr;
+  }
   gzExpanderCleanup();
 
   return return_value;
@@ -1916,6 +1974,162 @@ bool GzUnpacker::gzStreamExpander( Stream *stream, size_t gz_size )
   }
 
 
+  #if defined ESP32
+
+    // delta patch errors to esp32-targz error id
+    static tarGzErrorCode gzPatchError( int ret )
+    {
+      switch( ret ) {
+        case PATCH_ERR_SOURCE:   return ESP32_TARGZ_PATCH_SOURCE_MISMATCH;
+        case PATCH_ERR_CHECKSUM: return ESP32_TARGZ_INTEGRITY_FAIL;
+        case PATCH_ERR_WRITE:    return Update.getError() ? (tarGzErrorCode)(Update.getError()-20) : ESP32_TARGZ_UPDATE_ERROR_WRITE;
+        default:                 return ESP32_TARGZ_PATCH_INVALID;
+      }
+    }
+
+
+    // delta patch source: the running firmware
+    static size_t gzPatchReadSource( void *ctx, size_t offset, unsigned char *buf, size_t len )
+    {
+      const esp_partition_t *running = (const esp_partition_t *)ctx;
+      if( offset + len > running->size || esp_partition_read( running, offset, buf, len ) != ESP_OK ) {
+        log_e("Failed to read %d bytes at offset %d of the running partition", len, offset );
+        return 0;
+      }
+      return len;
+    }
+
+
+    // delta patch target: the update starts with the first block, once the source has been checked
+    static size_t gzPatchWriteTarget( void *ctx, unsigned char *buf, size_t len )
+    {
+      if( !Update.isRunning() ) {
+        if(tgzLogger)
+          tgzLogger("[GZUpdater] Starting delta update\n");
+        if( !Update.begin( gzPatch->target_size, U_FLASH ) ) {
+          log_e("Can't begin update (%d bytes)", gzPatch->target_size );
+          return 0;
+        }
+      }
+      return Update.write( buf, len );
+    }
+
+
+    // gzWriteCallback
+    bool GzUnpacker::gzPatchWriteCallback( unsigned char* buff, size_t buffsize )
+    {
+      int ret = PATCH::patch_write( gzPatch, buff, buffsize );
+      if( ret != PATCH_OK ) {
+        log_e("Delta patch failed with error %d", ret );
+        setError( gzPatchError( ret ) );
+        return false;
+      }
+      return true;
+    }
+
+
+    // apply a gzipped delta patch to the running firmware, the new firmware is written to the next OTA partition
+    bool GzUnpacker::gzPatchUpdater( fs_FS &fs, const char* patch_filename, bool restart_on_update )
+    {
+      tarGzClearError();
+      initFSCallbacks();
+      if (!tgzLogger ) {
+        setLoggerCallback( targzPrintLoggerCallback );
+      }
+      if( !fs.exists( patch_filename )  ) {
+        log_e("[ERROR] in gzPatchUpdater: %s does not exist", patch_filename);
+        setError( ESP32_TARGZ_UZLIB_INVALID_FILE );
+        return false;
+      }
+      fs_File gz = fs.open( patch_filename, fs_file_read );
+      return gzStreamPatchUpdater( (Stream*)&gz, restart_on_update );
+    }
+
+
+    // same from a gz stream (file or HTTP): the patch is decompressed and applied block by block, the running firmware
+    // is only read, the new one is checked against the crc32 from the patch before the update is activated
+    bool GzUnpacker::gzStreamPatchUpdater( Stream *stream, bool restart_on_update )
+    {
+      if( !gzProgressCallback ) {
+        setGzProgressCallback( defaultProgressCallback );
+      }
+      if( !tgzLogger ) {
+        setLoggerCallback( targzPrintLoggerCallback );
+      }
+
+      if( ! stream->available() ) {
+        log_e("Bad stream, aborting");
+        setError( ESP32_TARGZ_STREAM_ERROR );
+        return false;
+      }
+
+      if( HEAP_AVAILABLE() < GZIP_DICT_SIZE+GZIP_BUFF_SIZE+sizeof(PATCH::PATCH) ) {
+        log_w("Insufficient heap to apply patch (available:%d, needed:%d), aborting", HEAP_AVAILABLE(), GZIP_DICT_SIZE+GZIP_BUFF_SIZE+sizeof(PATCH::PATCH) );
+        setError( ESP32_TARGZ_HEAP_TOO_LOW );
+        return false;
+      }
+
+      const esp_partition_t *running = esp_ota_get_running_partition();
+      if( running == NULL ) {
+        log_e("Can't find the running partition");
+        setError( ESP32_TARGZ_UPDATE_ERROR_NO_PARTITION );
+        return false;
+      }
+
+      gzPatch = (PATCH::PATCH*)tgz_malloc( sizeof(PATCH::PATCH) );
+      if( gzPatch == nullptr ) {
+        log_e("[ERROR] can't alloc %d bytes for delta patch", sizeof(PATCH::PATCH) );
+        setError( ESP32_TARGZ_UZLIB_MALLOC_FAIL );
+        return false;
+      }
+      PATCH::patch_init( gzPatch, gzPatchReadSource, gzPatchWriteTarget, (void*)running );
+
+      tarGzIO.gz = stream;
+      setStreamWriter( gzPatchWriteCallback );
+
+      Update.onProgress([]( size_t done, size_t total ) {
+        gzProgressCallback( (100*done)/total );
+      });
+
+      // no zero-fill: the update size is the target size from the patch header
+      int ret = gzUncompress( false/*isupdate*/, false/*stream_to_tar*/, true/*use_dict*/, false/*show_progress*/ );
+      if( ret == ESP32_TARGZ_OK ) {
+        int patch_ret = PATCH::patch_end( gzPatch ); // last block + crc32 check
+        if( patch_ret != PATCH_OK ) {
+          log_e("Delta patch failed with error %d", patch_ret );
+          ret = gzPatchError( patch_ret );
+        }
+      }
+      free( gzPatch );
+      gzPatch = nullptr;
+
+      if( ret != ESP32_TARGZ_OK ) {
+        log_e("gzStreamPatchUpdater returned error code %d", ret);
+        if( Update.isRunning() )
+          Update.abort();
+        setError( (tarGzErrorCode)ret );
+        return false;
+      }
+
+      if ( !Update.end( true ) ) {
+        log_e( "Update Error Occurred. Error #: %u", Update.getError() );
+        setError( (tarGzErrorCode)(Update.getError()-20) ); // "-20" offset is Update error id to esp32-targz error id
+        return false;
+      }
+      if ( !Update.isFinished() ) {
+        log_e( "Update not finished? Something went wrong!" );
+        setError( ESP32_TARGZ_UPDATE_INCOMPLETE );
+        return false;
+      }
+      log_v("Delta update finished !");
+      gzProgressCallback( 100 );
+      if( restart_on_update ) ESP.restart();
+      return true;
+    }
+
+  #endif // defined ESP32
+
+
 #endif // defined HAS_OTA_SUPPORT
 
 
@@ -1942,27 +2156,30 @@ bool TarGzUnpacker::gzProcessTarBuffer( CC_UNUSED unsigned char* buff, CC_UNUSED
   }
 
   if( firstblock ) {
-    if( TAR::tar_setup(&tarCallbacks, NULL) == TAR_OK ) {
+    if( TAR::tar_setup(&tarReader, &tarCallbacks, NULL) == TAR_OK ) {
       firstblock = false;
     } else {
       return false;
     }
   }
+  // tar blocks are borrowed from this buffer, a header or a run of data blocks per step
+  gzTarBlocks = buffsize / TAR_BLOCK_SIZE;
+  gzTarBuffer = buff;
   gzTarBlockPos = 0;
-  while( gzTarBlockPos < blockmod ) {
-    int response = TAR::read_tar_step(); // warn: this may fire more than 1 read_cb()
+  while( gzTarBlockPos < gzTarBlocks ) {
+    int response = TAR::read_tar_step(&tarReader);
     if( response == TAR_EXPANDING_DONE ) {
       log_v("[TAR] Expanding done !");
       lastblock = true;
       return true;
     }
-    if( gzTarBlockPos > blockmod ) {
+    if( gzTarBlockPos > gzTarBlocks ) {
       log_e("[ERROR] read_tar_step() fired more too many read_cb()");
       setError( ESP32_TARGZ_TAR_ERR_GZREAD_FAIL );
       return false;
     }
     if( response < 0 ) {
-      log_e("[ERROR] gzProcessTarBuffer failed reading %d bytes (buffsize=%d) in gzip block #%d/%d, got response %d", TAR_BLOCK_SIZE, buffsize, gzTarBlockPos%blockmod, blockmod, response);
+      log_e("[ERROR] gzProcessTarBuffer failed reading %d bytes (buffsize=%d) in gzip block #%d/%d, got response %d", TAR_BLOCK_SIZE, buffsize, gzTarBlockPos, gzTarBlocks, response);
       setError( ESP32_TARGZ_TAR_ERR_GZREAD_FAIL );
       return false;
     }
@@ -1973,7 +2190,7 @@ bool TarGzUnpacker::gzProcessTarBuffer( CC_UNUSED unsigned char* buff, CC_UNUSED
 
 
 // tinyUntarReadCallback
-int TarGzUnpacker::tarReadGzStream( unsigned char* buff, size_t buffsize )
+int TarGzUnpacker::tarReadGzStream( unsigned char* buff, size_t buffsize, CC_UNUSED void *context_data )
 {
   if( buffsize%TAR_BLOCK_SIZE !=0 ) {
     log_e("[ERROR] tarReadGzStream Can't unmerge tar blocks (%d bytes) from gz block (%d bytes)\n", buffsize, GZIP_BUFF_SIZE);
@@ -2005,22 +2222,23 @@ int TarGzUnpacker::tarReadGzStream( unsigned char* buff, size_t buffsize )
 }
 
 
-// tinyUntarReadCallback
-int TarGzUnpacker::gzFeedTarBuffer( unsigned char* buff, size_t buffsize )
+// tinyUntarBorrowCallback: tar blocks are read in place from the gz output buffer, no copy
+unsigned char* TarGzUnpacker::gzBorrowTarBuffer( size_t *buffsize, CC_UNUSED void *context_data )
 {
-  static size_t bytes_fed = 0;
-  if( buffsize%TAR_BLOCK_SIZE !=0 ) {
-    log_e("[ERROR] gzFeedTarBuffer Can't unmerge tar blocks (%d bytes) from gz block (%d bytes)\n", buffsize, GZIP_BUFF_SIZE);
+  size_t blocks = *buffsize / TAR_BLOCK_SIZE;
+  if( blocks == 0 || gzTarBuffer == nullptr || gzTarBlockPos >= gzTarBlocks ) {
+    log_e("[ERROR] gzBorrowTarBuffer Can't unmerge tar blocks (%d bytes) from gz block (%d bytes)\n", *buffsize, GZIP_BUFF_SIZE);
     setError( ESP32_TARGZ_TAR_ERR_GZDEFL_FAIL );
-    return 0;
+    return nullptr;
   }
-  //stream_bytesleft -= buffsize;
-  uint32_t blockpos = gzTarBlockPos%blockmod;
-  memcpy( buff, output_buffer/*uzlib_buffer*/+(TAR_BLOCK_SIZE*blockpos), TAR_BLOCK_SIZE );
-  bytes_fed += TAR_BLOCK_SIZE;
-  log_v("[TGZ INFO][tarbuf<-gzbuf] block #%d (%d mod %d) at output_buffer[%d] (%d bytes, total %d)", blockpos, gzTarBlockPos, blockmod, (TAR_BLOCK_SIZE*blockpos), buffsize, bytes_fed );
-  gzTarBlockPos++;
-  return TAR_BLOCK_SIZE;
+  if( blocks > gzTarBlocks - gzTarBlockPos ) {
+    blocks = gzTarBlocks - gzTarBlockPos; // the rest of the run comes with the next gz buffer
+  }
+  unsigned char* block = gzTarBuffer + TAR_BLOCK_SIZE*gzTarBlockPos;
+  log_v("[TGZ INFO][tar<-gzbuf] %d block(s) #%d at output_buffer[%d]", blocks, gzTarBlockPos, TAR_BLOCK_SIZE*gzTarBlockPos );
+  gzTarBlockPos += blocks;
+  *buffsize = blocks * TAR_BLOCK_SIZE;
+  return block;
 }
 
 
@@ -2192,9 +2410,10 @@ bool TarGzUnpacker::tarGzExpander( fs_FS sourceFS, const char* sourceFile, fs_FS
 
     tarCallbacks = {
       tarHeaderUpdateCallBack,
-      gzFeedTarBuffer,
+      nullptr,
       tarStreamWriteUpdateCallback,
-      tarEndUpdateCallBack
+      tarEndUpdateCallBack,
+      gzBorrowTarBuffer
     };
 
     TAR::tar_error_logger      = tgzLogger; // targzPrintLoggerCallback or tgzLogger
@@ -2283,9 +2502,10 @@ bool TarGzUnpacker::tarGzStreamExpander( Stream *stream, fs_FS &destFS, const ch
 
   tarCallbacks = {
     tarHeaderCallBack,
-    gzFeedTarBuffer,
+    nullptr,
     tarStreamWriteCallback,
-    tarEndCallBack
+    tarEndCallBack,
+    gzBorrowTarBuffer
   };
 
   TAR::tar_error_logger      = tgzLogger; // targzPrintLoggerCallback or tgzLogger
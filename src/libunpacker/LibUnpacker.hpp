@@ -50,6 +50,11 @@ namespace GZ
   #include "../uzlib/uzlib.h"
 }
 
+namespace PATCH
+{
+  #include "../patch/libpatch.h"
+}
+
 
 #include "../types/esp32_targz_types.h"
 
@@ -121,7 +126,7 @@ struct TarUnpacker : virtual public BaseUnpacker
   void setTarExcludeFilter( tarExcludeFilter cb );
   void setTarIncludeFilter( tarIncludeFilter cb );
 
-  static int tarStreamReadCallback( unsigned char* buff, size_t buffsize );
+  static int tarStreamReadCallback( unsigned char* buff, size_t buffsize, void *context_data );
   static int tarStreamWriteCallback( TAR::header_translated_t *header, int entry_index, void *context_data, unsigned char *block, int length);
 
   static int tarHeaderCallBack(TAR::header_translated_t *header,  int entry_index,  void *context_data);
@@ -158,9 +163,19 @@ struct GzUnpacker : virtual public BaseUnpacker
     bool        gzUpdater( fs_FS &sourceFS, const char* gz_filename, int partition = U_FLASH, bool restart_on_update = true ); // flashes the ESP with the content of a *gzipped* file
     bool        gzStreamUpdater( Stream *stream, size_t update_size = 0, int partition = U_FLASH, bool restart_on_update = true ); // flashes the ESP from a gzip stream, no progress callback
     static bool gzUpdateWriteCallback( unsigned char* buff, size_t buffsize );
+    #if defined ESP32
+      bool        gzPatchUpdater( fs_FS &sourceFS, const char* patch_filename, bool restart_on_update = true ); // flashes the ESP with the running firmware + a *gzipped* delta patch (see extras/mkpatch.py)
+      bool        gzStreamPatchUpdater( Stream *stream, bool restart_on_update = true ); // same from a stream (file or HTTP)
+      static bool gzPatchWriteCallback( unsigned char* buff, size_t buffsize );
+    #endif
   #endif
   bool nodict = false;
   inline void noDict( bool force_disable_dict = true ) { nodict = force_disable_dict; };
+  // preset dictionary shared with the compressor (see LZPacker::setDictionary), must stay allocated while decompressing.
+  // Enables zlib (RFC1950) streams with FDICT in gzStreamExpander(), needs the gzip dictionary (see noDict)
+  const uint8_t* presetDict = nullptr;
+  size_t presetDictLen = 0;
+  inline void setDictionary( const uint8_t* dict, size_t dictLen ) { presetDict = dict; presetDictLen = dictLen; };
 };
 
 
@@ -176,8 +191,8 @@ struct TarGzUnpacker : public TarUnpacker, public GzUnpacker
   bool tarGzStreamExpander( Stream *stream, fs_FS &destFs, const char* destFolder = "/", int64_t streamSize = -1 );
 
   static bool gzProcessTarBuffer( unsigned char* buff, size_t buffsize );
-  static int tarReadGzStream( unsigned char* buff, size_t buffsize );
-  static int gzFeedTarBuffer( unsigned char* buff, size_t buffsize );
+  static int tarReadGzStream( unsigned char* buff, size_t buffsize, void *context_data );
+  static unsigned char* gzBorrowTarBuffer( size_t *buffsize, void *context_data );
 
   #if defined HAS_OTA_SUPPORT
     // requirements: targz archive must contain files with names suffixed by ".ino.bin" and/or ".spiffs.bin"
@@ -0,0 +1,235 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2025-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+\*/
+
+#include <string.h>
+#include "libpatch.h"
+#include "../uzlib/uzlib.h" // uzlib_crc32()
+
+
+enum {
+  PATCH_STATE_HEADER,
+  PATCH_STATE_DIFF_LEN,
+  PATCH_STATE_DIFF,
+  PATCH_STATE_EXTRA_LEN,
+  PATCH_STATE_EXTRA,
+  PATCH_STATE_SEEK
+};
+
+
+static uint32_t get_le32(const unsigned char *b)
+{
+  return b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+
+static int patch_fail(PATCH *p, int error)
+{
+  if( p->error == PATCH_OK )
+    p->error = error;
+  return p->error;
+}
+
+
+// write the block to the target and update the target crc
+static int patch_flush(PATCH *p)
+{
+  if( p->fill == 0 )
+    return PATCH_OK;
+  p->crc = uzlib_crc32(p->block, p->fill, p->crc);
+  if( p->writefunc(p->ctx, p->block, p->fill) != p->fill )
+    return patch_fail(p, PATCH_ERR_WRITE);
+  p->fill = 0;
+  return PATCH_OK;
+}
+
+
+// the header is complete: check it, then check the source image crc32 using the block as read buffer
+static int patch_header(PATCH *p)
+{
+  uint32_t crc = 0xffffffff;
+  size_t offset = 0;
+
+  if( memcmp(p->block, PATCH_MAGIC, 4) != 0 || p->block[4] != PATCH_VERSION )
+    return patch_fail(p, PATCH_ERR_HEADER);
+
+  p->source_size = get_le32(&p->block[8]);
+  p->source_crc  = get_le32(&p->block[12]);
+  p->target_size = get_le32(&p->block[16]);
+  p->target_crc  = get_le32(&p->block[20]);
+
+  while( offset < p->source_size ) {
+    size_t len = p->source_size - offset;
+    if( len > PATCH_BLOCK_SIZE )
+      len = PATCH_BLOCK_SIZE;
+    if( p->readfunc(p->ctx, offset, p->block, len) != len )
+      return patch_fail(p, PATCH_ERR_SOURCE);
+    crc = uzlib_crc32(p->block, len, crc);
+    offset += len;
+  }
+  if( ~crc != p->source_crc )
+    return patch_fail(p, PATCH_ERR_SOURCE);
+
+  p->fill = 0;
+  p->state = PATCH_STATE_DIFF_LEN;
+  return PATCH_OK;
+}
+
+
+// accumulate a LEB128 byte, returns 1 when the value is complete, -1 when it doesn't fit 32 bits
+static int patch_varint(PATCH *p, unsigned char b)
+{
+  if( p->varint_shift == 28 && (b & 0xf0) != 0 ) // 5th byte: 4 bits left, no continuation
+    return -1;
+  p->varint |= (uint32_t)(b & 0x7f) << p->varint_shift;
+  if( b & 0x80 ) {
+    p->varint_shift += 7;
+    return 0;
+  }
+  p->varint_shift = 0;
+  return 1;
+}
+
+
+void patch_init(PATCH *p, patch_readfunc_t readfunc, patch_writefunc_t writefunc, void *ctx)
+{
+  memset(p, 0, offsetof(PATCH, block)); // the block is never read before it's written
+  p->readfunc  = readfunc;
+  p->writefunc = writefunc;
+  p->ctx       = ctx;
+  p->state     = PATCH_STATE_HEADER;
+  p->error     = PATCH_OK;
+  p->crc       = 0xffffffff;
+}
+
+
+int patch_write(PATCH *p, const unsigned char *buf, size_t len)
+{
+  size_t n;
+  int ret;
+
+  if( p->error != PATCH_OK )
+    return p->error;
+
+  while( len > 0 ) {
+    switch( p->state ) {
+
+      case PATCH_STATE_HEADER:
+        n = PATCH_HEADER_SIZE - p->fill;
+        if( n > len )
+          n = len;
+        memcpy(&p->block[p->fill], buf, n);
+        p->fill += n;
+        buf += n;
+        len -= n;
+        if( p->fill == PATCH_HEADER_SIZE && patch_header(p) != PATCH_OK )
+          return p->error;
+      break;
+
+      case PATCH_STATE_DIFF_LEN:
+      case PATCH_STATE_EXTRA_LEN:
+        ret = patch_varint(p, *buf++);
+        len--;
+        if( ret < 0 )
+          return patch_fail(p, PATCH_ERR_DATA);
+        if( ret == 0 )
+          break;
+        p->remaining = p->varint;
+        p->varint = 0;
+        if( p->remaining > p->target_size - p->target_pos )
+          return patch_fail(p, PATCH_ERR_DATA);
+        if( p->state == PATCH_STATE_DIFF_LEN && p->remaining > p->source_size - p->source_pos )
+          return patch_fail(p, PATCH_ERR_DATA);
+        p->state++; // DIFF or EXTRA
+        if( p->remaining == 0 )
+          p->state++; // EXTRA_LEN or SEEK
+      break;
+
+      case PATCH_STATE_DIFF:
+      case PATCH_STATE_EXTRA:
+        n = PATCH_BLOCK_SIZE - p->fill;
+        if( n > len )
+          n = len;
+        if( n > p->remaining )
+          n = p->remaining;
+        if( p->state == PATCH_STATE_DIFF ) {
+          // the source bytes are read straight into the block and the diff bytes added in place
+          size_t i;
+          unsigned char *out = &p->block[p->fill];
+          if( p->readfunc(p->ctx, p->source_pos, out, n) != n )
+            return patch_fail(p, PATCH_ERR_SOURCE);
+          for( i = 0; i < n; i++ )
+            out[i] += buf[i];
+          p->source_pos += n;
+        } else {
+          memcpy(&p->block[p->fill], buf, n);
+        }
+        p->fill += n;
+        p->target_pos += n;
+        p->remaining -= n;
+        buf += n;
+        len -= n;
+        if( p->fill == PATCH_BLOCK_SIZE && patch_flush(p) != PATCH_OK )
+          return p->error;
+        if( p->remaining == 0 )
+          p->state++; // EXTRA_LEN or SEEK
+      break;
+
+      case PATCH_STATE_SEEK:
+        ret = patch_varint(p, *buf++);
+        len--;
+        if( ret < 0 )
+          return patch_fail(p, PATCH_ERR_DATA);
+        if( ret == 1 ) {
+          // zigzag: 0, -1, 1, -2, 2 ...
+          int64_t pos = (int64_t)p->source_pos + ( (p->varint & 1) ? -(int64_t)(p->varint >> 1) - 1 : (int64_t)(p->varint >> 1) );
+          p->varint = 0;
+          if( pos < 0 || pos > (int64_t)p->source_size )
+            return patch_fail(p, PATCH_ERR_DATA);
+          p->source_pos = (uint32_t)pos;
+          p->state = PATCH_STATE_DIFF_LEN;
+        }
+      break;
+
+      default:
+        return patch_fail(p, PATCH_ERR_DATA);
+    }
+  }
+  return PATCH_OK;
+}
+
+
+int patch_end(PATCH *p)
+{
+  if( p->error != PATCH_OK )
+    return p->error;
+  if( p->state == PATCH_STATE_HEADER )
+    return patch_fail(p, PATCH_ERR_HEADER);
+  if( patch_flush(p) != PATCH_OK )
+    return p->error;
+  if( p->state != PATCH_STATE_DIFF_LEN || p->varint_shift != 0 || p->target_pos != p->target_size || ~p->crc != p->target_crc )
+    return patch_fail(p, PATCH_ERR_CHECKSUM);
+  return PATCH_OK;
+}
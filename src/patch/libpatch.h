@@ -0,0 +1,107 @@
+/*\
+
+  MIT License
+
+  Copyright (c) 2025-now tobozo
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+
+  Delta patches (bsdiff-style) applied while streaming: the target image is rebuilt from
+  the source image and a sequence of records, each made of:
+
+    - varint diffLen, diffLen bytes added (mod 256) to the source bytes at the current source offset
+    - varint extraLen, extraLen bytes copied as is
+    - zigzag varint seek, added to the source offset
+
+  The patch starts with a 24 bytes header: "TGZP", version, 3 reserved bytes, then source size,
+  source crc32, target size and target crc32 (little endian). The source crc32 is checked before
+  the first record is applied, the target crc32 by patch_end().
+
+  Patches are made with extras/mkpatch.py and usually gzipped, see GzUnpacker::gzStreamPatchUpdater().
+
+\*/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+// size of the block buffer: source reads and target writes are done by blocks of this size
+#if !defined PATCH_BLOCK_SIZE
+  #define PATCH_BLOCK_SIZE 4096
+#endif
+
+#define PATCH_MAGIC       "TGZP"
+#define PATCH_VERSION     1
+#define PATCH_HEADER_SIZE 24
+
+#define PATCH_OK            0
+#define PATCH_ERR_HEADER   -1 // not a patch, or unsupported version
+#define PATCH_ERR_SOURCE   -2 // source image doesn't match the patch, or can't be read
+#define PATCH_ERR_DATA     -3 // corrupted record
+#define PATCH_ERR_WRITE    -4 // target write failed
+#define PATCH_ERR_CHECKSUM -5 // target image is incomplete or its crc32 doesn't match
+
+// read len bytes of the source image at offset, returns the number of bytes read
+typedef size_t (*patch_readfunc_t)(void *ctx, size_t offset, unsigned char *buf, size_t len);
+// write len bytes of the target image, returns the number of bytes written
+typedef size_t (*patch_writefunc_t)(void *ctx, unsigned char *buf, size_t len);
+
+
+typedef struct {
+  patch_readfunc_t  readfunc;
+  patch_writefunc_t writefunc;
+  void             *ctx;
+  int               state;
+  int               error;
+  uint32_t          source_size;
+  uint32_t          source_crc;
+  uint32_t          target_size;
+  uint32_t          target_crc;
+  uint32_t          crc;         // running crc32 of the target image
+  uint32_t          source_pos;  // source offset of the next diff byte
+  uint32_t          target_pos;  // target bytes produced so far, written or in the block
+  uint32_t          remaining;   // bytes left in the current diff or extra run
+  uint32_t          varint;
+  unsigned int      varint_shift;
+  size_t            fill;        // header bytes received, then target bytes in the block
+  unsigned char     block[PATCH_BLOCK_SIZE];
+} PATCH;
+
+
+// reset the patch state, no allocation: PATCH is ~PATCH_BLOCK_SIZE bytes
+void patch_init(PATCH *p, patch_readfunc_t readfunc, patch_writefunc_t writefunc, void *ctx);
+
+// feed len bytes of the (uncompressed) patch, returns PATCH_OK or the first error
+int patch_write(PATCH *p, const unsigned char *buf, size_t len);
+
+// write the last block and check the target image, returns PATCH_OK or an error
+int patch_end(PATCH *p);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -73,6 +73,7 @@ typedef void (*genericLoggerCallback)( const char* format, ... ); // same behavi
   #define fs_SeekSet SeekSet
   #define fs_file_read  "r"
   #define fs_file_write "w" // TODO: check what ancient platform needed "w+" instead of "w" and remove this comment
+  #define fs_file_append "a"
 
   // #define fs_file_read  FILE_READ
   // // on Teensyduino, FILE_WRITE flag doesn't truncate existing files, so FILE_WRITE_BEGIN it is
@@ -88,6 +89,7 @@ typedef void (*genericLoggerCallback)( const char* format, ... ); // same behavi
 
   #define fs_file_read  "r"
   #define fs_file_write "w" // TODO: check what ancient platform needed "w+" instead of "w" and remove this comment
+  #define fs_file_append "a"
 
 #endif
 
@@ -146,6 +148,8 @@ typedef enum tarGzErrorCode /* int8_t */
   ESP32_TARGZ_UZLIB_PARSE_HEADER_FAILED  =  -105, // Gz Error when parsing header
   ESP32_TARGZ_UZLIB_MALLOC_FAIL          =  -106, // Gz Error when allocating memory
   ESP32_TARGZ_INTEGRITY_FAIL             =  -107, // General error, file integrity check fail
+  ESP32_TARGZ_PATCH_INVALID              =  -108, // Not a delta patch, or corrupted
+  ESP32_TARGZ_PATCH_SOURCE_MISMATCH      =  -109, // Delta patch was not made for the running firmware
 
   // UZLIB: keeping error values from uzlib.h as is (no offset)
   ESP32_TARGZ_UZLIB_INVALID_FILE         =  -2,   // Not a valid gzip file
@@ -186,6 +190,93 @@ typedef enum tarGzErrorCode /* int8_t */
 
 // LibPacker types **************************************************************
 
+// Symbol buffer size (bytes) for dynamic huffman blocks, 3 bytes per LZ77 symbol.
+// Bigger buffers make bigger blocks with less tree overhead, set to 0 to emit static huffman blocks only.
+#if !defined LZPACKER_SYMBOL_BUFFER_SIZE
+  #if defined ESP8266
+    #define LZPACKER_SYMBOL_BUFFER_SIZE 6144
+  #else
+    #define LZPACKER_SYMBOL_BUFFER_SIZE 16384
+  #endif
+#endif
+
+// Compression history (bytes, up to 32768) kept across chunks when compressing from a stream.
+// Matches can reach back this far into previous chunks, set to 0 to compress chunks independently.
+#if !defined LZPACKER_STREAM_HISTORY_SIZE
+  #if defined ESP8266
+    #define LZPACKER_STREAM_HISTORY_SIZE 4096
+  #else
+    #define LZPACKER_STREAM_HISTORY_SIZE 32768
+  #endif
+#endif
+
+// Output staging buffer (bytes, 512 minimum) for buffer to stream compression, flushed with bulk Stream::write() calls
+#if !defined LZPACKER_WRITE_BUFFER_SIZE
+  #if defined ESP8266
+    #define LZPACKER_WRITE_BUFFER_SIZE 512
+  #else
+    #define LZPACKER_WRITE_BUFFER_SIZE 1024
+  #endif
+#endif
+#if LZPACKER_WRITE_BUFFER_SIZE < 512
+  #error "LZPACKER_WRITE_BUFFER_SIZE must be at least 512 bytes"
+#endif
+
+// Memory budget (bytes) per compressor, the hash table, hash chains, symbol buffer, stream history and
+// staging buffers are derived from it, see LZPacker::setMemoryBudget(). 0 = use the sizes above.
+#if !defined LZPACKER_MEMORY_BUDGET
+  #define LZPACKER_MEMORY_BUDGET 0
+#endif
+
+// Default compression level, same scale as zlib: 0 = stored, 1 = fastest, 9 = best.
+// Levels 1-3 use greedy matching, levels 4-9 use lazy matching with longer hash chains.
+// Level 10 is optimal parsing: several passes over a cost model, slow and ~1.5MB of RAM, meant for offline builds.
+#if !defined LZPACKER_DEFAULT_LEVEL
+  #if defined ESP8266
+    #define LZPACKER_DEFAULT_LEVEL 1
+  #else
+    #define LZPACKER_DEFAULT_LEVEL 6
+  #endif
+#endif
+
+// Hash chain table size (log2 of entries, 2 bytes per entry), bounds how far back chained candidates are searched.
+#if !defined LZPACKER_CHAIN_BITS
+  #if defined ESP8266
+    #define LZPACKER_CHAIN_BITS 11
+  #else
+    #define LZPACKER_CHAIN_BITS 13
+  #endif
+#endif
+
+// Adaptive compression: input with few matches (jpg, png, gz, encrypted) is stored without searching for matches
+// and sampled again later, saves CPU time on mixed content. Needs the symbol buffer.
+#if !defined LZPACKER_ADAPTIVE
+  #define LZPACKER_ADAPTIVE 1
+#endif
+
+// Parallel compression of in-memory sources (pigz-style) on multi-core ESP32: number of tasks, 0 or 1 = disabled.
+// Each task compresses LZPACKER_PARALLEL_BLOCK_SIZE bytes with its own compressor (~50KB + compressed block).
+#if !defined LZPACKER_PARALLEL_TASKS
+  #if defined ESP32 && !defined CONFIG_FREERTOS_UNICORE
+    #define LZPACKER_PARALLEL_TASKS 2
+  #else
+    #define LZPACKER_PARALLEL_TASKS 0
+  #endif
+#endif
+
+#if !defined LZPACKER_PARALLEL_BLOCK_SIZE
+  #define LZPACKER_PARALLEL_BLOCK_SIZE 65536
+#endif
+
+// Rolling log archiver (LZPacker::GzipLogRotator): a .gz segment is closed and a new one started past this many compressed bytes
+#if !defined LZPACKER_LOG_SEGMENT_SIZE
+  #if defined ESP8266
+    #define LZPACKER_LOG_SEGMENT_SIZE 16384
+  #else
+    #define LZPACKER_LOG_SEGMENT_SIZE 65536
+  #endif
+#endif
+
 namespace LZPacker
 {
   typedef size_t (*gzStreamReader_t)( uint8_t* buf, size_t bufsize );
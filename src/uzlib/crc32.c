@@ -29,6 +29,10 @@
  *
  * 3. This notice may not be removed or altered from
  *    any source distribution.
+ *
+ *
+ * Edited by Tobozo for ESP32-targz
+ *  - Added uzlib_crc32_combine()
  */
 
 /*
@@ -61,3 +65,39 @@ uint32_t uzlib_crc32(const void *data, unsigned int length, uint32_t crc)
    // return value suitable for passing in next time, for final value invert it
    return crc/* ^ 0xffffffff*/;
 }
+
+
+/* multiply a and b modulo the crc polynomial, both reflected */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+   uint32_t m = (uint32_t)1 << 31, p = 0;
+
+   for (;;) {
+      if (a & m) {
+         p ^= b;
+         if ((a & (m - 1)) == 0)
+            break;
+      }
+      m >>= 1;
+      b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+   }
+   return p;
+}
+
+/* crc of the concatenation of two blocks, from their (final) crcs and the length of the second block */
+uint32_t uzlib_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+   uint32_t sq = (uint32_t)1 << 30; /* x^1 */
+   uint32_t p  = (uint32_t)1 << 31; /* x^0 */
+   int k;
+
+   for (k = 0; k < 3; k++)
+      sq = crc32_multmodp(sq, sq); /* x^8, one byte */
+   while (len2) {
+      if (len2 & 1)
+         p = crc32_multmodp(sq, p);
+      len2 >>= 1;
+      sq = crc32_multmodp(sq, sq);
+   }
+   return crc32_multmodp(p, crc1) ^ crc2;
+}
@@ -33,6 +33,14 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
   - Added byteWriter to outbits()
   - Added out4bytes(), with byteWriter support
   - Added zlib_next_block() and zlib_empty_block() for streamed input
+  - Added dynamic huffman blocks, enabled with zlib_huff_init()
+  - Added stored blocks for literal only blocks and level 0
+  - Replaced length/distance code binary searches with lookup tables
+  - Added 64 bits accumulator, geometric output growth and writeDestBytes()
+  - Added zlib_split_block(), stored/compressed input byte counters
+  - Added zlib_huff_size() and zlib_huff_place() for caller provided memory
+  - Added zlib_partial_block() for Z_PARTIAL_FLUSH and stream blocks spanning several calls
+  - Added zlib_match_symbols() for the optimal parser cost model
 
 
 */
@@ -54,66 +62,103 @@ WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #endif
 
 /* ----------------------------------------------------------------------
- * Zlib compression. We always use the static Huffman tree option.
- * Mostly this is because it's hard to scan a block in advance to
- * work out better trees; dynamic trees are great when you're
- * compressing a large file under no significant time constraint,
- * but when you're compressing little bits in real time, things get
- * hairier.
+ * Zlib compression. By default we use the static Huffman tree option,
+ * symbols are emitted as soon as the LZ77 matcher produces them.
  *
- * I suppose it's possible that I could compute Huffman trees based
- * on the frequencies in the _previous_ block, as a sort of
- * heuristic, but I'm not confident that the gain would balance out
- * having to transmit the trees.
+ * When a symbol buffer is attached with zlib_huff_init(), literals and
+ * matches are collected until the buffer is full (or the block is
+ * closed), then the block is emitted with dynamic Huffman trees built
+ * from the symbol frequencies, unless the static trees turn out to be
+ * cheaper for this block. Blocks without matches are stored as is when
+ * that's the smallest option (always at level 0).
  */
 
-void outbits(struct uzlib_comp *out, unsigned long bits, int nbits)
+/*
+ * Output goes to the outbuf span: in grow mode (grow_buffer = 1) the span
+ * is reallocated geometrically and keeps the whole output, otherwise the
+ * span has a fixed size and writeDestBytes() is called each time it's full
+ * (and by zlib_flush_output()). The legacy writeDestByte() is still called
+ * once per byte when set.
+ */
+
+/* make room for n more bytes in the output span */
+static void outreserve(struct uzlib_comp *out, int n)
 {
-    assert(out->noutbits + nbits <= 32);
-    out->outbits |= bits << out->noutbits;
-    out->noutbits += nbits;
-    while (out->noutbits >= 8) {
-        if (out->outlen+1 >= out->outsize) {
-            out->outsize = out->outlen + 64;
-            if( out->grow_buffer == 1 )
-                out->outbuf = sresize(out->outbuf, out->outsize, unsigned char);
+    if (out->grow_buffer == 1) {
+        if (out->outlen + n > out->outsize) {
+            int size = out->outsize + out->outsize / 2;
+            if (size < out->outlen + n)
+                size = out->outlen + n;
+            if (size < 256)
+                size = 256;
+            out->outbuf = sresize(out->outbuf, size, unsigned char);
+            out->outsize = size;
         }
-        unsigned char outval = (out->outbits & 0xFF);
-        if( out->grow_buffer == 1 )
-            out->outbuf[out->outlen] = outval;
-        if( out->writeDestByte ) // compressing to stream: write 1 byte
-            out->writeDestByte( out, outval );
-        out->outlen++;
-        out->outbits >>= 8;
-        out->noutbits -= 8;
+    } else if (out->writeDestBytes && out->outpos + n > out->outsize) {
+        /* the writer may also swap the span (outbuf, outsize) */
+        out->writeDestBytes(out, out->outbuf, out->outpos);
+        out->outpos = 0;
     }
 }
 
+/* move nbytes (up to 8) from the bit accumulator to the output */
+static void outaccbytes(struct uzlib_comp *out, int nbytes)
+{
+    int i;
+    if (out->grow_buffer == 1 || out->writeDestBytes) {
+        unsigned char *dst;
+        outreserve(out, nbytes);
+        if (out->grow_buffer == 1) {
+            dst = out->outbuf + out->outlen;
+        } else {
+            dst = out->outbuf + out->outpos;
+            out->outpos += nbytes;
+        }
+        for (i = 0; i < nbytes; i++)
+            dst[i] = (unsigned char)(out->outbits >> (8 * i));
+    }
+    if (out->writeDestByte) { // compressing to stream: write 1 byte at a time
+        for (i = 0; i < nbytes; i++)
+            out->writeDestByte(out, (unsigned char)(out->outbits >> (8 * i)));
+    }
+    out->outlen += nbytes;
+    out->outbits = nbytes == 8 ? 0 : out->outbits >> (8 * nbytes);
+    out->noutbits -= 8 * nbytes;
+}
+
+void outbits(struct uzlib_comp *out, unsigned long bits, int nbits)
+{
+    assert(nbits <= 32 && out->noutbits < 32);
+    out->outbits |= (uint64_t)bits << out->noutbits;
+    out->noutbits += nbits;
+    if (out->noutbits >= 32)
+        outaccbytes(out, 4); /* a whole word at a time */
+}
+
+/* pad with zero bits to a byte boundary and move all complete bytes to the output */
+void outalign(struct uzlib_comp *out)
+{
+    if (out->noutbits & 7)
+        outbits(out, 0, 8 - (out->noutbits & 7));
+    if (out->noutbits)
+        outaccbytes(out, out->noutbits / 8);
+}
+
 
 void out4bytes( struct uzlib_comp *out, unsigned char st, unsigned char nd, unsigned char rd, unsigned char th )
 {
-    int newlen = out->outlen + 4;
-    if (newlen > out->outsize) {
-        out->outsize = newlen;
-        if( out->grow_buffer == 1 )
-            out->outbuf = sresize(out->outbuf, newlen, unsigned char);
-    }
+    outalign(out);
+    outbits(out, st | (nd << 8) | (rd << 16) | ((unsigned long)th << 24), 32);
+    outalign(out);
+}
 
-    if( out->grow_buffer == 1 ) {
-        out->outbuf[out->outlen]   = st;
-        out->outbuf[out->outlen+1] = nd;
-        out->outbuf[out->outlen+2] = rd;
-        out->outbuf[out->outlen+3] = th;
-    }
 
-    if( out->writeDestByte ) {
-        // compressing to stream: write 4 bytes
-        out->writeDestByte( out, st );
-        out->writeDestByte( out, nd );
-        out->writeDestByte( out, rd );
-        out->writeDestByte( out, th );
+void zlib_flush_output(struct uzlib_comp *out)
+{
+    if (out->grow_buffer != 1 && out->writeDestBytes && out->outpos > 0) {
+        out->writeDestBytes(out, out->outbuf, out->outpos);
+        out->outpos = 0;
     }
-    out->outlen+=4;
 }
 
 
@@ -153,83 +198,651 @@ static const unsigned char mirrorbytes[256] = {
 };
 
 typedef struct {
+    uint8_t code;       /* static huffman code, pre-mirrored */
+    uint8_t bits;       /* static huffman code length */
     uint8_t extrabits;
-    uint8_t min, max;
+    uint8_t min;        /* first length of this code, minus 3 */
 } len_coderecord;
 
 typedef struct {
-    uint8_t code, extrabits;
-    uint16_t min, max;
+    uint8_t code;       /* static huffman code (5 bits), pre-mirrored */
+    uint8_t extrabits;
+    uint16_t min;       /* first distance of this code */
 } dist_coderecord;
 
-#define TO_LCODE(x, y) x - 3, y - 3
-#define FROM_LCODE(x) (x + 3)
-
+/* length code 257 + i */
 static const len_coderecord lencodes[] = {
-    {0, TO_LCODE(3, 3)},
-    {0, TO_LCODE(4, 4)},
-    {0, TO_LCODE(5, 5)},
-    {0, TO_LCODE(6, 6)},
-    {0, TO_LCODE(7, 7)},
-    {0, TO_LCODE(8, 8)},
-    {0, TO_LCODE(9, 9)},
-    {0, TO_LCODE(10, 10)},
-    {1, TO_LCODE(11, 12)},
-    {1, TO_LCODE(13, 14)},
-    {1, TO_LCODE(15, 16)},
-    {1, TO_LCODE(17, 18)},
-    {2, TO_LCODE(19, 22)},
-    {2, TO_LCODE(23, 26)},
-    {2, TO_LCODE(27, 30)},
-    {2, TO_LCODE(31, 34)},
-    {3, TO_LCODE(35, 42)},
-    {3, TO_LCODE(43, 50)},
-    {3, TO_LCODE(51, 58)},
-    {3, TO_LCODE(59, 66)},
-    {4, TO_LCODE(67, 82)},
-    {4, TO_LCODE(83, 98)},
-    {4, TO_LCODE(99, 114)},
-    {4, TO_LCODE(115, 130)},
-    {5, TO_LCODE(131, 162)},
-    {5, TO_LCODE(163, 194)},
-    {5, TO_LCODE(195, 226)},
-    {5, TO_LCODE(227, 257)},
-    {0, TO_LCODE(258, 258)},
+    {0x40, 7, 0,   0}, /* 257: 3-3 */
+    {0x20, 7, 0,   1}, /* 258: 4-4 */
+    {0x60, 7, 0,   2}, /* 259: 5-5 */
+    {0x10, 7, 0,   3}, /* 260: 6-6 */
+    {0x50, 7, 0,   4}, /* 261: 7-7 */
+    {0x30, 7, 0,   5}, /* 262: 8-8 */
+    {0x70, 7, 0,   6}, /* 263: 9-9 */
+    {0x08, 7, 0,   7}, /* 264: 10-10 */
+    {0x48, 7, 1,   8}, /* 265: 11-12 */
+    {0x28, 7, 1,  10}, /* 266: 13-14 */
+    {0x68, 7, 1,  12}, /* 267: 15-16 */
+    {0x18, 7, 1,  14}, /* 268: 17-18 */
+    {0x58, 7, 2,  16}, /* 269: 19-22 */
+    {0x38, 7, 2,  20}, /* 270: 23-26 */
+    {0x78, 7, 2,  24}, /* 271: 27-30 */
+    {0x04, 7, 2,  28}, /* 272: 31-34 */
+    {0x44, 7, 3,  32}, /* 273: 35-42 */
+    {0x24, 7, 3,  40}, /* 274: 43-50 */
+    {0x64, 7, 3,  48}, /* 275: 51-58 */
+    {0x14, 7, 3,  56}, /* 276: 59-66 */
+    {0x54, 7, 4,  64}, /* 277: 67-82 */
+    {0x34, 7, 4,  80}, /* 278: 83-98 */
+    {0x74, 7, 4,  96}, /* 279: 99-114 */
+    {0x03, 8, 4, 112}, /* 280: 115-130 */
+    {0x83, 8, 5, 128}, /* 281: 131-162 */
+    {0x43, 8, 5, 160}, /* 282: 163-194 */
+    {0xc3, 8, 5, 192}, /* 283: 195-226 */
+    {0x23, 8, 5, 224}, /* 284: 227-257 */
+    {0xa3, 8, 0, 255}, /* 285: 258-258 */
 };
 
+/* distance code i */
 static const dist_coderecord distcodes[] = {
-    {0, 0, 1, 1},
-    {1, 0, 2, 2},
-    {2, 0, 3, 3},
-    {3, 0, 4, 4},
-    {4, 1, 5, 6},
-    {5, 1, 7, 8},
-    {6, 2, 9, 12},
-    {7, 2, 13, 16},
-    {8, 3, 17, 24},
-    {9, 3, 25, 32},
-    {10, 4, 33, 48},
-    {11, 4, 49, 64},
-    {12, 5, 65, 96},
-    {13, 5, 97, 128},
-    {14, 6, 129, 192},
-    {15, 6, 193, 256},
-    {16, 7, 257, 384},
-    {17, 7, 385, 512},
-    {18, 8, 513, 768},
-    {19, 8, 769, 1024},
-    {20, 9, 1025, 1536},
-    {21, 9, 1537, 2048},
-    {22, 10, 2049, 3072},
-    {23, 10, 3073, 4096},
-    {24, 11, 4097, 6144},
-    {25, 11, 6145, 8192},
-    {26, 12, 8193, 12288},
-    {27, 12, 12289, 16384},
-    {28, 13, 16385, 24576},
-    {29, 13, 24577, 32768},
+    {0x00,  0,     1}, /* 0: 1-1 */
+    {0x10,  0,     2}, /* 1: 2-2 */
+    {0x08,  0,     3}, /* 2: 3-3 */
+    {0x18,  0,     4}, /* 3: 4-4 */
+    {0x04,  1,     5}, /* 4: 5-6 */
+    {0x14,  1,     7}, /* 5: 7-8 */
+    {0x0c,  2,     9}, /* 6: 9-12 */
+    {0x1c,  2,    13}, /* 7: 13-16 */
+    {0x02,  3,    17}, /* 8: 17-24 */
+    {0x12,  3,    25}, /* 9: 25-32 */
+    {0x0a,  4,    33}, /* 10: 33-48 */
+    {0x1a,  4,    49}, /* 11: 49-64 */
+    {0x06,  5,    65}, /* 12: 65-96 */
+    {0x16,  5,    97}, /* 13: 97-128 */
+    {0x0e,  6,   129}, /* 14: 129-192 */
+    {0x1e,  6,   193}, /* 15: 193-256 */
+    {0x01,  7,   257}, /* 16: 257-384 */
+    {0x11,  7,   385}, /* 17: 385-512 */
+    {0x09,  8,   513}, /* 18: 513-768 */
+    {0x19,  8,   769}, /* 19: 769-1024 */
+    {0x05,  9,  1025}, /* 20: 1025-1536 */
+    {0x15,  9,  1537}, /* 21: 1537-2048 */
+    {0x0d, 10,  2049}, /* 22: 2049-3072 */
+    {0x1d, 10,  3073}, /* 23: 3073-4096 */
+    {0x03, 11,  4097}, /* 24: 4097-6144 */
+    {0x13, 11,  6145}, /* 25: 6145-8192 */
+    {0x0b, 12,  8193}, /* 26: 8193-12288 */
+    {0x1b, 12, 12289}, /* 27: 12289-16384 */
+    {0x07, 13, 16385}, /* 28: 16385-24576 */
+    {0x17, 13, 24577}, /* 29: 24577-32768 */
+};
+
+/* lencodes[] index for each match length minus 3 */
+static const uint8_t len_lut[256] = {
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  8,  9,  9, 10, 10, 11, 11,
+    12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15,
+    16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17, 17,
+    18, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19, 19,
+    20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+    21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22,
+    23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+    24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+    24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+    25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 28,
+};
+
+/* distcodes[] index: distances up to 256 are direct, above that indexed by (distance-1) >> 7 */
+static const uint8_t dist_lut[512] = {
+     0,  1,  2,  3,  4,  4,  5,  5,  6,  6,  6,  6,  7,  7,  7,  7,
+     8,  8,  8,  8,  8,  8,  8,  8,  9,  9,  9,  9,  9,  9,  9,  9,
+    10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+    11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+    12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+    12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+    13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13,
+    13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13, 13,
+    14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+    14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+    14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+    14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14, 14,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+     0,  0, 16, 17, 18, 18, 19, 19, 20, 20, 20, 20, 21, 21, 21, 21,
+    22, 22, 22, 22, 22, 22, 22, 22, 23, 23, 23, 23, 23, 23, 23, 23,
+    24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+    25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
 };
 
+#define LEN_CODE(len)   (&lencodes[len_lut[(len) - 3]])
+#define DIST_CODE(dist) (&distcodes[dist_lut[(dist) <= 256 ? (dist) - 1 : 256 + (((dist) - 1) >> 7)]])
+
+static void fixed_literal(struct uzlib_comp *out, unsigned char c)
+{
+    if (c <= 143) {
+        /* 0 through 143 are 8 bits long starting at 00110000. */
+        outbits(out, mirrorbytes[0x30 + c], 8);
+    } else {
+        /* 144 through 255 are 9 bits long starting at 110010000. */
+        outbits(out, 1 + 2 * mirrorbytes[0x90 - 144 + c], 9);
+    }
+}
+
+static void fixed_match(struct uzlib_comp *out, int distance, int thislen)
+{
+    const len_coderecord *l = LEN_CODE(thislen);
+    const dist_coderecord *d = DIST_CODE(distance);
+
+    /* length code, length extra bits, distance code, distance extra bits: 31 bits at most */
+    unsigned long lbits = l->code | ((unsigned long)(thislen - 3 - l->min) << l->bits);
+    unsigned long dbits = d->code | ((unsigned long)(distance - d->min) << 5);
+    int lnbits = l->bits + l->extrabits;
+    outbits(out, lbits | (dbits << lnbits), lnbits + 5 + d->extrabits);
+}
+
+
+/* ----------------------------------------------------------------------
+ * Dynamic Huffman blocks.
+ */
+
+#define HUFF_LCODES   286 /* literal/length alphabet: 0-255, EOB, 257-285 */
+#define HUFF_DCODES   30  /* distance alphabet */
+#define HUFF_BLCODES  19  /* code length alphabet */
+#define HUFF_MAX_BITS 15  /* max code length for literal/length and distance codes */
+#define HUFF_MAX_BL   7   /* max code length for code length codes */
+#define HUFF_EOB      256
+
+struct uzlib_huff {
+    /* symbol buffer, 3 bytes per symbol: distance (2 bytes, 0 for a literal), literal or length-3 */
+    uint8_t *sym_buf;
+    unsigned int sym_len;
+    unsigned int sym_max;
+    unsigned int in_len; /* input bytes covered by the symbols */
+    char last; /* the pending block is the final block */
+    char placed; /* caller provided memory, see zlib_huff_place() */
+
+    uint16_t lfreq[HUFF_LCODES], dfreq[HUFF_DCODES], cfreq[HUFF_BLCODES];
+    uint8_t llen[HUFF_LCODES], dlen[HUFF_DCODES], clen[HUFF_BLCODES];
+    uint16_t lcode[HUFF_LCODES], dcode[HUFF_DCODES], ccode[HUFF_BLCODES];
+
+    /* run-length encoded code lengths: code length symbol and its extra bits value */
+    uint8_t rle_sym[HUFF_LCODES + HUFF_DCODES], rle_extra[HUFF_LCODES + HUFF_DCODES];
+    unsigned int rle_len;
+
+    /* scratch space for the code length builder */
+    uint32_t work[HUFF_LCODES];
+    uint16_t order[HUFF_LCODES];
+};
+
+/* Code length codes are transmitted in this order (RFC1951 3.2.7) */
+static const uint8_t blorder[HUFF_BLCODES] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Extra bits for code length symbols 16, 17 and 18 */
+static const uint8_t blextra[3] = { 2, 3, 7 };
+
+
+/*
+ * In-place minimum redundancy code lengths for a list of weights sorted
+ * in ascending order (A. Moffat, J. Katajainen, "In-Place Calculation of
+ * Minimum-Redundancy Codes"). On return A[i] holds the code length of
+ * the i-th weight.
+ */
+static void huff_min_redundancy(uint32_t *A, int n)
+{
+    int root, leaf, next, avbl, used, dpth;
+
+    if (n == 0)
+        return;
+    if (n == 1) {
+        A[0] = 1;
+        return;
+    }
+    A[0] += A[1];
+    root = 0;
+    leaf = 2;
+    for (next = 1; next < n - 1; next++) {
+        if (leaf >= n || A[root] < A[leaf]) {
+            A[next] = A[root];
+            A[root++] = next;
+        } else {
+            A[next] = A[leaf++];
+        }
+        if (leaf >= n || (root < next && A[root] < A[leaf])) {
+            A[next] += A[root];
+            A[root++] = next;
+        } else {
+            A[next] += A[leaf++];
+        }
+    }
+    A[n - 2] = 0;
+    for (next = n - 3; next >= 0; next--)
+        A[next] = A[A[next]] + 1;
+    avbl = 1;
+    used = dpth = 0;
+    root = n - 2;
+    next = n - 1;
+    while (avbl > 0) {
+        while (root >= 0 && (int)A[root] == dpth) {
+            used++;
+            root--;
+        }
+        while (avbl > used) {
+            A[next--] = dpth;
+            avbl--;
+        }
+        avbl = 2 * used;
+        dpth++;
+        used = 0;
+    }
+}
+
+
+/*
+ * Build length-limited canonical Huffman codes from the symbol
+ * frequencies. Codes are stored bit-reversed, ready for outbits().
+ */
+static void huff_build(struct uzlib_huff *h, const uint16_t *freq, int n, int maxbits, uint8_t *lens, uint16_t *codes)
+{
+    uint16_t num[HUFF_MAX_BITS + 2];
+    uint16_t next_code[HUFF_MAX_BITS + 2];
+    uint32_t total;
+    int i, j, m = 0;
+
+    memset(lens, 0, n);
+    memset(num, 0, sizeof(num));
+
+    /* Collect used symbols, sorted by ascending frequency */
+    for (i = 0; i < n; i++) {
+        if (freq[i] == 0)
+            continue;
+        for (j = m; j > 0 && freq[h->order[j - 1]] > freq[i]; j--)
+            h->order[j] = h->order[j - 1];
+        h->order[j] = i;
+        m++;
+    }
+
+    if (m == 0)
+        return;
+
+    for (i = 0; i < m; i++)
+        h->work[i] = freq[h->order[i]];
+    huff_min_redundancy(h->work, m);
+
+    /* Enforce the maximum code length, keeping the code complete */
+    for (i = 0; i < m; i++)
+        num[h->work[i] > (uint32_t)maxbits ? (uint32_t)maxbits : h->work[i]]++;
+    total = 0;
+    for (i = maxbits; i > 0; i--)
+        total += (uint32_t)num[i] << (maxbits - i);
+    while (total != (1UL << maxbits)) {
+        num[maxbits]--;
+        for (i = maxbits - 1; i > 0; i--) {
+            if (num[i]) {
+                num[i]--;
+                num[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    /* Most frequent symbols get the shortest codes */
+    for (i = 1, j = m - 1; i <= maxbits; i++) {
+        int k;
+        for (k = num[i]; k > 0; k--)
+            lens[h->order[j--]] = i;
+    }
+
+    /* Canonical codes (RFC1951 3.2.2), bit-reversed */
+    memset(num, 0, sizeof(num));
+    for (i = 0; i < n; i++)
+        num[lens[i]]++;
+    num[0] = 0;
+    next_code[1] = 0;
+    for (i = 2; i <= maxbits; i++)
+        next_code[i] = (next_code[i - 1] + num[i - 1]) << 1;
+    for (i = 0; i < n; i++) {
+        int len = lens[i];
+        if (len) {
+            uint16_t code = next_code[len]++;
+            codes[i] = ((mirrorbytes[code & 0xFF] << 8) | mirrorbytes[code >> 8]) >> (16 - len);
+        }
+    }
+}
+
+
+/*
+ * Make sure at least two symbols of an alphabet are used, so the
+ * resulting code is complete (some inflaters reject incomplete codes).
+ */
+static void huff_min_symbols(uint16_t *freq, int n)
+{
+    int i, used = 0;
+    for (i = 0; i < n && used < 2; i++)
+        if (freq[i])
+            used++;
+    for (i = 0; i < n && used < 2; i++) {
+        if (freq[i] == 0) {
+            freq[i] = 1;
+            used++;
+        }
+    }
+}
+
+
+static void huff_rle_push(struct uzlib_huff *h, int sym, int extra)
+{
+    h->rle_sym[h->rle_len] = sym;
+    h->rle_extra[h->rle_len] = extra;
+    h->rle_len++;
+    h->cfreq[sym]++;
+}
+
+
+/*
+ * Run-length encode the literal/length and distance code lengths
+ * using code length symbols 16 (repeat previous), 17 and 18 (repeat zero).
+ */
+static void huff_rle(struct uzlib_huff *h, int hlit, int hdist)
+{
+    int total = hlit + hdist;
+    int i = 0;
+
+    h->rle_len = 0;
+    memset(h->cfreq, 0, sizeof(h->cfreq));
+
+    while (i < total) {
+        int v = i < hlit ? h->llen[i] : h->dlen[i - hlit];
+        int run = 1;
+        while (i + run < total && (i + run < hlit ? h->llen[i + run] : h->dlen[i + run - hlit]) == v)
+            run++;
+        i += run;
+        if (v == 0) {
+            while (run >= 11) {
+                int r = run > 138 ? 138 : run;
+                huff_rle_push(h, 18, r - 11);
+                run -= r;
+            }
+            if (run >= 3) {
+                huff_rle_push(h, 17, run - 3);
+                run = 0;
+            }
+        } else {
+            huff_rle_push(h, v, 0);
+            run--;
+            while (run >= 3) {
+                int r = run > 6 ? 6 : run;
+                huff_rle_push(h, 16, r - 3);
+                run -= r;
+            }
+        }
+        while (run-- > 0)
+            huff_rle_push(h, v, 0);
+    }
+}
+
+
+/*
+ * Emit the buffered symbols as one deflate block, with dynamic trees
+ * or static trees, whichever is smaller.
+ */
+/* emit a literal only block as a stored block */
+static void huff_stored_block(struct uzlib_comp *out, int final)
+{
+    struct uzlib_huff *h = out->huff;
+    unsigned int i;
+
+    outbits(out, final ? 1 : 0, 1);
+    outbits(out, 0, 2); /* Stored block */
+    outalign(out);
+    outbits(out, h->sym_len, 16);
+    outbits(out, ~h->sym_len & 0xFFFF, 16);
+    for (i = 0; i < h->sym_len; i++)
+        outbits(out, h->sym_buf[i * 3 + 2], 8);
+    out->stored_bytes += h->in_len;
+    h->sym_len = h->in_len = 0;
+}
+
+static void huff_flush_block(struct uzlib_comp *out, int final)
+{
+    struct uzlib_huff *h = out->huff;
+    unsigned long fixed_cost = 3, dyn_cost = 3 + 5 + 5 + 4, stored_cost = (unsigned long)-1;
+    int hlit, hdist, hclen, has_match = 0;
+    unsigned int i;
+
+    if (h->sym_len == 0 && !final)
+        return;
+
+    memset(h->lfreq, 0, sizeof(h->lfreq));
+    memset(h->dfreq, 0, sizeof(h->dfreq));
+    h->lfreq[HUFF_EOB] = 1;
+
+    for (i = 0; i < h->sym_len; i++) {
+        const uint8_t *sym = &h->sym_buf[i * 3];
+        int dist = sym[0] | (sym[1] << 8);
+        if (dist == 0) {
+            h->lfreq[sym[2]]++;
+            fixed_cost += sym[2] <= 143 ? 8 : 9;
+        } else {
+            const len_coderecord *l = &lencodes[len_lut[sym[2]]];
+            const dist_coderecord *d = DIST_CODE(dist);
+            int lcode = l - lencodes + 257;
+            has_match = 1;
+            h->lfreq[lcode]++;
+            h->dfreq[d - distcodes]++;
+            /* extra bits are the same for both codings */
+            fixed_cost += l->bits + 5 + l->extrabits + d->extrabits;
+            dyn_cost += l->extrabits + d->extrabits;
+        }
+    }
+    fixed_cost += 7; /* EOB */
+
+    if (!has_match) {
+        /* literals only: storing is an option, and the only one at level 0 */
+        if (out->store_only && h->sym_len) {
+            huff_stored_block(out, final);
+            return;
+        }
+        stored_cost = 3 + (8 - (out->noutbits + 3) % 8) % 8 + 32 + 8UL * h->sym_len;
+    }
+
+    huff_min_symbols(h->lfreq, HUFF_LCODES);
+    huff_min_symbols(h->dfreq, HUFF_DCODES);
+    huff_build(h, h->lfreq, HUFF_LCODES, HUFF_MAX_BITS, h->llen, h->lcode);
+    huff_build(h, h->dfreq, HUFF_DCODES, HUFF_MAX_BITS, h->dlen, h->dcode);
+
+    for (hlit = HUFF_LCODES; hlit > 257 && h->llen[hlit - 1] == 0; hlit--);
+    for (hdist = HUFF_DCODES; hdist > 1 && h->dlen[hdist - 1] == 0; hdist--);
+
+    huff_rle(h, hlit, hdist);
+    huff_build(h, h->cfreq, HUFF_BLCODES, HUFF_MAX_BL, h->clen, h->ccode);
+
+    for (hclen = HUFF_BLCODES; hclen > 4 && h->clen[blorder[hclen - 1]] == 0; hclen--);
+
+    dyn_cost += 3 * hclen;
+    for (i = 0; i < HUFF_BLCODES; i++)
+        dyn_cost += (unsigned long)h->cfreq[i] * h->clen[i] + (i >= 16 ? h->cfreq[i] * blextra[i - 16] : 0);
+    for (i = 0; i < HUFF_LCODES; i++)
+        dyn_cost += (unsigned long)h->lfreq[i] * h->llen[i];
+    for (i = 0; i < HUFF_DCODES; i++)
+        dyn_cost += (unsigned long)h->dfreq[i] * h->dlen[i];
+
+    if (stored_cost < dyn_cost && stored_cost < fixed_cost) {
+        huff_stored_block(out, final);
+        return;
+    }
+
+    outbits(out, final ? 1 : 0, 1);
+
+    if (dyn_cost >= fixed_cost) {
+        outbits(out, 1, 2); /* Static huffman block */
+        for (i = 0; i < h->sym_len; i++) {
+            const uint8_t *sym = &h->sym_buf[i * 3];
+            int dist = sym[0] | (sym[1] << 8);
+            if (dist == 0)
+                fixed_literal(out, sym[2]);
+            else
+                fixed_match(out, dist, sym[2] + 3);
+        }
+        outbits(out, 0, 7); /* close block */
+        out->compressed_bytes += h->in_len;
+        h->sym_len = h->in_len = 0;
+        return;
+    }
+
+    outbits(out, 2, 2); /* Dynamic huffman block */
+    outbits(out, hlit - 257, 5);
+    outbits(out, hdist - 1, 5);
+    outbits(out, hclen - 4, 4);
+    for (i = 0; i < (unsigned int)hclen; i++)
+        outbits(out, h->clen[blorder[i]], 3);
+    for (i = 0; i < h->rle_len; i++) {
+        int sym = h->rle_sym[i];
+        outbits(out, h->ccode[sym], h->clen[sym]);
+        if (sym >= 16)
+            outbits(out, h->rle_extra[i], blextra[sym - 16]);
+    }
+
+    for (i = 0; i < h->sym_len; i++) {
+        const uint8_t *sym = &h->sym_buf[i * 3];
+        int dist = sym[0] | (sym[1] << 8);
+        if (dist == 0) {
+            outbits(out, h->lcode[sym[2]], h->llen[sym[2]]);
+        } else {
+            int len = sym[2] + 3;
+            const len_coderecord *l = LEN_CODE(len);
+            const dist_coderecord *d = DIST_CODE(dist);
+            int lcode = l - lencodes + 257;
+            int dcode = d - distcodes;
+            /* code + extra bits: 20 bits at most for lengths, 28 for distances */
+            outbits(out, h->lcode[lcode] | ((unsigned long)(len - 3 - l->min) << h->llen[lcode]), h->llen[lcode] + l->extrabits);
+            outbits(out, h->dcode[dcode] | ((unsigned long)(dist - d->min) << h->dlen[dcode]), h->dlen[dcode] + d->extrabits);
+        }
+    }
+    outbits(out, h->lcode[HUFF_EOB], h->llen[HUFF_EOB]); /* close block */
+    out->compressed_bytes += h->in_len;
+    h->sym_len = h->in_len = 0;
+}
+
+
+static void huff_push(struct uzlib_comp *out, int distance, int lc)
+{
+    struct uzlib_huff *h = out->huff;
+    uint8_t *sym;
+    if (h->sym_len == h->sym_max)
+        huff_flush_block(out, 0); /* buffer full, emit a non final block */
+    sym = &h->sym_buf[h->sym_len * 3];
+    sym[0] = distance & 0xFF;
+    sym[1] = distance >> 8;
+    sym[2] = lc;
+    h->sym_len++;
+    h->in_len += distance ? lc + 3 : 1;
+}
+
+
+static unsigned int huff_sym_max(unsigned int bufsize)
+{
+    unsigned int sym_max = bufsize / 3;
+    if (sym_max > 0xFFFE)
+        sym_max = 0xFFFE; /* keep symbol frequencies in 16 bits */
+    return sym_max;
+}
+
+
+static void huff_setup(struct uzlib_comp *out, struct uzlib_huff *h, unsigned int sym_max, char placed)
+{
+    memset(h, 0, sizeof(struct uzlib_huff));
+    h->sym_buf = (uint8_t *)(h + 1);
+    h->sym_max = sym_max;
+    h->placed = placed;
+    out->huff = h;
+}
+
+
+int zlib_huff_init(struct uzlib_comp *out, unsigned int bufsize)
+{
+    unsigned int sym_max = huff_sym_max(bufsize);
+    struct uzlib_huff *h;
+
+    zlib_huff_free(out);
+
+    if (sym_max == 0)
+        return 0; /* static huffman blocks only */
+
+    h = (struct uzlib_huff *)malloc(sizeof(struct uzlib_huff) + sym_max * 3);
+    if (h == NULL)
+        return -1;
+    huff_setup(out, h, sym_max, FALSE);
+    return 0;
+}
+
+
+unsigned int zlib_huff_size(unsigned int bufsize)
+{
+    unsigned int sym_max = huff_sym_max(bufsize);
+    return sym_max ? sizeof(struct uzlib_huff) + sym_max * 3 : 0;
+}
+
+
+/* a non final block is emitted when the symbol buffer fills up: with chunks no larger than the output
+   span, the overflow is about a block of that many symbols (1.5 bytes each, literals are stored at worst) */
+unsigned int zlib_huff_spill_size(unsigned int bufsize)
+{
+    unsigned int spill = (huff_sym_max(bufsize) * 3 / 2 + 7) & ~7U;
+    return spill > UZLIB_STREAM_SPILL_SIZE ? spill : UZLIB_STREAM_SPILL_SIZE;
+}
+
+
+unsigned int zlib_stream_spill_size(struct uzlib_comp *out)
+{
+    return zlib_huff_spill_size(out->huff ? out->huff->sym_max * 3 : 0);
+}
+
+
+int zlib_huff_place(struct uzlib_comp *out, void *mem, unsigned int bufsize)
+{
+    unsigned int sym_max = huff_sym_max(bufsize);
+
+    zlib_huff_free(out);
+
+    if (sym_max == 0 || mem == NULL)
+        return 0; /* static huffman blocks only */
+    huff_setup(out, (struct uzlib_huff *)mem, sym_max, TRUE);
+    return 0;
+}
+
+
+void zlib_huff_free(struct uzlib_comp *out)
+{
+    if (out->huff) {
+        if (!out->huff->placed)
+            sfree(out->huff);
+        out->huff = NULL;
+    }
+}
+
+
 void zlib_literal(struct uzlib_comp *out, unsigned char c)
 {
     if (out->comp_disabled) {
@@ -240,22 +853,26 @@ void zlib_literal(struct uzlib_comp *out, unsigned char c)
         return;
     }
 
-    if (c <= 143) {
-        /* 0 through 143 are 8 bits long starting at 00110000. */
-        outbits(out, mirrorbytes[0x30 + c], 8);
+    if (out->huff) {
+        huff_push(out, 0, c);
     } else {
-        /* 144 through 255 are 9 bits long starting at 110010000. */
-        outbits(out, 1 + 2 * mirrorbytes[0x90 - 144 + c], 9);
+        fixed_literal(out, c);
+        out->compressed_bytes++;
     }
 }
 
-void zlib_match(struct uzlib_comp *out, int distance, int len)
+void zlib_match_symbols(int distance, int len, int *lsym, int *lextra, int *dsym, int *dextra)
 {
-    const dist_coderecord *d;
-    const len_coderecord *l;
-    int i, j, k;
-    int lcode;
+    const len_coderecord *l = LEN_CODE(len);
+    const dist_coderecord *d = DIST_CODE(distance);
+    *lsym = l - lencodes + 257;
+    *lextra = l->extrabits;
+    *dsym = d - distcodes;
+    *dextra = d->extrabits;
+}
 
+void zlib_match(struct uzlib_comp *out, int distance, int len)
+{
     assert(!out->comp_disabled);
 
     while (len > 0) {
@@ -274,94 +891,68 @@ void zlib_match(struct uzlib_comp *out, int distance, int len)
         thislen = (len > 260 ? 258 : len <= 258 ? len : len - 3);
         len -= thislen;
 
-        /*
-         * Binary-search to find which length code we're
-         * transmitting.
-         */
-        i = -1;
-        j = sizeof(lencodes) / sizeof(*lencodes);
-        while (1) {
-            assert(j - i >= 2);
-            k = (j + i) / 2;
-            if (thislen < FROM_LCODE(lencodes[k].min))
-                j = k;
-            else if (thislen > FROM_LCODE(lencodes[k].max))
-                i = k;
-            else {
-                l = &lencodes[k];
-                break;                 /* found it! */
-            }
-        }
-
-        lcode = l - lencodes + 257;
-
-        /*
-         * Transmit the length code. 256-279 are seven bits
-         * starting at 0000000; 280-287 are eight bits starting at
-         * 11000000.
-         */
-        if (lcode <= 279) {
-            outbits(out, mirrorbytes[(lcode - 256) * 2], 7);
+        if (out->huff) {
+            huff_push(out, distance, thislen - 3);
         } else {
-            outbits(out, mirrorbytes[0xc0 - 280 + lcode], 8);
+            fixed_match(out, distance, thislen);
+            out->compressed_bytes += thislen;
         }
-
-        /*
-         * Transmit the extra bits.
-         */
-        if (l->extrabits)
-            outbits(out, thislen - FROM_LCODE(l->min), l->extrabits);
-
-        /*
-         * Binary-search to find which distance code we're
-         * transmitting.
-         */
-        i = -1;
-        j = sizeof(distcodes) / sizeof(*distcodes);
-        while (1) {
-            assert(j - i >= 2);
-            k = (j + i) / 2;
-            if (distance < distcodes[k].min)
-                j = k;
-            else if (distance > distcodes[k].max)
-                i = k;
-            else {
-                d = &distcodes[k];
-                break;                 /* found it! */
-            }
-        }
-
-        /*
-         * Transmit the distance code. Five bits starting at 00000.
-         */
-        outbits(out, mirrorbytes[d->code * 8], 5);
-
-        /*
-         * Transmit the extra bits.
-         */
-        if (d->extrabits)
-            outbits(out, distance - d->min, d->extrabits);
     }
 }
 
 
 void zlib_next_block(struct uzlib_comp *out)
 {
+    if (out->huff) {
+        out->huff->last = 0; /* header is written when the block is flushed */
+        return;
+    }
     outbits(out, 0, 1); /* Not the final block */
     outbits(out, 1, 2); /* Static huffman block */
 }
 
 void zlib_empty_block(struct uzlib_comp *out)
 {
-    outbits(out, 0, 7); /* close block */
+    if (out->huff)
+        huff_flush_block(out, 0);
+    else
+        outbits(out, 0, 7); /* close block */
     outbits(out, 0, 3); /* header of stored block */
-    outbits(out, 0, 7); /* flush all bits */
-    out4bytes(out, 0x00, 0x00, 0xFF, 0xFF); // empty block ?
+    out4bytes(out, 0x00, 0x00, 0xFF, 0xFF); /* aligned, LEN = 0, NLEN = 0xFFFF */
+    zlib_flush_output(out);
+}
+
+
+void zlib_split_block(struct uzlib_comp *out)
+{
+    if (out->huff && out->huff->sym_len)
+        huff_flush_block(out, 0);
+}
+
+
+void zlib_partial_block(struct uzlib_comp *out, int final)
+{
+    if (out->huff)
+        huff_flush_block(out, 0);
+    else
+        outbits(out, 0, 7); /* close block */
+    outbits(out, final ? 1 : 0, 1);
+    outbits(out, 1, 2); /* empty static huffman block */
+    outbits(out, 0, 7);
+    if (final)
+        outalign(out);
+    else if (out->noutbits >= 8)
+        outaccbytes(out, out->noutbits / 8); /* up to 7 bits stay pending */
+    zlib_flush_output(out);
 }
 
 
 void zlib_start_block(struct uzlib_comp *out)
 {
+    if (out->huff) {
+        out->huff->last = 1; /* header is written when the block is flushed */
+        return;
+    }
 //    outbits(out, 0x9C78, 16);
     outbits(out, 1, 1); /* Final block */
     outbits(out, 1, 2); /* Static huffman block */
@@ -369,6 +960,10 @@ void zlib_start_block(struct uzlib_comp *out)
 
 void zlib_finish_block(struct uzlib_comp *out)
 {
-    outbits(out, 0, 7); /* close block */
-    outbits(out, 0, 7); /* Make sure all bits are flushed */
+    if (out->huff)
+        huff_flush_block(out, out->huff->last);
+    else
+        outbits(out, 0, 7); /* close block */
+    outalign(out); /* Make sure all bits are flushed */
+    zlib_flush_output(out);
 }
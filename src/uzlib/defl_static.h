@@ -35,15 +35,45 @@
   - Added byteWriter to outbits()
   - Added out4bytes(), with byteWriter support
   - Added zlib_next_block() and zlib_empty_block() for streamed input
+  - Added zlib_huff_init() and zlib_huff_free() for dynamic huffman blocks
+  - Added zlib_huff_size() and zlib_huff_place()
+  - Added zlib_huff_spill_size() and zlib_stream_spill_size()
+  - Added zlib_partial_block()
+  - Added outalign() and zlib_flush_output()
+  - Added zlib_split_block()
+  - Added zlib_match_symbols()
 
 */
 
 void outbits(struct uzlib_comp *ctx, unsigned long bits, int nbits);
 void out4bytes( struct uzlib_comp *out, unsigned char st, unsigned char nd, unsigned char rd, unsigned char th );
+void outalign(struct uzlib_comp *out);
+/* Hand the pending bytes of a fixed output span to writeDestBytes() */
+void zlib_flush_output(struct uzlib_comp *out);
 void zlib_start_block(struct uzlib_comp *ctx);
 void zlib_finish_block(struct uzlib_comp *ctx);
 void zlib_literal(struct uzlib_comp *ctx, unsigned char c);
 void zlib_match(struct uzlib_comp *ctx, int distance, int len);
+/* Length symbol (257-285) and distance code (0-29) of a match, with their extra bits, for cost models */
+void zlib_match_symbols(int distance, int len, int *lsym, int *lextra, int *dsym, int *dextra);
 
 void zlib_next_block(struct uzlib_comp *out);
 void zlib_empty_block(struct uzlib_comp *out);
+/* End the pending dynamic huffman block here (non final), no-op with static blocks */
+void zlib_split_block(struct uzlib_comp *out);
+/* Close the pending non final block with an empty static block: the final block when final is set
+   (byte aligned), otherwise a Z_PARTIAL_FLUSH point with up to 7 bits left pending for the next block */
+void zlib_partial_block(struct uzlib_comp *out, int final);
+
+/* Attach a symbol buffer of bufsize bytes (3 bytes per symbol) to enable
+   dynamic huffman blocks, returns 0 on success. bufsize = 0 detaches it. */
+int zlib_huff_init(struct uzlib_comp *out, unsigned int bufsize);
+void zlib_huff_free(struct uzlib_comp *out);
+/* Memory needed by a bufsize symbol buffer (0 = static blocks only), and the same as
+   zlib_huff_init() in that caller provided memory, zlib_huff_free() won't free it. */
+unsigned int zlib_huff_size(unsigned int bufsize);
+int zlib_huff_place(struct uzlib_comp *out, void *mem, unsigned int bufsize);
+/* Stream mode spill buffer size for a bufsize symbol buffer (at least UZLIB_STREAM_SPILL_SIZE),
+   and the one uzlib_deflate_init_stream() allocates for the symbol buffer attached to out */
+unsigned int zlib_huff_spill_size(unsigned int bufsize);
+unsigned int zlib_stream_spill_size(struct uzlib_comp *out);
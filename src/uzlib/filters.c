@@ -0,0 +1,182 @@
+/*
+ * filters  -  reversible pre-compression filters for uzlib
+ *
+ * Copyright (c) 2025-now tobozo
+ *
+ * This software is provided 'as-is', without any express
+ * or implied warranty.  In no event will the authors be
+ * held liable for any damages arising from the use of
+ * this software.
+ *
+ * Permission is granted to anyone to use this software
+ * for any purpose, including commercial applications,
+ * and to alter it and redistribute it freely, subject to
+ * the following restrictions:
+ *
+ * 1. The origin of this software must not be
+ *    misrepresented; you must not claim that you
+ *    wrote the original software. If you use this
+ *    software in a product, an acknowledgment in
+ *    the product documentation would be appreciated
+ *    but is not required.
+ *
+ * 2. Altered source versions must be plainly marked
+ *    as such, and must not be misrepresented as
+ *    being the original software.
+ *
+ * 3. This notice may not be removed or altered from
+ *    any source distribution.
+ *
+ *
+ * Delta: every byte is replaced by its difference with the byte `stride` positions before,
+ * fixed width samples become small repeating values.
+ *
+ * BCJ (branch/call/jump): relative call targets are turned into absolute ones, so calls to
+ * the same function from different places become the same bytes. The ARM Thumb filter is
+ * the one from xz, the Xtensa (CALL8) and RISC-V (JAL ra) filters follow the same idea.
+ * Detection only looks at bytes the conversion leaves untouched, so the encoder and the
+ * decoder always agree on instruction boundaries, whatever the data.
+ */
+
+#include <string.h>
+#include "uzlib.h"
+
+
+int uzlib_filter_init(struct uzlib_filter *f, int id, int param, int encode)
+{
+    memset(f, 0, sizeof(*f));
+    f->encode = encode ? 1 : 0;
+    switch (id) {
+        case UZLIB_FILTER_DELTA:
+            if (param < 0 || param >= (int)sizeof(f->history))
+                return -1;
+            f->stride = param + 1;
+            break;
+        case UZLIB_FILTER_NONE:
+        case UZLIB_FILTER_XTENSA:
+        case UZLIB_FILTER_RISCV:
+        case UZLIB_FILTER_ARM_THUMB:
+            break;
+        default:
+            return -1;
+    }
+    f->id = id;
+    return 0;
+}
+
+
+static size_t filter_delta(struct uzlib_filter *f, unsigned char *buf, size_t len)
+{
+    size_t i;
+    unsigned int idx = f->idx;
+    for (i = 0; i < len; i++) {
+        unsigned char b = f->encode ? buf[i] : (unsigned char)(buf[i] + f->history[idx]);
+        if (f->encode)
+            buf[i] = b - f->history[idx];
+        else
+            buf[i] = b;
+        f->history[idx] = b;
+        if (++idx == f->stride)
+            idx = 0;
+    }
+    f->idx = idx;
+    return len;
+}
+
+
+// CALL8: op0 = 0101, n = 10, offset:18, target = (pc & ~3) + (offset << 2) + 4. Only near calls (+/-128KB, the top
+// 3 offset bits are the same) are converted, modulo 2^16 words so the result passes the same test: far hits are mostly
+// addresses in literal pools (e.g. 0x400d25xx) and converting them costs more than it saves. The offset test reads two
+// bytes a conversion at i+1 or i+2 would change, so these can't start a call after a rejected candidate at i
+static size_t filter_xtensa(struct uzlib_filter *f, unsigned char *buf, size_t len)
+{
+    size_t i = 0;
+    unsigned int blocked = f->blocked;
+    while (i + 3 <= len) {
+        if ((buf[i] & 0x3f) == 0x25 && blocked == 0) {
+            uint32_t w = buf[i] | ((uint32_t)buf[i+1] << 8) | ((uint32_t)buf[i+2] << 16);
+            uint32_t v = w >> 6;
+            if (((v + 0x8000) & 0x3ffff) < 0x10000) {
+                uint32_t pc = (f->pos + i) >> 2;
+                v = (f->encode ? v + pc : v - pc) & 0xffff;
+                if (v & 0x8000)
+                    v |= 0x30000;
+                w = (w & 0x3f) | (v << 6);
+                buf[i]   = w;
+                buf[i+1] = w >> 8;
+                buf[i+2] = w >> 16;
+                i += 3;
+                continue;
+            }
+            blocked = 3;
+        }
+        if (blocked > 0)
+            blocked--;
+        i++;
+    }
+    f->blocked = blocked;
+    return i;
+}
+
+
+// JAL with rd = ra (x1): opcode 1101111, imm[20|10:1|11|19:12] in bits 31..12, 2 bytes aligned (C extension)
+static size_t filter_riscv(struct uzlib_filter *f, unsigned char *buf, size_t len)
+{
+    size_t i = 0;
+    while (i + 4 <= len) {
+        if (buf[i] == 0xef && (buf[i+1] & 0x0f) == 0) {
+            uint32_t w = buf[i] | ((uint32_t)buf[i+1] << 8) | ((uint32_t)buf[i+2] << 16) | ((uint32_t)buf[i+3] << 24);
+            uint32_t imm = ((w >> 11) & 0x100000) | ((w >> 20) & 0x7fe) | ((w >> 9) & 0x800) | (w & 0xff000);
+            uint32_t pc = f->pos + i;
+            imm = (f->encode ? imm + pc : imm - pc) & 0x1fffff;
+            w = (w & 0xfff) | ((imm & 0x100000) << 11) | ((imm & 0x7fe) << 20) | ((imm & 0x800) << 9) | (imm & 0xff000);
+            buf[i]   = w;
+            buf[i+1] = w >> 8;
+            buf[i+2] = w >> 16;
+            buf[i+3] = w >> 24;
+            i += 4;
+        } else {
+            i += 2;
+        }
+    }
+    return i;
+}
+
+
+// BL: two halfwords 11110:offset_hi and 11111:offset_lo, target = pc + 4 + (offset << 1)
+static size_t filter_arm_thumb(struct uzlib_filter *f, unsigned char *buf, size_t len)
+{
+    size_t i = 0;
+    while (i + 4 <= len) {
+        if ((buf[i+1] & 0xf8) == 0xf0 && (buf[i+3] & 0xf8) == 0xf8) {
+            uint32_t v = ((uint32_t)(buf[i+1] & 7) << 19) | ((uint32_t)buf[i] << 11) | ((uint32_t)(buf[i+3] & 7) << 8) | buf[i+2];
+            uint32_t pc = (f->pos + i + 4) >> 1;
+            v = f->encode ? v + pc : v - pc;
+            buf[i+1] = 0xf0 | ((v >> 19) & 7);
+            buf[i]   = v >> 11;
+            buf[i+3] = 0xf8 | ((v >> 8) & 7);
+            buf[i+2] = v;
+            i += 4;
+        } else {
+            i += 2;
+        }
+    }
+    return i;
+}
+
+
+size_t uzlib_filter(struct uzlib_filter *f, unsigned char *buf, size_t len, int final)
+{
+    size_t done;
+    switch (f->id) {
+        case UZLIB_FILTER_DELTA:     done = filter_delta(f, buf, len); break;
+        case UZLIB_FILTER_XTENSA:    done = filter_xtensa(f, buf, len); break;
+        case UZLIB_FILTER_RISCV:     done = filter_riscv(f, buf, len); break;
+        case UZLIB_FILTER_ARM_THUMB: done = filter_arm_thumb(f, buf, len); break;
+        default:                     done = len; break;
+    }
+    if (final) // the last bytes can't hold an instruction: they're left as is
+        done = len;
+    f->pos += done;
+    return done;
+}
@@ -32,10 +32,23 @@
  *  - Added uzlib_checksum_none()
  *  - Added uzlib_deflate_init_stream()
  *  - Added uzlib_deflate_stream()
+ *  - Added sliding window to uzlib_deflate_stream()
+ *  - Added hash chains, lazy matching and uzlib_deflate_level()
+ *  - Added word-at-a-time match comparison
+ *  - uzlib_deflate_stream() writes to the caller's buffer, overflow goes to a persistent spill buffer
+ *  - Added uzlib_compress_dict()
+ *  - Added adaptive mode: incompressible input is stored without searching for matches
+ *  - Added uzlib_compress_dict_save() and uzlib_compress_dict_restore() for preset dictionaries
+ *  - Added Z_NO_FLUSH, Z_PARTIAL_FLUSH and Z_SYNC_FLUSH modes to uzlib_deflate_stream()
+ *  - Windowless uzlib_deflate_stream() chunks are compressed in place, matches stay inside the chunk
+ *  - Added optimal parsing (level 10)
+ *  - Added Z_RLE and Z_HUFFMAN_ONLY strategies
  *
  */
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "uzlib.h"
 
 #pragma GCC diagnostic push
@@ -77,40 +90,640 @@ static inline void copy(void *data, unsigned offset, unsigned len)
 // used only when uzlib_compress is in buffer mode (when in stream mode, progress_cb is managed from outside)
 #define UZLIB_PROGRESS(b,t) if( data->is_stream == 0 && data->progress_cb ) data->progress_cb(b, t);
 
-void uzlib_compress(struct uzlib_comp *data, const uint8_t *src, unsigned slen)
+/* Matches of MIN_MATCH bytes are discarded in lazy mode when further away than this */
+#define TOO_FAR 4096
+
+/* zlib's configuration table, level 0 stores the input */
+static const struct {
+    unsigned short good_length, max_lazy, nice_length, max_chain;
+    char lazy;
+} uzlib_levels[11] = {
+    /* 0 */ {  0,   0,   0,    0, 0 }, /* store only */
+    /* 1 */ {  4,   4,   8,    4, 0 }, /* greedy, max_lazy is the max insert length */
+    /* 2 */ {  4,   5,  16,    8, 0 },
+    /* 3 */ {  4,   6,  32,   32, 0 },
+    /* 4 */ {  4,   4,  16,   16, 1 }, /* lazy matching */
+    /* 5 */ {  8,  16,  32,   32, 1 },
+    /* 6 */ {  8,  16, 128,  128, 1 },
+    /* 7 */ {  8,  32, 128,  256, 1 },
+    /* 8 */ { 32, 128, 258, 1024, 1 },
+    /* 9 */ { 32, 258, 258, 4096, 1 },
+    /* 10 */ { 258, 258, 258, 8192, 1 }, /* optimal parsing, see deflate_optimal() */
+};
+
+
+// Apply zlib-like compression level settings (0-9, 10 = optimal parsing), returns the level or -1 when out of range
+int uzlib_deflate_level(struct uzlib_comp *c, int level)
 {
-    UZLIB_PROGRESS(0,slen);
+    if (level < 0 || level > 10)
+        return -1;
+    c->good_length = uzlib_levels[level].good_length;
+    c->max_lazy    = uzlib_levels[level].max_lazy;
+    c->nice_length = uzlib_levels[level].nice_length;
+    c->max_chain   = uzlib_levels[level].max_chain;
+    c->lazy        = uzlib_levels[level].lazy;
+    c->store_only  = level == 0;
+    c->optimal     = level == 10 ? 15 : 0; // passes
+    return level;
+}
+
 
-    const uint8_t *top = src + slen - MIN_MATCH;
-    while (src < top) {
-        UZLIB_PROGRESS( slen-(top-src), slen);
-        int h = HASH(data, src);
-        const uint8_t **bucket = &data->hash_table[h & (HASH_SIZE - 1)];
-        const uint8_t *subs = *bucket;
-        *bucket = src;
-        if (subs && src > subs && (src - subs) <= MAX_OFFSET && !memcmp(src, subs, MIN_MATCH)) {
-            src += MIN_MATCH;
-            const uint8_t *m = subs + MIN_MATCH;
-            int len = MIN_MATCH;
-            while (*src == *m && len < MAX_MATCH && src < top) {
-                src++; m++; len++;
+// Word-at-a-time match comparison on little endian targets (ESP32, ESP8266, RP2040 and most hosts)
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define UZLIB_WORD_MATCH 1
+#else
+#define UZLIB_WORD_MATCH 0
+#endif
+
+#if UZLIB_WORD_MATCH
+// unaligned-safe loads, memcpy() compiles to a single load where the target allows it
+static inline uint32_t load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned long loadword(const uint8_t *p)
+{
+    unsigned long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+#endif
+
+// MIN_MATCH bytes prefix check, avail is the number of readable bytes at a (b is before a)
+static inline int prefix_match(const uint8_t *a, const uint8_t *b, unsigned int avail)
+{
+#if UZLIB_WORD_MATCH
+    if (avail >= sizeof(uint32_t))
+        return ((load32(a) ^ load32(b)) & 0x00FFFFFF) == 0;
+#endif
+    (void)avail;
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+// Extend a match from len up to max_len, one word per iteration while a whole word fits
+static inline unsigned int match_length(const uint8_t *a, const uint8_t *b, unsigned int len, unsigned int max_len)
+{
+#if UZLIB_WORD_MATCH
+    while (len + sizeof(unsigned long) <= max_len) {
+        unsigned long x = loadword(a + len) ^ loadword(b + len);
+        if (x)
+            return len + (__builtin_ctzl(x) >> 3); // index of the first mismatching byte
+        len += sizeof(unsigned long);
+    }
+#endif
+    while (len < max_len && a[len] == b[len])
+        len++;
+    return len;
+}
+
+
+// Insert p in its hash bucket and chain, returns the previous bucket head
+static inline const uint8_t *insert_string(struct uzlib_comp *data, const uint8_t *p)
+{
+    const uint8_t **bucket = &data->hash_table[HASH(data, p)];
+    const uint8_t *head = *bucket;
+    *bucket = p;
+    if (data->hash_prev) {
+        size_t dist = head && head < p ? p - head : 0;
+        data->hash_prev[(uintptr_t)p & ((1U << data->prev_bits) - 1)] = dist <= 0xFFFF ? dist : 0;
+    }
+    return head;
+}
+
+
+// Walk the hash chain starting at cand, returns the longest match length found
+// above best_len (or best_len) and sets *match accordingly
+static unsigned int longest_match(struct uzlib_comp *data, const uint8_t *src, const uint8_t *end,
+                                  const uint8_t *cand, unsigned int best_len, const uint8_t **match)
+{
+    unsigned int chain = data->max_chain ? data->max_chain : 1;
+    unsigned int nice = data->nice_length ? data->nice_length : MAX_MATCH;
+    unsigned int max_len = end - src < MAX_MATCH ? end - src : MAX_MATCH;
+    size_t chain_reach = data->hash_prev ? (size_t)1 << data->prev_bits : 0;
+
+    if (data->good_length && best_len >= data->good_length)
+        chain >>= 2;
+    if (nice > max_len)
+        nice = max_len;
+    if (best_len >= max_len)
+        return best_len; // nothing longer fits, and src[best_len] would be out of bounds
+
+    while (cand && cand < src && cand >= data->match_floor) {
+        size_t dist = src - cand;
+        if (dist > MAX_OFFSET)
+            break;
+        // cheap rejection: the byte that would make this match longer must match first
+        if (cand[best_len] == src[best_len] && prefix_match(src, cand, max_len)) {
+            unsigned int len = match_length(src, cand, MIN_MATCH, max_len);
+            if (len > best_len) {
+                best_len = len;
+                *match = cand;
+                if (len >= nice)
+                    break;
+            }
+        }
+        // a chain slot is only trusted while it can't have been reused by a more recent position
+        if (--chain == 0 || dist >= chain_reach)
+            break;
+        unsigned int prev = data->hash_prev[(uintptr_t)cand & (chain_reach - 1)];
+        if (prev == 0)
+            break;
+        cand -= prev;
+    }
+    return best_len;
+}
+
+
+// Greedy matching from src up to stop (matches can extend up to end), returns where it stopped
+static const uint8_t *deflate_greedy(struct uzlib_comp *data, const uint8_t *src, const uint8_t *stop,
+                                     const uint8_t *end, const uint8_t *start, unsigned *matched)
+{
+    unsigned slen = end - start;
+    // last position that still has MIN_MATCH bytes to hash
+    const uint8_t *top = end - start >= MIN_MATCH ? end - MIN_MATCH : start - 1;
+
+    while (src < stop) {
+        UZLIB_PROGRESS( src-start, slen);
+        const uint8_t *m = NULL;
+        unsigned int len = 0;
+        if (src <= top) {
+            const uint8_t *head = insert_string(data, src);
+            if (head)
+                len = longest_match(data, src, end, head, MIN_MATCH - 1, &m);
+        }
+        if (len >= MIN_MATCH) {
+            copy(data, src - m, len);
+            *matched += len;
+            if (len <= data->max_lazy) {
+                // short match: index the positions it covers too
+                const uint8_t *p = src + 1;
+                src += len;
+                for (; p < src && p <= top; p++)
+                    insert_string(data, p);
+            } else {
+                src += len;
             }
-            copy(data, src - len - subs, len);
         } else {
             literal(data, *src++);
         }
     }
-    // Process buffer tail, which is less than MIN_MATCH
-    // (and so it doesn't make sense to look for matches there)
-    top += MIN_MATCH;
-    while (src < top) {
+    return src;
+}
+
+
+// Lazy matching from src up to stop: a match at src is only emitted if src+1 doesn't have a longer one
+static const uint8_t *deflate_lazy(struct uzlib_comp *data, const uint8_t *src, const uint8_t *stop,
+                                   const uint8_t *end, const uint8_t *start, unsigned *matched)
+{
+    unsigned slen = end - start;
+    const uint8_t *top = end - start >= MIN_MATCH ? end - MIN_MATCH : start - 1;
+    unsigned int prev_len = MIN_MATCH - 1;
+    const uint8_t *prev_match = NULL;
+    int match_available = 0;
+
+    while (src < stop) {
+        UZLIB_PROGRESS( src-start, slen);
+        unsigned int len = MIN_MATCH - 1;
+        const uint8_t *m = NULL;
+        if (src <= top) {
+            const uint8_t *head = insert_string(data, src);
+            if (head && prev_len < data->max_lazy) {
+                len = longest_match(data, src, end, head, prev_len, &m);
+                if (m == NULL || len <= prev_len)
+                    len = MIN_MATCH - 1;
+                else if (len == MIN_MATCH && src - m > TOO_FAR)
+                    len = MIN_MATCH - 1;
+            }
+        }
+        if (prev_len >= MIN_MATCH && len <= prev_len) {
+            // the previous match is better: emit it and index the positions it covers
+            const uint8_t *mstart = src - 1;
+            copy(data, mstart - prev_match, prev_len);
+            *matched += prev_len;
+            const uint8_t *mend = mstart + prev_len;
+            for (src++; src < mend; src++) {
+                if (src <= top)
+                    insert_string(data, src);
+            }
+            match_available = 0;
+            prev_len = MIN_MATCH - 1;
+        } else {
+            if (match_available)
+                literal(data, src[-1]);
+            match_available = 1;
+            prev_len = len;
+            prev_match = m;
+            src++;
+        }
+    }
+    if (match_available) {
+        if (prev_len >= MIN_MATCH) {
+            // stopped with a pending match (stop < end): emit it, it can run past stop
+            const uint8_t *mstart = src - 1;
+            copy(data, mstart - prev_match, prev_len);
+            *matched += prev_len;
+            const uint8_t *mend = mstart + prev_len;
+            for (; src < mend; src++) {
+                if (src <= top)
+                    insert_string(data, src);
+            }
+        } else {
+            literal(data, src[-1]);
+        }
+    }
+    return src;
+}
+
+
+// Optimal parsing (level 10): every position gets the closest match for increasingly long lengths, then
+// a shortest path over symbol costs in bits picks literals and matches. Costs come from the statistics
+// of the previous pass (Zopfli style), the cheapest of data->optimal passes is emitted.
+#define OPTIMAL_MATCHES 8
+#define OPTIMAL_LCODES  286 /* literal/length alphabet */
+#define OPTIMAL_DCODES  30  /* distance alphabet */
+
+struct optimal_state {
+    uint16_t *mlen, *mdist;         // OPTIMAL_MATCHES candidates per position, by increasing length
+    uint8_t *mcount;
+    float *cost;                    // cost of the cheapest path to each position
+    uint16_t *step_len, *step_dist; // last step of that path: literal (1, 0) or match
+    uint16_t *best_len, *best_dist; // steps of the cheapest pass so far
+    float lcost[OPTIMAL_LCODES], dcost[OPTIMAL_DCODES];
+    uint32_t lfreq[OPTIMAL_LCODES], dfreq[OPTIMAL_DCODES];
+};
+
+
+// Collect matches at src, each one longer than the previous (and further away), returns their count
+static unsigned int optimal_matches(struct uzlib_comp *data, const uint8_t *src, const uint8_t *end,
+                                    const uint8_t *cand, uint16_t *lens, uint16_t *dists)
+{
+    unsigned int chain = data->max_chain;
+    unsigned int max_len = end - src < MAX_MATCH ? end - src : MAX_MATCH;
+    size_t chain_reach = data->hash_prev ? (size_t)1 << data->prev_bits : 0;
+    unsigned int best_len = MIN_MATCH - 1, n = 0;
+
+    if (max_len < MIN_MATCH)
+        return 0;
+    while (cand && cand < src && cand >= data->match_floor) {
+        size_t dist = src - cand;
+        if (dist > MAX_OFFSET)
+            break;
+        if (cand[best_len] == src[best_len] && prefix_match(src, cand, max_len)) {
+            unsigned int len = match_length(src, cand, MIN_MATCH, max_len);
+            if (len > best_len) {
+                if (n == OPTIMAL_MATCHES)
+                    n--; // the longest one replaces the last one
+                lens[n] = len;
+                dists[n] = dist;
+                n++;
+                best_len = len;
+                if (len == max_len)
+                    break;
+            }
+        }
+        if (--chain == 0 || dist >= chain_reach)
+            break;
+        unsigned int prev = data->hash_prev[(uintptr_t)cand & (chain_reach - 1)];
+        if (prev == 0)
+            break;
+        cand -= prev;
+    }
+    return n;
+}
+
+
+// Symbol costs in bits from their frequencies, an unused symbol costs a bit more than a single use
+static void optimal_model(const uint32_t *freq, int n, float *cost)
+{
+    uint32_t total = 0;
+    int i;
+    for (i = 0; i < n; i++)
+        total += freq[i];
+    float bits = total ? log2f((float)total) : 0;
+    for (i = 0; i < n; i++)
+        cost[i] = freq[i] ? bits - log2f((float)freq[i]) : bits + 1;
+}
+
+
+// Cheapest path through n positions of src with the current costs
+static void optimal_pass(struct optimal_state *st, const uint8_t *src, unsigned int n)
+{
+    float lencost[MAX_MATCH + 1];
+    unsigned int i, len, k;
+    int lsym, lextra, dsym, dextra;
+
+    for (len = MIN_MATCH; len <= MAX_MATCH; len++) {
+        zlib_match_symbols(1, len, &lsym, &lextra, &dsym, &dextra);
+        lencost[len] = st->lcost[lsym] + lextra;
+    }
+    st->cost[0] = 0;
+    for (i = 1; i <= n; i++)
+        st->cost[i] = 1e30f;
+
+    for (i = 0; i < n; i++) {
+        float base = st->cost[i];
+        float c = base + st->lcost[src[i]];
+        if (c < st->cost[i + 1]) {
+            st->cost[i + 1] = c;
+            st->step_len[i + 1] = 1;
+            st->step_dist[i + 1] = 0;
+        }
+        len = MIN_MATCH;
+        for (k = 0; k < st->mcount[i]; k++) {
+            unsigned int dist = st->mdist[i * OPTIMAL_MATCHES + k];
+            unsigned int max = st->mlen[i * OPTIMAL_MATCHES + k];
+            zlib_match_symbols(dist, MIN_MATCH, &lsym, &lextra, &dsym, &dextra);
+            float dc = base + st->dcost[dsym] + dextra;
+            for (; len <= max; len++) {
+                c = dc + lencost[len];
+                if (c < st->cost[i + len]) {
+                    st->cost[i + len] = c;
+                    st->step_len[i + len] = len;
+                    st->step_dist[i + len] = dist;
+                }
+            }
+        }
+    }
+}
+
+
+// Statistics of the path found by optimal_pass(), they become the costs of the next pass.
+// Returns the size of the path in bits with these costs
+static float optimal_stats(struct optimal_state *st, const uint8_t *src, unsigned int n)
+{
+    float bits = 0;
+    unsigned int i;
+    int lsym, lextra, dsym, dextra;
+
+    memset(st->lfreq, 0, sizeof(st->lfreq));
+    memset(st->dfreq, 0, sizeof(st->dfreq));
+    st->lfreq[256] = 1; // end of block
+    for (i = n; i > 0; i -= st->step_len[i]) {
+        if (st->step_dist[i] == 0) {
+            st->lfreq[src[i - 1]]++;
+        } else {
+            zlib_match_symbols(st->step_dist[i], st->step_len[i], &lsym, &lextra, &dsym, &dextra);
+            st->lfreq[lsym]++;
+            st->dfreq[dsym]++;
+            bits += lextra + dextra;
+        }
+    }
+    optimal_model(st->lfreq, OPTIMAL_LCODES, st->lcost);
+    optimal_model(st->dfreq, OPTIMAL_DCODES, st->dcost);
+    for (i = 0; i < OPTIMAL_LCODES; i++)
+        bits += st->lfreq[i] * st->lcost[i];
+    for (i = 0; i < OPTIMAL_DCODES; i++)
+        bits += st->dfreq[i] * st->dcost[i];
+    return bits;
+}
+
+
+unsigned int uzlib_optimal_size(unsigned int slen)
+{
+    unsigned int seg = slen < UZLIB_OPTIMAL_SEGMENT ? slen : UZLIB_OPTIMAL_SEGMENT;
+    return sizeof(struct optimal_state) + seg * (OPTIMAL_MATCHES * 4 + 1) + (seg + 1) * 12;
+}
+
+
+static void deflate_optimal(struct uzlib_comp *data, const uint8_t *src, const uint8_t *end, const uint8_t *start)
+{
+    unsigned int seg = end - src < UZLIB_OPTIMAL_SEGMENT ? end - src : UZLIB_OPTIMAL_SEGMENT;
+    const uint8_t *top = end - start >= MIN_MATCH ? end - MIN_MATCH : start - 1;
+    struct optimal_state *st = malloc(uzlib_optimal_size(seg));
+    unsigned int i, k, pass;
+
+    if (st == NULL) {
+        // not enough memory: level 9
+        unsigned matched = 0;
+        deflate_lazy(data, src, end, end, start, &matched);
+        return;
+    }
+    st->cost      = (float *)(st + 1);
+    st->step_len  = (uint16_t *)(st->cost + seg + 1);
+    st->step_dist = st->step_len + seg + 1;
+    st->best_len  = st->step_dist + seg + 1;
+    st->best_dist = st->best_len + seg + 1;
+    st->mlen      = st->best_dist + seg + 1;
+    st->mdist     = st->mlen + seg * OPTIMAL_MATCHES;
+    st->mcount    = (uint8_t *)(st->mdist + seg * OPTIMAL_MATCHES);
+
+    while (src < end) {
+        unsigned int n = end - src < seg ? end - src : seg;
+        float best = 1e30f, prev = 0;
+        UZLIB_PROGRESS( src-start, end-start);
+
+        // every position is indexed, matches stop at the segment end
+        for (i = 0; i < n; i++) {
+            const uint8_t *head = src + i <= top ? insert_string(data, src + i) : NULL;
+            st->mcount[i] = head ? optimal_matches(data, src + i, src + n, head, &st->mlen[i * OPTIMAL_MATCHES], &st->mdist[i * OPTIMAL_MATCHES]) : 0;
+        }
+
+        // first pass with static huffman costs
+        for (i = 0; i < OPTIMAL_LCODES; i++)
+            st->lcost[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+        for (i = 0; i < OPTIMAL_DCODES; i++)
+            st->dcost[i] = 5;
+        for (pass = 0; pass < data->optimal; pass++) {
+            optimal_pass(st, src, n);
+            float bits = optimal_stats(st, src, n);
+            if (bits < best) {
+                best = bits;
+                memcpy(st->best_len, st->step_len, (n + 1) * sizeof(uint16_t));
+                memcpy(st->best_dist, st->step_dist, (n + 1) * sizeof(uint16_t));
+            }
+            if (pass > 0 && bits == prev)
+                break; // the costs don't change anymore
+            prev = bits;
+        }
+
+        // the cheapest path is walked backwards, emit it forwards
+        for (k = 0, i = n; i > 0; i -= st->best_len[i], k++) {
+            st->step_len[k] = st->best_len[i];
+            st->step_dist[k] = st->best_dist[i];
+        }
+        while (k-- > 0) {
+            if (st->step_dist[k] == 0)
+                literal(data, *src);
+            else
+                copy(data, st->step_dist[k], st->step_len[k]);
+            src += st->step_len[k];
+        }
+    }
+    free(st);
+}
+
+
+// Z_RLE: runs of the previous byte become distance 1 matches, Z_HUFFMAN_ONLY: literals only.
+// Nothing is searched so there's no hash table, the block writer picks the cheapest coding
+static void deflate_rle(struct uzlib_comp *data, const uint8_t *src, const uint8_t *end, const uint8_t *start)
+{
+    while (src < end) {
+        if (data->strategy == Z_RLE && src > start && src[0] == src[-1]) {
+            unsigned int max = end - src < MAX_MATCH ? end - src : MAX_MATCH;
+            unsigned int len = 1;
+            while (len < max && src[len] == src[-1])
+                len++;
+            if (len >= MIN_MATCH) {
+                copy(data, 1, len);
+                src += len;
+                continue;
+            }
+        }
         literal(data, *src++);
     }
+}
+
+
+void uzlib_compress(struct uzlib_comp *data, const uint8_t *src, unsigned slen)
+{
+    UZLIB_PROGRESS(0,slen);
+
+    const uint8_t *start = src;
+    const uint8_t *end = src + slen;
+    unsigned matched = 0;
+
+    if (data->store_only) {
+        // level 0: no matching, literals are turned into stored blocks by the block writer
+        while (src < end)
+            literal(data, *src++);
+        UZLIB_PROGRESS( slen, slen);
+        return;
+    }
+
+    if (data->strategy == Z_RLE || data->strategy == Z_HUFFMAN_ONLY) {
+        deflate_rle(data, src, end, start);
+        UZLIB_PROGRESS( slen, slen);
+        return;
+    }
+
+    if (data->optimal) {
+        deflate_optimal(data, src, end, start);
+        UZLIB_PROGRESS( slen, slen);
+        return;
+    }
+
+    if (!data->adaptive || !data->huff) {
+        if (data->lazy)
+            deflate_lazy(data, src, end, end, start, &matched);
+        else
+            deflate_greedy(data, src, end, end, start, &matched);
+        UZLIB_PROGRESS( slen, slen);
+        return;
+    }
+
+    // adaptive: input is sampled in segments, a segment with few matches is incompressible (compressed
+    // or encrypted data), the next ones are passed as literals without searching, so the block writer
+    // can store them. Segments skipped in a row double up to UZLIB_ADAPTIVE_MAX_SKIP before sampling
+    // again, skipped segments are probed every 16 bytes to resume early when the data changes.
+    const uint8_t *top = slen >= MIN_MATCH ? end - MIN_MATCH : src - 1;
+    while (src < end) {
+        const uint8_t *stop = end - src > UZLIB_ADAPTIVE_SEGMENT ? src + UZLIB_ADAPTIVE_SEGMENT : end;
+        if (data->skip_count) {
+            UZLIB_PROGRESS( src-start, slen);
+            unsigned probes = 0, hits = 0;
+            for (const uint8_t *p = src; p < stop && p <= top; p += 16) {
+                const uint8_t *head = insert_string(data, p);
+                probes++;
+                if (head && head < p && head >= data->match_floor && p - head <= MAX_OFFSET && prefix_match(p, head, end - p))
+                    hits++;
+            }
+            while (src < stop)
+                literal(data, *src++);
+            data->skip_count--;
+            if (hits * 16 > probes)
+                data->skip_count = data->skip_run = 0; // looks compressible again
+            if (data->skip_count == 0)
+                zlib_split_block(data); // don't mix stored literals with the next sample
+            continue;
+        }
+        const uint8_t *from = src;
+        matched = 0;
+        if (data->lazy)
+            src = deflate_lazy(data, src, stop, end, start, &matched);
+        else
+            src = deflate_greedy(data, src, stop, end, start, &matched);
+        if (src - from < UZLIB_ADAPTIVE_SEGMENT / 4)
+            continue; // too short to tell
+        if (matched * 32 < (unsigned)(src - from)) {
+            // less than 3% of the sample was matched
+            if (data->skip_run < UZLIB_ADAPTIVE_MAX_SKIP)
+                data->skip_run = data->skip_run ? data->skip_run * 2 : 1;
+            data->skip_count = data->skip_run;
+            zlib_split_block(data); // the stored literals get their own block
+        } else {
+            data->skip_run = 0;
+        }
+    }
     UZLIB_PROGRESS( slen, slen);
 }
 
 
 
+// Index dict without emitting anything, so uzlib_compress() can reference it. dict must stay
+// readable and be followed by the data compressed next (e.g. the previous block of the same buffer)
+void uzlib_compress_dict(struct uzlib_comp *data, const uint8_t *dict, unsigned dlen)
+{
+    const uint8_t *p;
+    if (data->hash_table == NULL) // Z_RLE and Z_HUFFMAN_ONLY don't reference previous data
+        return;
+    if (dlen > MAX_OFFSET) {
+        dict += dlen - MAX_OFFSET;
+        dlen = MAX_OFFSET;
+    }
+    for (p = dict; p + MIN_MATCH <= dict + dlen; p++)
+        insert_string(data, p);
+}
+
+
+// Preset dictionary reused across messages: index dict into empty tables and save the hash heads
+// (1 << hash_bits entries, offset in dict + 1, dlen <= 65535) so uzlib_compress_dict_restore() can
+// bring them back before each message. With hash chains, chains gets the chain slots of the last
+// min(dlen, 1 << prev_bits) bytes of dict. The message must be compressed right after dict in the same buffer
+void uzlib_compress_dict_save(struct uzlib_comp *data, const uint8_t *dict, unsigned dlen, uint16_t *heads, uint16_t *chains)
+{
+    unsigned int i;
+    if (data->hash_table == NULL) // Z_RLE and Z_HUFFMAN_ONLY don't reference previous data
+        return;
+    memset(data->hash_table, 0, sizeof(uzlib_hash_entry_t) * HASH_SIZE);
+    if (data->hash_prev)
+        memset(data->hash_prev, 0, sizeof(uint16_t) << data->prev_bits);
+    uzlib_compress_dict(data, dict, dlen);
+    for (i = 0; i < HASH_SIZE; i++)
+        heads[i] = data->hash_table[i] ? data->hash_table[i] - dict + 1 : 0;
+    if (data->hash_prev && chains) {
+        unsigned int mask = (1U << data->prev_bits) - 1;
+        unsigned int n = dlen < mask + 1 ? dlen : mask + 1;
+        for (i = 0; i < n; i++)
+            chains[i] = data->hash_prev[(uintptr_t)(dict + dlen - n + i) & mask];
+    }
+}
+
+
+// Forget the previous message (mlen bytes): back to the state saved by uzlib_compress_dict_save().
+// Message byte k shares its chain slot with dict byte dlen + k - (1 << prev_bits), only these are put back
+void uzlib_compress_dict_restore(struct uzlib_comp *data, const uint8_t *dict, unsigned dlen, const uint16_t *heads, const uint16_t *chains, unsigned mlen)
+{
+    unsigned int i;
+    for (i = 0; data->hash_table && i < HASH_SIZE; i++)
+        data->hash_table[i] = heads[i] ? dict + heads[i] - 1 : NULL;
+    if (data->hash_table && data->hash_prev && chains) {
+        unsigned int mask = (1U << data->prev_bits) - 1;
+        unsigned int n = dlen < mask + 1 ? dlen : mask + 1;
+        if (mlen > mask + 1)
+            mlen = mask + 1;
+        for (i = mask + 1 - n; i < mlen; i++) { // chains[i + n - size] is dict byte dlen + i - size
+            unsigned int k = i + n - (mask + 1);
+            data->hash_prev[(uintptr_t)(dict + dlen - n + k) & mask] = chains[k];
+        }
+    }
+    data->skip_run = data->skip_count = 0;
+}
+
+
+
 uint32_t uzlib_checksum_none(__attribute__((unused)) const void *data, __attribute__((unused)) unsigned int length, uint32_t prev_sum)
 {
   return prev_sum;
@@ -118,14 +731,89 @@ uint32_t uzlib_checksum_none(__attribute__((unused)) const void *data, __attribu
 
 
 
+// Slide the window: keep the most recent history bytes and rebase hash table pointers
+static void uzlib_slide_window(struct uzlib_comp* ctx, unsigned int keep)
+{
+    unsigned int shift = ctx->window_len - keep;
+    const uint8_t *base = ctx->window + shift;
+    unsigned int i;
+
+    memmove(ctx->window, base, keep);
+    ctx->window_len = keep;
+
+    for (i = 0; ctx->hash_table && i < (1U << ctx->hash_bits); i++) {
+        const uint8_t *p = ctx->hash_table[i];
+        ctx->hash_table[i] = (p && p >= base) ? p - shift : NULL;
+    }
+    // chain slots are indexed by address: they stay valid when the shift is a multiple of the table size
+    if (ctx->hash_prev && (shift & ((1U << ctx->prev_bits) - 1)) != 0)
+        memset(ctx->hash_prev, 0, sizeof(uint16_t) << ctx->prev_bits);
+}
+
+
+// Compress a chunk, matches can reach back into previous chunks when a window is attached
+static void uzlib_compress_window(struct uzlib_comp* ctx, const uint8_t *src, unsigned int slen)
+{
+    if (ctx->window == NULL) {
+        // compressed in place: the hash table may still point into previous chunks, which can be gone
+        ctx->match_floor = src;
+        uzlib_compress(ctx, src, slen);
+        return;
+    }
+
+    // history kept when sliding: dict_size, or half the window if it's too small to hold more
+    unsigned int keep = ctx->dict_size < ctx->window_size ? ctx->dict_size : ctx->window_size / 2;
+    if (ctx->hash_prev) {
+        // slide by a multiple of the chain table size so the chains survive, unless it costs over half the history
+        unsigned int mask = (1U << ctx->prev_bits) - 1;
+        unsigned int shift = (ctx->window_size - keep + mask) & ~mask;
+        if (shift < ctx->window_size && ctx->window_size - shift >= keep / 2)
+            keep = ctx->window_size - shift;
+    }
+    ctx->match_floor = ctx->window; // chains can lead below the window once it has slid
+
+    while (slen > 0) {
+        if (ctx->window_len == ctx->window_size)
+            uzlib_slide_window(ctx, keep);
+        unsigned int len = ctx->window_size - ctx->window_len;
+        if (len > slen)
+            len = slen;
+        uint8_t *dst = ctx->window + ctx->window_len;
+        memcpy(dst, src, len);
+        ctx->window_len += len;
+        uzlib_compress(ctx, dst, len);
+        src  += len;
+        slen -= len;
+    }
+}
+
+
+
 int uzlib_deflate_init_stream(struct uzlib_comp* ctx, uzlib_stream* uzstream){
     if (uzstream == Z_NULL)
         return Z_STREAM_ERROR;
     if (ctx == Z_NULL)
         return Z_MEM_ERROR;
-    if( ctx->hash_table == NULL )
+    if( ctx->hash_table == NULL && ctx->strategy != Z_RLE && ctx->strategy != Z_HUFFMAN_ONLY )
         return Z_MEM_ERROR;
     ctx->comp_disabled = 0;
+    ctx->window_len = 0;
+    ctx->outbits = ctx->noutbits = 0;
+    ctx->block_open = 0;
+
+    // allocated once and sized for the symbol buffer, the compression loop doesn't allocate
+    if (ctx->spill == NULL) {
+        if (ctx->spill_size == 0)
+            ctx->spill_size = zlib_stream_spill_size(ctx);
+        ctx->spill = malloc(ctx->spill_size);
+        if (ctx->spill == NULL)
+            return Z_MEM_ERROR;
+        ctx->spill_owned = 1;
+    } else if (ctx->spill_size == 0) {
+        return Z_STREAM_ERROR;
+    }
+    ctx->spill_len = ctx->spill_pos = 0;
+    ctx->spill_error = 0;
 
     switch( ctx->checksum_type ) {
       case TINF_CHKSUM_CRC:
@@ -155,97 +843,151 @@ int uzlib_deflate_init_stream(struct uzlib_comp* ctx, uzlib_stream* uzstream){
 
 
 
-int uzlib_deflate_stream(struct uzlib_stream* uzstream, int flush){
-    struct uzlib_comp* ctx = uzstream->ctx;
-
-    // some data is still pending in the output buffer
-    if(ctx->outbuf != NULL) {
-        if(uzstream->out.avail < ctx->outlen){
-            memcpy(uzstream->out.next, ctx->outbuf, uzstream->out.avail);
-            ctx->outbuf  += uzstream->out.avail;
-            ctx->outlen  -= uzstream->out.avail;
-            uzstream->out.next  += uzstream->out.avail;
-            uzstream->out.total += uzstream->out.avail;
-            uzstream->out.avail = 0;
-            return Z_OK;
+// Output span writer for stream mode: the span is uzlib_stream.out until it's full, then the free part of the spill buffer
+static unsigned int uzlib_stream_spill(struct uzlib_comp *ctx, __attribute__((unused)) const unsigned char *buf, unsigned int len)
+{
+    if (!ctx->spilling) {
+        ctx->direct_len = len; // already in place
+        ctx->spilling = 1;
+    } else {
+        ctx->spill_len += len;
+        if (ctx->spill_size - ctx->spill_len < 8) {
+            // only with a spill_size set below zlib_stream_spill_size() or chunks larger than the output span
+            // a caller provided buffer is left alone, the output moves to an owned one
+            unsigned char *p = ctx->spill_owned ? realloc(ctx->spill, ctx->spill_size * 2) : malloc(ctx->spill_size * 2);
+            if (p) {
+                if (!ctx->spill_owned)
+                    memcpy(p, ctx->spill, ctx->spill_len);
+                ctx->spill = p;
+                ctx->spill_size *= 2;
+                ctx->spill_owned = 1;
+            } else {
+                ctx->spill_error = 1;
+                ctx->spill_len = 0; // drop the output, uzlib_deflate_stream() will report the error
+            }
         }
+    }
+    ctx->outbuf  = ctx->spill + ctx->spill_len;
+    ctx->outsize = ctx->spill_size - ctx->spill_len;
+    return len;
+}
 
-        memcpy(uzstream->out.next, ctx->outbuf, ctx->outlen);
 
-        ctx->outbuf -= uzstream->out.total;
+// Copy pending spill bytes to uzlib_stream.out
+static void uzlib_stream_drain(struct uzlib_stream* uzstream)
+{
+    struct uzlib_comp* ctx = uzstream->ctx;
+    unsigned int len = ctx->spill_len - ctx->spill_pos;
+    if (len > uzstream->out.avail)
+        len = uzstream->out.avail;
+    memcpy(uzstream->out.next, ctx->spill + ctx->spill_pos, len);
+    ctx->spill_pos      += len;
+    uzstream->out.next  += len;
+    uzstream->out.avail -= len;
+    uzstream->out.total += len;
+    if (ctx->spill_pos == ctx->spill_len)
+        ctx->spill_pos = ctx->spill_len = 0;
+}
+
 
-        uzstream->out.avail -= ctx->outlen;
-        uzstream->out.next  += ctx->outlen;
-        uzstream->out.total += ctx->outlen;
+int uzlib_deflate_stream(struct uzlib_stream* uzstream, int flush){
+    struct uzlib_comp* ctx = uzstream->ctx;
 
-        free((void*)ctx->outbuf);
-        ctx->outbuf = NULL;
-        if(uzstream->in.avail == 0) return Z_OK;
+    // some data is still pending in the spill buffer
+    if(ctx->spill_len > 0) {
+        uzlib_stream_drain(uzstream);
+        if(ctx->spill_len > 0)
+            return Z_OK; // out is full, call again
     }
 
-    if(uzstream->in.avail == 0 && flush != Z_FINISH)
+    if(ctx->comp_disabled)
+        return Z_STREAM_END; // final block fully drained
+
+    if(uzstream->in.avail == 0 && flush == Z_NO_FLUSH)
         return Z_OK;
 
-    ctx->outlen   = 0;
-    ctx->outsize  = 0;
-    ctx->outbits  = 0;
-    ctx->noutbits = 0;
+    // compress straight into the caller's output span
+    ctx->grow_buffer    = 0;
+    ctx->writeDestBytes = uzlib_stream_spill;
+    ctx->outbuf         = uzstream->out.next;
+    ctx->outsize        = uzstream->out.avail;
+    ctx->outpos         = 0;
+    ctx->outlen         = 0; // outbits keeps the bits left pending by Z_NO_FLUSH or Z_PARTIAL_FLUSH
+    ctx->direct_len     = 0;
+    ctx->spilling       = 0;
 
     ctx->checksum = ctx->checksum_cb(uzstream->in.next, uzstream->in.avail, ctx->checksum);
 
     if(flush != Z_FINISH){
-        zlib_next_block(ctx);
-        uzlib_compress(ctx, uzstream->in.next, uzstream->in.avail);
-        zlib_empty_block(ctx);
+        if(!ctx->block_open)
+            zlib_next_block(ctx);
+        uzlib_compress_window(ctx, uzstream->in.next, uzstream->in.avail);
+        switch(flush) {
+            case Z_NO_FLUSH: // the block goes on in the next call, dynamic blocks keep their symbols
+                ctx->block_open = ctx->huff == NULL;
+                zlib_flush_output(ctx);
+                break;
+            case Z_PARTIAL_FLUSH:
+                ctx->block_open = 0;
+                zlib_partial_block(ctx, 0); // flushes the output span
+                break;
+            default: // Z_SYNC_FLUSH, Z_FULL_FLUSH, Z_BLOCK
+                ctx->block_open = 0;
+                zlib_empty_block(ctx); // flushes the output span
+                break;
+        }
+    } else if(ctx->block_open) {
+        // static block left open by Z_NO_FLUSH: the data goes in it, then an empty final block
+        uzlib_compress_window(ctx, uzstream->in.next, uzstream->in.avail);
+        zlib_partial_block(ctx, 1); // flushes the output span
+        ctx->block_open = 0;
+        ctx->comp_disabled = 1;
     } else {
         zlib_start_block(ctx);
-        uzlib_compress(ctx, uzstream->in.next, uzstream->in.avail);
-        zlib_finish_block(ctx);
+        uzlib_compress_window(ctx, uzstream->in.next, uzstream->in.avail);
+        zlib_finish_block(ctx); // flushes the output span
         ctx->comp_disabled = 1;
     }
 
-    uzstream->in.total += uzstream->in.avail;
-
-    uzstream->in.next += uzstream->in.avail;
-    uzstream->in.avail = 0;
-
-    // output buffer too small for output ?
-    if(uzstream->out.avail < ctx->outlen){
-        if(flush == Z_FINISH) {
-            free((void*)ctx->outbuf);
-            ctx->outbuf = NULL;
-            printf("gz buffer ERROR\n");
-            return Z_BUF_ERROR;
-        }
-        memcpy(uzstream->out.next, ctx->outbuf, uzstream->out.avail);
-        ctx->outbuf += uzstream->out.avail;
-        ctx->outlen -= uzstream->out.avail;
-        uzstream->out.next += uzstream->out.avail;
-        uzstream->out.total = uzstream->out.avail;
-        uzstream->out.avail = 0;
-        return Z_OK;
-    }
+    ctx->outbuf  = NULL; // the span belongs to the caller or to spill, never free it
+    ctx->outsize = 0;
 
-    memcpy(uzstream->out.next, ctx->outbuf, ctx->outlen);
+    if(ctx->spill_error)
+        return Z_MEM_ERROR;
 
-    if(flush == Z_FINISH) {
-        uzstream->out.total  = ctx->outlen;
-    } else {
-        uzstream->out.total += ctx->outlen;
-    }
+    uzstream->in.total += uzstream->in.avail;
+    uzstream->in.next  += uzstream->in.avail;
+    uzstream->in.avail = 0;
 
-    uzstream->out.avail -= ctx->outlen;
-    uzstream->out.next  += ctx->outlen;
+    uzstream->out.next  += ctx->direct_len;
+    uzstream->out.avail -= ctx->direct_len;
+    uzstream->out.total += ctx->direct_len;
 
-    free((void*)ctx->outbuf);
-    ctx->outbuf = NULL;
+    // the direct span may have a few unused bytes left when it overflowed
+    if(ctx->spill_len > 0)
+        uzlib_stream_drain(uzstream);
 
     if( ctx->progress_cb && uzstream->in.total<=ctx->slen)
         ctx->progress_cb(uzstream->in.total, ctx->slen);
 
+    if(ctx->spill_len > 0)
+        return Z_OK; // out is full, call again to drain the rest
+
     return flush == Z_FINISH ? Z_STREAM_END : Z_OK;
 }
 
 
+int uzlib_deflate_end_stream(struct uzlib_comp* ctx){
+    if (ctx == Z_NULL)
+        return Z_STREAM_ERROR;
+    if (ctx->spill_owned)
+        free(ctx->spill);
+    ctx->spill = NULL;
+    ctx->spill_size = ctx->spill_len = ctx->spill_pos = 0;
+    ctx->spill_owned = 0;
+    return Z_OK;
+}
+
+
 #pragma GCC diagnostic pop
 
@@ -88,10 +88,28 @@ int uzlib_gzip_parse_header(TINF_DATA *d)
     /* skip rest of base header of 10 bytes */
     tinf_skip_bytes(d, 6);
 
-    /* skip extra data if present */
+    d->filter_id = UZLIB_FILTER_NONE;
+    d->filter_param = 0;
+
+    /* skip extra data if present, except the pre-compression filter subfield */
     if (flg & FEXTRA)
     {
        unsigned int xlen = tinf_get_uint16(d);
+       while (xlen >= 4) {
+          unsigned char si1 = uzlib_get_byte(d);
+          unsigned char si2 = uzlib_get_byte(d);
+          unsigned int len = tinf_get_uint16(d);
+          xlen -= 4;
+          if (len > xlen)
+             len = xlen;
+          xlen -= len;
+          if (si1 == UZLIB_FILTER_SI1 && si2 == UZLIB_FILTER_SI2 && len >= 2) {
+             d->filter_id = uzlib_get_byte(d);
+             d->filter_param = uzlib_get_byte(d);
+             len -= 2;
+          }
+          tinf_skip_bytes(d, len);
+       }
        tinf_skip_bytes(d, xlen);
     }
 
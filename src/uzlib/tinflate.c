@@ -33,6 +33,7 @@
  */
 
 #include <assert.h>
+#include <string.h>
 #include "uzlib.h"
 
 #define UZLIB_DUMP_ARRAY(heading, arr, size) \
@@ -627,6 +628,23 @@ void uzlib_uncompress_init(TINF_DATA *d, void *dict, unsigned int dictLen)
    d->readSourceErrors = 0;
 }
 
+/* prime the dict ring with a preset dictionary (its last dict_size bytes), so
+   the first blocks can reference it. Back references are only read from the
+   ring, there's nothing to prime without it */
+int uzlib_uncompress_dict(TINF_DATA *d, const void *dict, unsigned int dictLen)
+{
+   const unsigned char *p = dict;
+   if (d->dict_ring == NULL)
+      return TINF_DICT_ERROR;
+   if (dictLen > d->dict_size) {
+      p += dictLen - d->dict_size;
+      dictLen = d->dict_size;
+   }
+   memcpy(d->dict_ring, p, dictLen);
+   d->dict_idx = dictLen == d->dict_size ? 0 : dictLen;
+   return TINF_OK;
+}
+
 /* inflate next output bytes from compressed stream */
 int uzlib_uncompress(TINF_DATA *d)
 {
@@ -31,6 +31,10 @@
  *
  * 3. This notice may not be removed or altered from
  *    any source distribution.
+ *
+ *
+ * Edited by Tobozo for ESP32-targz
+ *  - Preset dictionary id is parsed instead of rejected
  */
 
 #include "uzlib.h"
@@ -57,8 +61,14 @@ int uzlib_zlib_parse_header(TINF_DATA *d)
    /* check window size is valid */
    if ((cmf >> 4) > 7) return TINF_DATA_ERROR;
 
-   /* check there is no preset dictionary */
-   if (flg & 0x20) return TINF_DATA_ERROR;
+   /* preset dictionary: keep its id, the caller must provide it (see uzlib_uncompress_dict) */
+   d->dict_id = 0;
+   if (flg & 0x20) {
+      d->dict_id  = (uint32_t)uzlib_get_byte(d) << 24;
+      d->dict_id |= (uint32_t)uzlib_get_byte(d) << 16;
+      d->dict_id |= (uint32_t)uzlib_get_byte(d) << 8;
+      d->dict_id |= uzlib_get_byte(d);
+   }
 
    /* initialize for adler32 checksum */
    d->checksum_type = TINF_CHKSUM_ADLER;
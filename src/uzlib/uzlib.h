@@ -10,6 +10,15 @@
  * Edited by Tobozo for ESP32-targz
  *  - Added logging to inflate
  *  - Added stream support to deflate
+ *  - Added dynamic huffman blocks to deflate
+ *  - Added hash chains, lazy matching and compression levels to deflate
+ *  - Added adaptive stored blocks for incompressible input
+ *  - Added preset dictionary support (zlib FDICT) to inflate and deflate
+ *  - Added Z_NO_FLUSH, Z_PARTIAL_FLUSH and Z_SYNC_FLUSH to stream deflate
+ *  - Stream deflate input can be any size, without a window it's compressed in place
+ *  - Added optimal parsing (level 10) to deflate
+ *  - Added Z_RLE and Z_HUFFMAN_ONLY strategies to deflate
+ *  - Added delta and BCJ pre-compression filters, recorded in the gzip FEXTRA field
  *
  */
 
@@ -120,6 +129,11 @@ typedef struct TINF_DATA  {
     unsigned char *dict_ring;
     unsigned int dict_size;
     unsigned int dict_idx;
+    /* zlib preset dictionary id (adler32 of the dictionary) when FDICT is set, see uzlib_uncompress_dict() */
+    unsigned int dict_id;
+    /* pre-compression filter found in the gzip FEXTRA field (UZLIB_FILTER_*) and its parameter */
+    unsigned char filter_id;
+    unsigned char filter_param;
 
     TINF_TREE ltree; /* dynamic length/symbol tree */
     TINF_TREE dtree; /* dynamic distance tree */
@@ -140,6 +154,8 @@ void TINFCC uzlib_init(void);
 void TINFCC uzlib_uncompress_init(TINF_DATA *d, void *dict, unsigned int dictLen);
 int  TINFCC uzlib_uncompress(TINF_DATA *d);
 int  TINFCC uzlib_uncompress_chksum(TINF_DATA *d);
+/* prime the dict ring with a preset dictionary, after uzlib_uncompress_init() */
+int  TINFCC uzlib_uncompress_dict(TINF_DATA *d, const void *dict, unsigned int dictLen);
 
 int TINFCC uzlib_zlib_parse_header(TINF_DATA *d);
 int TINFCC uzlib_gzip_parse_header(TINF_DATA *d);
@@ -154,6 +170,9 @@ int TINFCC uzlib_gzip_parse_header(TINF_DATA *d);
 #define Z_FINISH        4
 #define Z_BLOCK         5
 #define Z_TREES         6
+#define Z_DEFAULT_STRATEGY 0
+#define Z_HUFFMAN_ONLY     2
+#define Z_RLE              3
 #define Z_NULL          0
 #define Z_OK            0
 #define Z_STREAM_END    1
@@ -166,11 +185,12 @@ int TINFCC uzlib_gzip_parse_header(TINF_DATA *d);
 
 typedef const uint8_t *uzlib_hash_entry_t;
 
+struct uzlib_huff; // dynamic huffman block state, see zlib_huff_init()
 
 struct uzlib_comp {
     unsigned char *outbuf;
     int outlen, outsize;
-    unsigned long outbits;
+    uint64_t outbits;
     int noutbits;
     int comp_disabled;
 
@@ -188,12 +208,56 @@ struct uzlib_comp {
     void (*progress_cb)( size_t progress, size_t total );
     // output stream byte writer
     unsigned int (*writeDestByte)(struct uzlib_comp *data, unsigned char byte);
+    // output stream chunk writer, called when the fixed size output span (outbuf, outsize) is full, see zlib_flush_output()
+    unsigned int (*writeDestBytes)(struct uzlib_comp *data, const unsigned char *buf, unsigned int len);
+    int outpos; // bytes pending in the output span when writeDestBytes is set
 
     char checksum_type; // crc32 or adler32
-    char grow_buffer; // 1 = enables realloc() in outbits() and out4bytes() functions
+    char grow_buffer; // 1 = enables (geometric) realloc() in outbits() and out4bytes() functions
     char is_stream; // 1 = disables calling progress_cb() from uzlib_compress()
     unsigned char reserved[1];
 
+    // optional symbol buffer for dynamic huffman blocks, NULL = static huffman blocks only
+    struct uzlib_huff *huff;
+
+    // optional sliding window for stream mode, NULL = each uzlib_deflate_stream() chunk is compressed independently
+    unsigned char *window;
+    unsigned int window_size; // allocated bytes, should be dict_size + largest chunk size
+    unsigned int window_len;  // bytes currently in window
+    const unsigned char *match_floor; // matches can't reach below this address, NULL = no limit (set per chunk without a window)
+
+    // match finder settings, see uzlib_deflate_level(), all zeroes = greedy single candidate
+    uint16_t *hash_prev;          // optional hash chains: distance to the previous position with the same hash, NULL = no chains
+    unsigned int prev_bits;       // hash_prev has (1 << prev_bits) entries, chained candidates are searched that far back
+    unsigned short max_chain;     // candidates to try per position
+    unsigned short good_length;   // search less when the previous match is at least that long
+    unsigned short nice_length;   // stop searching when a match is at least that long
+    unsigned short max_lazy;      // lazy: don't look for a better match above that length, greedy: insert matches up to that length in the hash
+    char lazy;                    // 1 = lazy match evaluation
+    char store_only;              // 1 = level 0, no matching, stored blocks (needs the symbol buffer)
+    unsigned char optimal;        // level 10: optimal parsing passes over a cost model, 0 = off (slow, for offline builds)
+    char strategy;                // Z_DEFAULT_STRATEGY, Z_RLE (distance 1 matches only) or Z_HUFFMAN_ONLY (literals only), the last two need no hash table
+
+    // adaptive mode: segments of input with few matches (already compressed data) and the ones following
+    // them are sent as literals without searching for matches, the block writer stores them, see uzlib_compress()
+    char adaptive;                // 1 = enabled (needs the symbol buffer)
+    unsigned char skip_run;       // segments to skip after the next incompressible sample
+    unsigned short skip_count;    // segments left to skip before sampling again
+    size_t stored_bytes;          // input bytes sent in stored blocks
+    size_t compressed_bytes;      // input bytes sent in huffman blocks
+
+    // stream mode output is written straight to uzlib_stream.out, the excess is kept in this spill buffer
+    // until the next uzlib_deflate_stream() calls drain it
+    unsigned char *spill;         // allocated by uzlib_deflate_init_stream() when NULL, or caller provided (spill_size bytes)
+    unsigned int spill_size;      // 0 = zlib_stream_spill_size(), can be set before uzlib_deflate_init_stream(), grows if a chunk overflows it
+    unsigned int spill_len;       // bytes in spill
+    unsigned int spill_pos;       // bytes of spill already drained
+    unsigned int direct_len;      // bytes written to uzlib_stream.out by the current call
+    char spilling;                // 1 = uzlib_stream.out is full, output goes to spill
+    char spill_error;             // 1 = spill buffer could not grow, output is lost
+    char spill_owned;             // 1 = spill is freed by uzlib_deflate_end_stream(), a caller provided one is never freed nor reallocated
+    char block_open;              // 1 = a static block left open by Z_NO_FLUSH continues in the next call
+
 };
 
 
@@ -213,17 +277,58 @@ typedef struct uzlib_stream {
 
 
 void TINFCC uzlib_compress(struct uzlib_comp *c, const uint8_t *src, unsigned slen);
+void TINFCC uzlib_compress_dict(struct uzlib_comp *c, const uint8_t *dict, unsigned dlen);
+void TINFCC uzlib_compress_dict_save(struct uzlib_comp *c, const uint8_t *dict, unsigned dlen, uint16_t *heads, uint16_t *chains);
+void TINFCC uzlib_compress_dict_restore(struct uzlib_comp *c, const uint8_t *dict, unsigned dlen, const uint16_t *heads, const uint16_t *chains, unsigned mlen);
+int TINFCC uzlib_deflate_level(struct uzlib_comp *c, int level);
+// working memory allocated by each level 10 compression call for slen input bytes (UZLIB_OPTIMAL_SEGMENT at most)
+unsigned int TINFCC uzlib_optimal_size(unsigned int slen);
 int TINFCC uzlib_deflate_init_stream(struct uzlib_comp* ctx, uzlib_stream* strm);
+// flush: Z_NO_FLUSH keeps the pending block open (best ratio, output comes when the block is emitted),
+// Z_PARTIAL_FLUSH emits everything with an empty static block (not byte aligned), Z_SYNC_FLUSH and
+// Z_BLOCK emit everything and byte align with an empty stored block, Z_FINISH ends the stream
 int TINFCC uzlib_deflate_stream(struct uzlib_stream* strm, int flush);
+int TINFCC uzlib_deflate_end_stream(struct uzlib_comp* ctx);
 
 #include "defl_static.h"
 
+/* Filter API */
+
+// reversible transforms applied before deflate and undone after inflate, the filter id and
+// its parameter are stored in a gzip FEXTRA subfield: 'T' 'F' LEN=2 id param
+#define UZLIB_FILTER_NONE      0
+#define UZLIB_FILTER_DELTA     1 // param = stride - 1 (stride 1-256 bytes)
+#define UZLIB_FILTER_XTENSA    2 // CALL8 (windowed ABI: ESP32, ESP32-S2, ESP32-S3)
+#define UZLIB_FILTER_RISCV     3 // JAL ra (ESP32-C3, ESP32-C6, ESP32-H2, ESP32-P4)
+#define UZLIB_FILTER_ARM_THUMB 4 // BL (RP2040, Teensy)
+#define UZLIB_FILTER_SI1       'T'
+#define UZLIB_FILTER_SI2       'F'
+#define UZLIB_FILTER_LOOKAHEAD 3 // max bytes held back by uzlib_filter() until the next call
+
+struct uzlib_filter {
+    unsigned char id;
+    unsigned char encode;        // 1 = before deflate, 0 = after inflate
+    unsigned short stride;       // delta distance
+    unsigned short idx;          // delta position in history
+    unsigned char blocked;       // xtensa: next positions that can't start a call
+    uint32_t pos;                // stream offset of the next byte to filter (instruction address for BCJ)
+    unsigned char history[256];  // delta: last stride bytes of the unfiltered data
+};
+
+// param is the FEXTRA parameter byte, returns -1 for an unknown filter or parameter
+int TINFCC uzlib_filter_init(struct uzlib_filter *f, int id, int param, int encode);
+// filters buf in place, returns how many bytes are done: the others start an instruction cut by the
+// end of buf and must be passed again at the start of the next call, final = 1 filters everything
+size_t TINFCC uzlib_filter(struct uzlib_filter *f, unsigned char *buf, size_t len, int final);
+
 /* Checksum API */
 
 /* prev_sum is previous value for incremental computation, 1 initially */
 uint32_t TINFCC uzlib_adler32(const void *data, unsigned int length, uint32_t prev_sum);
 /* crc is previous value for incremental computation, 0xffffffff initially */
 uint32_t TINFCC uzlib_crc32(const void *data, unsigned int length, uint32_t crc);
+/* crc of two concatenated blocks, from their final crcs and the length of the second one */
+uint32_t TINFCC uzlib_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -19,4 +19,28 @@
 #define UZLIB_CONF_PARANOID_CHECKS 0
 #endif
 
+#ifndef UZLIB_STREAM_SPILL_SIZE
+/* Minimal size of the buffer holding uzlib_deflate_stream() output that
+   doesn't fit in the caller's output buffer, it's enlarged to cover a
+   block of the symbol buffer (see zlib_stream_spill_size()). */
+#define UZLIB_STREAM_SPILL_SIZE 1024
+#endif
+
+#ifndef UZLIB_ADAPTIVE_SEGMENT
+/* Adaptive mode sample size: uzlib_compress() checks the match rate of
+   each segment of that many input bytes to detect incompressible data. */
+#define UZLIB_ADAPTIVE_SEGMENT 4096
+#endif
+
+#ifndef UZLIB_ADAPTIVE_MAX_SKIP
+/* Adaptive mode: max segments stored without matching before sampling again. */
+#define UZLIB_ADAPTIVE_MAX_SKIP 16
+#endif
+
+#ifndef UZLIB_OPTIMAL_SEGMENT
+/* Optimal parsing (level 10): input bytes parsed together, about 48 bytes
+   of working memory per byte are allocated for the duration of a call. */
+#define UZLIB_OPTIMAL_SEGMENT 32768
+#endif
+
 #endif /* UZLIB_CONF_H_INCLUDED */